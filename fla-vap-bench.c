@@ -0,0 +1,248 @@
+/**********************************************************************
+Reference validation benchmark of the heating and evaporation model in
+fla-vap.c, run outside ANSYS Fluent.
+
+The production kernel vap_heat_mass() is integrated with the same time step
+(DPM_DT) and the same property functions as in the UDF for
+1. a single droplet in a hot quiescent/slow gas and
+2. a monodisperse droplet cloud, where the droplets cool the gas.
+For every case the d^2 and temperature histories are written and, if a
+digitized reference curve is given, compared with it. Wall time per case is
+reported, so every change of the kernels can be checked against the physics
+of Zaripov, Rybdylova & Sazhin (2018).
+
+Build (the fluid is selected as in fla-vap.c, n-dodecane by default):
+    cc -O2 -o fla-vap-bench fla-vap-bench.c -lm
+    cc -O2 -DWATER -o fla-vap-bench-water fla-vap-bench.c -lm
+    cc -O2 -DISOOCTANE -o fla-vap-bench-isooctane fla-vap-bench.c -lm
+Usage:
+    fla-vap-bench [-r refdir] [-o outdir] [-n repeats] [-s stride]
+With -s the series is evaluated on every stride-th layer only (vap_res.stride),
+to compare layer counts, e.g. of the uniform and the clustered grid
+(VAP_GRID_CLUSTER), against histories written with -o at stride 1.
+Reference curves are read from refdir/<fluid>_<case>.csv, one point per line:
+    t [s], d^2/d0^2, T_s [K]
+Lines starting with '#' are skipped. Histories are written to
+outdir/<fluid>_<case>.csv in the same format plus T_av and T_gas.
+
+Copyright (C) 2018 Oyuna Rybdylova, Timur Zaripov - All Rights Reserved
+You may use, distribute and modify this code under the terms of the MIT license
+***********************************************************************/
+#define FLA_VAP_STANDALONE
+#include "fla-vap.c"
+
+#include "fla-vap-offline.h"
+
+#define MAX_HIST 200000
+
+typedef struct bench_case_s {
+    const char *name;
+    real d0;      // initial diameter, m
+    real T0;      // initial droplet temperature, K
+    real T_g;     // initial gas temperature, K
+    real p_g;     // pressure, Pa
+    real u_rel;   // gas velocity relative to the droplets, m/s
+    real n_d;     // droplet number density, 1/m^3 (0 for a single droplet)
+    real t_end;   // s
+} bench_case_t;
+
+// Edit the table to add cases; names are used for the reference/output files.
+static const bench_case_t cases[] = {
+    // name      d0        T0     T_g    p_g     u_rel n_d     t_end
+    { "single", 20.e-6,  300.0, 880.0, 3.0e6,  1.0,  0.0,    20.e-3 },
+    { "cloud",  20.e-6,  300.0, 880.0, 3.0e6,  1.0,  1.e11,  20.e-3 },
+};
+
+typedef struct bench_hist_s {
+    int n;
+    real t[MAX_HIST];
+    real d2[MAX_HIST];   // (d/d0)^2
+    real Ts[MAX_HIST];
+    real T_av[MAX_HIST];
+    real T_g[MAX_HIST];
+} bench_hist_t;
+
+static bench_hist_t hist;
+static bench_hist_t ref;
+
+// Integrates one case with DPM_DT until the history ends (see
+// offline_history_step()) or t_end is reached; the end in *end. Returns the
+// number of particle steps.
+static int bench_run(const bench_case_t *bc, bench_hist_t *h, offline_history_t *end)
+{
+    offline_droplet_t dr;
+    offline_droplet_init(&dr, bc->d0, bc->T0);
+    offline_history_init(end);
+    real T_g = bc->T_g;
+    real t = 0.0;
+
+    h->n = 0;
+    while (t < bc->t_end && h->n < MAX_HIST) {
+        h->t[h->n] = t;
+        h->d2[h->n] = dr.d*dr.d / (bc->d0*bc->d0);
+        h->Ts[h->n] = dr.s.T[N_INT];
+        h->T_av[h->n] = dr.s.T_av;
+        h->T_g[h->n] = T_g;
+        h->n++;
+
+        // density and c_p of the gas before the step, for the cooling by the cloud
+        real mu_g, k_g, cp_g;
+        air_properties(T_g, &mu_g, &k_g, &cp_g);
+        real rho_g = bc->p_g / (R_AIR*T_g);
+        vap_rates_t r;
+        if (offline_history_step(end, &dr, bc->d0, T_g, bc->p_g, bc->u_rel, DPM_DT, &r) != OFFLINE_ALIVE) {
+            break;
+        }
+        // the cloud cools the gas, see dzdt->energy in multivap_conv_diffusion_new
+        T_g -= bc->n_d*r.dh_dt*DPM_DT / (rho_g*cp_g);
+        t += DPM_DT;
+    }
+    return end->n;
+}
+
+// Reads t, d2, Ts triples; returns the number of points or -1.
+static int read_reference(const char *path, bench_hist_t *r)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    char line[256];
+    r->n = 0;
+    while (fgets(line, sizeof(line), f) != NULL && r->n < MAX_HIST) {
+        double t, d2, Ts;
+        if (line[0] == '#') {
+            continue;
+        }
+        if (sscanf(line, "%lf , %lf , %lf", &t, &d2, &Ts) == 3) {
+            r->t[r->n] = t; r->d2[r->n] = d2; r->Ts[r->n] = Ts;
+            r->n++;
+        }
+    }
+    fclose(f);
+    return r->n;
+}
+
+// Linear interpolation of y(t) on the history.
+static real interpolate(const bench_hist_t *h, const real y[], real t)
+{
+    if (t <= h->t[0]) {
+        return y[0];
+    }
+    for (int i = 1; i < h->n; i++) {
+        if (t <= h->t[i]) {
+            real w = (t - h->t[i - 1]) / (h->t[i] - h->t[i - 1]);
+            return (1.0 - w)*y[i - 1] + w*y[i];
+        }
+    }
+    return y[h->n - 1];
+}
+
+static void write_history(const char *path, const bench_hist_t *h)
+{
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        Message("Cannot write %s\n", path);
+        return;
+    }
+    fprintf(f, "# t [s], d^2/d0^2, T_s [K], T_av [K], T_gas [K]\n");
+    for (int i = 0; i < h->n; i++) {
+        fprintf(f, "%e, %e, %e, %e, %e\n", h->t[i], h->d2[i], h->Ts[i], h->T_av[i], h->T_g[i]);
+    }
+    fclose(f);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *refdir = NULL;
+    const char *outdir = NULL;
+    int repeats = 5;
+    int stride = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            refdir = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            outdir = argv[++i];
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            repeats = atoi(argv[++i]);
+            repeats = MAX(1, repeats);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            stride = atoi(argv[++i]);
+        } else {
+            Message("Usage: %s [-r refdir] [-o outdir] [-n repeats] [-s stride]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (stride < 1 || N_INT % (2*stride) != 0) {
+        Message("N_INT / stride has to be even\n");
+        return EXIT_FAILURE;
+    }
+    vap_res.stride = stride;
+
+    vap_dispatch_init(0);
+#ifdef VAP_GRID_CLUSTER
+    const char *grid = "clustered";
+#else
+    const char *grid = "uniform";
+#endif
+    Message("fluid: %s, N_Lambda = %d, N_INT = %d (%s, stride %d), DPM_DT = %g\n", FLUID_NAME, N_Lambda, N_INT,
+            grid, stride, DPM_DT);
+    Message("%-8s %-10s %10s %10s %10s %8s %12s %12s %10s %10s %10s %10s\n", "case", "end", "t_end", "Ts_max",
+            "Tg_end", "steps", "wall [s]", "us/step", "d2 rms", "d2 max", "Ts rms", "Ts max");
+    for (size_t k = 0; k < sizeof(cases) / sizeof(cases[0]); k++) {
+        const bench_case_t *bc = &cases[k];
+        char path[1024];
+
+        // best of several repeats for the timing
+        int steps = 0;
+        offline_history_t end;
+        double best = 1.e30;
+        for (int rep = 0; rep < repeats; rep++) {
+            double t0 = vap_wtime();
+            steps = bench_run(bc, &hist, &end);
+            best = MIN(best, vap_wtime() - t0);
+        }
+
+        real Ts_max = 0.0;
+        for (int i = 0; i < hist.n; i++) {
+            Ts_max = MAX(Ts_max, hist.Ts[i]);
+        }
+
+        char err[64] = "       n/a        n/a        n/a        n/a";
+        if (refdir != NULL) {
+            snprintf(path, sizeof(path), "%s/%s_%s.csv", refdir, FLUID_NAME, bc->name);
+            if (read_reference(path, &ref) > 0) {
+                real d2_rms = 0.0, d2_max = 0.0, Ts_rms = 0.0, Ts_max_err = 0.0;
+                int n = 0;
+                for (int i = 0; i < ref.n; i++) {
+                    if (ref.t[i] > hist.t[hist.n - 1]) {
+                        break;
+                    }
+                    real e_d2 = fabs(interpolate(&hist, hist.d2, ref.t[i]) - ref.d2[i]);
+                    real e_Ts = fabs(interpolate(&hist, hist.Ts, ref.t[i]) - ref.Ts[i]);
+                    d2_rms += e_d2*e_d2; d2_max = MAX(d2_max, e_d2);
+                    Ts_rms += e_Ts*e_Ts; Ts_max_err = MAX(Ts_max_err, e_Ts);
+                    n++;
+                }
+                if (n > 0) {
+                    snprintf(err, sizeof(err), "%10.3e %10.3e %10.3f %10.3f",
+                             sqrt(d2_rms / n), d2_max, sqrt(Ts_rms / n), Ts_max_err);
+                }
+            } else {
+                Message("No reference curve %s\n", path);
+            }
+        }
+
+        // t_end of a history that outlived the case is the last sample
+        real t_end = end.end != OFFLINE_ALIVE ? end.t_end : hist.t[hist.n - 1];
+        Message("%-8s %-10s %10.4e %10.2f %10.2f %8d %12.4e %12.3f %s\n", bc->name, offline_history_end_name(end.end),
+                t_end, Ts_max, hist.T_g[hist.n - 1], steps, best, 1.e6*best / MAX(steps, 1), err);
+
+        if (outdir != NULL) {
+            snprintf(path, sizeof(path), "%s/%s_%s.csv", outdir, FLUID_NAME, bc->name);
+            write_history(path, &hist);
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,394 @@
+/**********************************************************************
+Calibration of the property correlations of fla-vap.c against measured
+single-droplet histories, run outside ANSYS Fluent.
+
+The fitted coefficients are the multipliers of the property correlations
+(vap_prop_scale_t, as in fla-vap-uq.c), selected with -p; the default pair
+is the vapour c_p (constant for iso-octane, see the FIXME) and the liquid
+c_p (the iso-octane correlation is that of n-dodecane). Every candidate set
+integrates the droplet histories of all experiments with the production
+kernel vap_heat_mass() and DPM_DT, and is scored by
+    J = sum over experiments of mean((d2 - d2_exp)^2) / sigma_d2^2
+                              + mean((T_s - T_s,exp)^2) / sigma_Ts^2
+at the measured times. A history that ends early (evaporated, or the surface
+at the boiling point) is continued with d2 = 0 and its last T_s.
+The optimizer is differential evolution (DE/rand/1/bin) on the logarithms of
+the multipliers within [1/bound, bound]. The trial vectors of a generation
+are independent, so they are evaluated concurrently, split into blocks, one
+per thread.
+
+Experiments are given as -e d0,T0,T_g,p_g,u_rel,file: initial diameter [m]
+and temperature [K], gas temperature [K], pressure [Pa], slip velocity [m/s]
+and a history in the format of the fla-vap-bench.c references:
+    t [s], d^2/d0^2, T_s [K]
+Without -e a synthetic experiment is fitted: the "single" case of
+fla-vap-bench.c integrated with all selected multipliers at -s, which the fit
+should recover.
+
+Build (the fluid is selected as in fla-vap.c, n-dodecane by default):
+    cc -O2 -pthread -DISOOCTANE -o fla-vap-calib fla-vap-calib.c -lm
+Usage:
+    fla-vap-calib [-e d0,T0,T_g,p_g,u_rel,file]... [-p coef,coef,...] [-t threads]
+                  [-n population] [-g generations] [-b bound] [-s synthetic]
+
+Copyright (C) 2018 Oyuna Rybdylova, Timur Zaripov - All Rights Reserved
+You may use, distribute and modify this code under the terms of the MIT license
+***********************************************************************/
+#define FLA_VAP_STANDALONE
+#define VAP_PROP_UQ
+#include "fla-vap.c"
+
+#include "fla-vap-offline.h"
+
+#include <pthread.h>
+
+#define CAL_MAX_EXP   (16)
+#define CAL_MAX_POINTS (4096)
+#define CAL_N_COEF    ((int)(sizeof(vap_prop_scale_t) / sizeof(real)))
+#define CAL_SIGMA_D2  (0.01)   // weight of the d^2 residuals
+#define CAL_SIGMA_TS  (1.0)    // weight of the T_s residuals, K
+#define CAL_F         (0.7)    // DE differential weight
+#define CAL_CR        (0.9)    // DE crossover probability
+
+static const char *coef_name[] = { "p_sat", "c_v", "D", "L", "rho_l", "mu_l", "k_l", "c_l" };
+
+typedef struct cal_exp_s {
+    real d0, T0, T_g, p_g, u_rel;
+    int n;
+    real t[CAL_MAX_POINTS];
+    real d2[CAL_MAX_POINTS];
+    real Ts[CAL_MAX_POINTS];
+} cal_exp_t;
+
+typedef struct cal_worker_s {
+    pthread_t id;
+    int first, last;
+} cal_worker_t;
+
+static struct {
+    int n_exp;
+    cal_exp_t exp[CAL_MAX_EXP];
+    int n_fit;
+    int fit[CAL_N_COEF];    // indices of the fitted multipliers in vap_prop_scale_t
+    int n_pop, n_gen, n_threads;
+    real log_bound;
+    real *x;                // population, n_pop x n_fit logarithms of the multipliers
+    real *trial;
+    real *J, *J_trial;
+    cal_worker_t *workers;
+} cal;
+
+// Uniform number in [0, 1) from the state of the generator.
+static real uniform(uint64_t *state)
+{
+    *state = splitmix64(*state);
+    return offline_uniform(*state);
+}
+
+// Multipliers of the candidate with the logarithms x of the fitted ones.
+static void candidate_scale(const real x[], vap_prop_scale_t *sc)
+{
+    real *f = &sc->p_sat;
+    for (int k = 0; k < CAL_N_COEF; k++) {
+        f[k] = 1.0;
+    }
+    for (int i = 0; i < cal.n_fit; i++) {
+        f[cal.fit[i]] = exp(x[i]);
+    }
+}
+
+// History of experiment e with the multipliers in vap_prop, sampled at the
+// measured times into d2[] and Ts[]. Returns the number of points before the
+// end of the history, or -1 if the surface balance of a step did not converge.
+static int history(const cal_exp_t *e, real d2[], real Ts[])
+{
+    offline_droplet_t dr;
+    offline_droplet_init(&dr, e->d0, e->T0);
+    offline_history_t h;
+    offline_history_init(&h);
+
+    real d2_old = 1.0, Ts_old = e->T0;
+    int i = 0;
+    while (i < e->n) {
+        real t = h.n*DPM_DT;
+        real d2_new = dr.m > 0.0 ? dr.d*dr.d / (e->d0*e->d0) : 0.0;
+        real Ts_new = dr.s.T[N_INT];
+        // measured times up to t, interpolated within the last step
+        while (i < e->n && e->t[i] <= t) {
+            real w = t > 0.0 ? MAX(0.0, 1.0 - (t - e->t[i]) / DPM_DT) : 1.0;
+            d2[i] = (1.0 - w)*d2_old + w*d2_new;
+            Ts[i] = (1.0 - w)*Ts_old + w*Ts_new;
+            i++;
+        }
+        d2_old = d2_new;
+        Ts_old = Ts_new;
+        if (h.end != OFFLINE_ALIVE) {
+            break;
+        }
+        vap_rates_t r;
+        if (offline_history_step(&h, &dr, e->d0, e->T_g, e->p_g, e->u_rel, DPM_DT, &r) == OFFLINE_FAILED) {
+            break;
+        }
+    }
+    int n = i;
+    for (; i < e->n; i++) {
+        d2[i] = 0.0;
+        Ts[i] = Ts_old;
+    }
+    return h.end == OFFLINE_FAILED ? -1 : n;
+}
+
+// Objective of the candidate x; rms_d2 and rms_Ts per experiment if not NULL.
+// A candidate whose surface balance does not converge in some history gets
+// 1e30, as a non-finite one.
+static real objective(const real x[], real rms_d2[], real rms_Ts[])
+{
+    candidate_scale(x, &vap_prop);
+    real J = 0.0;
+    int failed = 0;
+    real d2[CAL_MAX_POINTS], Ts[CAL_MAX_POINTS];
+    for (int k = 0; k < cal.n_exp; k++) {
+        const cal_exp_t *e = &cal.exp[k];
+        failed = failed || history(e, d2, Ts) < 0;
+        real s_d2 = 0.0, s_Ts = 0.0;
+        for (int i = 0; i < e->n; i++) {
+            s_d2 += (d2[i] - e->d2[i])*(d2[i] - e->d2[i]);
+            s_Ts += (Ts[i] - e->Ts[i])*(Ts[i] - e->Ts[i]);
+        }
+        s_d2 /= MAX(e->n, 1);
+        s_Ts /= MAX(e->n, 1);
+        J += s_d2 / (CAL_SIGMA_D2*CAL_SIGMA_D2) + s_Ts / (CAL_SIGMA_TS*CAL_SIGMA_TS);
+        if (rms_d2 != NULL) {
+            rms_d2[k] = sqrt(s_d2);
+            rms_Ts[k] = sqrt(s_Ts);
+        }
+    }
+    return isfinite(J) && !failed ? J : 1.e30;
+}
+
+// Worker k evaluates the trial vectors [first, last) of the generation.
+static void *worker(void *arg)
+{
+    cal_worker_t *w = arg;
+    for (int i = w->first; i < w->last; i++) {
+        cal.J_trial[i] = objective(&cal.trial[i*cal.n_fit], NULL, NULL);
+    }
+    return NULL;
+}
+
+static void evaluate_trials(void)
+{
+    for (int k = 0; k < cal.n_threads; k++) {
+        pthread_create(&cal.workers[k].id, NULL, worker, &cal.workers[k]);
+    }
+    for (int k = 0; k < cal.n_threads; k++) {
+        pthread_join(cal.workers[k].id, NULL);
+    }
+}
+
+// Trial vectors of a generation (DE/rand/1/bin), clipped to the bounds.
+static void make_trials(uint64_t *rng)
+{
+    int n = cal.n_fit;
+    for (int i = 0; i < cal.n_pop; i++) {
+        int a, b, c;
+        do { a = (int)(uniform(rng)*cal.n_pop); } while (a == i);
+        do { b = (int)(uniform(rng)*cal.n_pop); } while (b == i || b == a);
+        do { c = (int)(uniform(rng)*cal.n_pop); } while (c == i || c == a || c == b);
+        int forced = (int)(uniform(rng)*n);
+        real *y = &cal.trial[i*n];
+        for (int k = 0; k < n; k++) {
+            if (k == forced || uniform(rng) < CAL_CR) {
+                y[k] = cal.x[a*n + k] + CAL_F*(cal.x[b*n + k] - cal.x[c*n + k]);
+                y[k] = MIN(MAX(y[k], -cal.log_bound), cal.log_bound);
+            } else {
+                y[k] = cal.x[i*n + k];
+            }
+        }
+    }
+}
+
+// Parses -e d0,T0,T_g,p_g,u_rel,file and reads the history.
+static int read_experiment(const char *arg, cal_exp_t *e)
+{
+    char path[1024];
+    double v[5];
+    if (sscanf(arg, "%lf,%lf,%lf,%lf,%lf,%1023s", &v[0], &v[1], &v[2], &v[3], &v[4], path) != 6) {
+        return -1;
+    }
+    e->d0 = v[0]; e->T0 = v[1]; e->T_g = v[2]; e->p_g = v[3]; e->u_rel = v[4];
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    char line[256];
+    e->n = 0;
+    while (fgets(line, sizeof(line), f) != NULL && e->n < CAL_MAX_POINTS) {
+        double t, d2, Ts;
+        if (line[0] == '#') {
+            continue;
+        }
+        if (sscanf(line, "%lf , %lf , %lf", &t, &d2, &Ts) == 3) {
+            e->t[e->n] = t; e->d2[e->n] = d2; e->Ts[e->n] = Ts;
+            e->n++;
+        }
+    }
+    fclose(f);
+    return e->n > 0 ? 0 : -1;
+}
+
+// Parses the comma separated coefficient names of -p.
+static int select_coefs(const char *arg)
+{
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", arg);
+    cal.n_fit = 0;
+    for (char *tok = strtok(buf, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        int k = 0;
+        while (k < CAL_N_COEF && strcmp(tok, coef_name[k]) != 0) {
+            k++;
+        }
+        if (k == CAL_N_COEF || cal.n_fit == CAL_N_COEF) {
+            return -1;
+        }
+        cal.fit[cal.n_fit++] = k;
+    }
+    return cal.n_fit > 0 ? 0 : -1;
+}
+
+// The "single" case of fla-vap-bench.c with the selected multipliers at s,
+// sampled every DPM_DT.
+static void synthetic_experiment(real s, cal_exp_t *e)
+{
+    e->d0 = 20.e-6; e->T0 = 300.0; e->T_g = 880.0; e->p_g = 3.0e6; e->u_rel = 1.0;
+    e->n = MIN((int)(20.e-3 / DPM_DT + 0.5), CAL_MAX_POINTS);
+    for (int i = 0; i < e->n; i++) {
+        e->t[i] = i*DPM_DT;
+    }
+    real x[CAL_N_COEF];
+    for (int i = 0; i < cal.n_fit; i++) {
+        x[i] = log(s);
+    }
+    candidate_scale(x, &vap_prop);
+    e->n = history(e, e->d2, e->Ts);
+}
+
+int main(int argc, char *argv[])
+{
+    real synthetic = 1.2;
+    real bound = 2.0;
+    cal.n_pop = 0;
+    cal.n_gen = 60;
+    cal.n_threads = 4;
+    select_coefs("c_v,c_l");
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-e") == 0 && i + 1 < argc && cal.n_exp < CAL_MAX_EXP) {
+            if (read_experiment(argv[++i], &cal.exp[cal.n_exp]) != 0) {
+                Message("Cannot read the experiment %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            cal.n_exp++;
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            if (select_coefs(argv[++i]) != 0) {
+                Message("Unknown coefficient in %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            cal.n_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            cal.n_pop = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+            cal.n_gen = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            bound = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            synthetic = atof(argv[++i]);
+        } else {
+            Message("Usage: %s [-e d0,T0,T_g,p_g,u_rel,file]... [-p coef,coef,...] [-t threads]\n"
+                    "       [-n population] [-g generations] [-b bound] [-s synthetic]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (cal.n_pop < 4) {
+        cal.n_pop = MAX(16, 10*cal.n_fit);
+    }
+    cal.n_gen = MAX(1, cal.n_gen);
+    cal.n_threads = MAX(1, MIN(cal.n_threads, cal.n_pop));
+    cal.log_bound = log(MAX(bound, 1.01));
+
+    vap_dispatch_init(0);
+    char source[64] = "";
+    if (cal.n_exp == 0) {
+        synthetic_experiment(synthetic, &cal.exp[0]);
+        cal.n_exp = 1;
+        snprintf(source, sizeof(source), " (synthetic, multipliers %g)", synthetic);
+    }
+    int n = cal.n_fit;
+    cal.x = malloc((size_t)cal.n_pop*n*sizeof(real));
+    cal.trial = malloc((size_t)cal.n_pop*n*sizeof(real));
+    cal.J = malloc(cal.n_pop*sizeof(real));
+    cal.J_trial = malloc(cal.n_pop*sizeof(real));
+    cal.workers = malloc(cal.n_threads*sizeof(cal_worker_t));
+    if (cal.x == NULL || cal.trial == NULL || cal.J == NULL || cal.J_trial == NULL || cal.workers == NULL) {
+        Message("Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    for (int k = 0; k < cal.n_threads; k++) {
+        cal.workers[k].first = (int)((long)k*cal.n_pop / cal.n_threads);
+        cal.workers[k].last = (int)((long)(k + 1)*cal.n_pop / cal.n_threads);
+    }
+
+    Message("fluid: %s, experiments: %d%s, fitted:", FLUID_NAME, cal.n_exp, source);
+    for (int i = 0; i < n; i++) {
+        Message(" %s", coef_name[cal.fit[i]]);
+    }
+    Message(", population: %d, threads: %d\n", cal.n_pop, cal.n_threads);
+
+    // the initial population covers the bounds, member 0 is nominal
+    uint64_t rng = 12345;
+    for (int i = 0; i < cal.n_pop; i++) {
+        for (int k = 0; k < n; k++) {
+            cal.trial[i*n + k] = i == 0 ? 0.0 : cal.log_bound*(2.0*uniform(&rng) - 1.0);
+        }
+    }
+    double t0 = vap_wtime();
+    evaluate_trials();
+    memcpy(cal.x, cal.trial, (size_t)cal.n_pop*n*sizeof(real));
+    memcpy(cal.J, cal.J_trial, cal.n_pop*sizeof(real));
+    real J_nominal = cal.J[0];
+    long evaluations = cal.n_pop;
+
+    int best = 0;
+    for (int gen = 0; gen < cal.n_gen; gen++) {
+        make_trials(&rng);
+        evaluate_trials();
+        evaluations += cal.n_pop;
+        for (int i = 0; i < cal.n_pop; i++) {
+            if (cal.J_trial[i] <= cal.J[i]) {
+                memcpy(&cal.x[i*n], &cal.trial[i*n], n*sizeof(real));
+                cal.J[i] = cal.J_trial[i];
+            }
+        }
+        for (int i = 0; i < cal.n_pop; i++) {
+            best = cal.J[i] < cal.J[best] ? i : best;
+        }
+        if ((gen + 1) % 10 == 0 || gen == cal.n_gen - 1) {
+            Message("generation %4d: J = %.4e,", gen + 1, cal.J[best]);
+            for (int k = 0; k < n; k++) {
+                Message(" %s %.4f", coef_name[cal.fit[k]], exp(cal.x[best*n + k]));
+            }
+            Message("\n");
+        }
+    }
+    double wall = vap_wtime() - t0;
+
+    real rms_d2[CAL_MAX_EXP], rms_Ts[CAL_MAX_EXP];
+    real J = objective(&cal.x[best*n], rms_d2, rms_Ts);
+    Message("evaluations: %ld in %.3f s (%.0f per second), J: nominal %.4e, fitted %.4e\n", evaluations, wall,
+            evaluations / MAX(wall, 1.e-9), J_nominal, J);
+    for (int k = 0; k < cal.n_exp; k++) {
+        Message("experiment %d: %d points, rms d2 %.3e, rms T_s %.3f K\n", k, cal.exp[k].n, rms_d2[k], rms_Ts[k]);
+    }
+    free(cal.workers); free(cal.J_trial); free(cal.J); free(cal.trial); free(cal.x);
+    return EXIT_SUCCESS;
+}
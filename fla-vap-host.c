@@ -0,0 +1,332 @@
+/**********************************************************************
+Stand-in CFD host for the host adapter of fla-vap.c (vap_host_t): droplet
+parcels in the synthetic jet of fla-vap-offline.h are advanced through
+vap_generic_host(), with the cell data supplied by callbacks over the
+offline mesh, as a solver other than Fluent would supply them.
+
+The host owns the particle motion and the mass update, the adapter runs the
+heat-mass and FLA steps (vap_host_heat_mass(), vap_host_fla()) and hands the
+sources back through the deposit callback. The parcels are split into blocks,
+one per thread, each with its own source buffers. The same parcels are then
+advanced directly with offline_parcel_step(); the final parcel states and the
+deposited sources of the two runs are compared, so the adapter can be
+checked to reproduce the kernels called without it.
+
+Build (the fluid is selected as in fla-vap.c, n-dodecane by default):
+    cc -O2 -pthread -o fla-vap-host fla-vap-host.c -lm
+Usage:
+    fla-vap-host [-n parcels] [-s max_steps] [-t threads]
+
+Copyright (C) 2018 Oyuna Rybdylova, Timur Zaripov - All Rights Reserved
+You may use, distribute and modify this code under the terms of the MIT license
+***********************************************************************/
+#define FLA_VAP_STANDALONE
+#include "fla-vap.c"
+
+#include "fla-vap-offline.h"
+
+#include <pthread.h>
+
+// Particle of the host; rec.host points back to it.
+typedef struct host_parcel_s {
+    vap_record_t rec;
+    real x[2], u[2];
+    real m;
+    int alive;
+    int steps;
+    int failed;     // steps whose surface balance did not converge
+} host_parcel_t;
+
+// Sources of one run, per cell: N_P weighted vapour (kg/s) and heat (W).
+typedef struct host_sources_s {
+    real *vap;
+    real *heat;
+} host_sources_t;
+
+// Per-thread context of the cell callbacks.
+typedef struct host_thread_s {
+    pthread_t id;
+    int first, last;
+    host_sources_t src;
+    double wall;
+} host_thread_t;
+
+static struct {
+    int n_parcels, max_steps, n_threads;
+    real d0, T0, U_inj, delta, dt;
+    offline_mesh_t mesh;
+    host_parcel_t *hp;
+    offline_parcel_t *op;
+    host_thread_t *threads;
+} host;
+
+static int sources_init(host_sources_t *s, int n_cells)
+{
+    s->vap = calloc(n_cells, sizeof(real));
+    s->heat = calloc(n_cells, sizeof(real));
+    return s->vap == NULL || s->heat == NULL ? -1 : 0;
+}
+
+//-----------------------------------------------------------------------------
+// Cell callbacks of the host, see vap_cells_t.
+static int host_gas(void *ctx, const vap_record_t *rec, real Ts, vap_env_t *g)
+{
+    (void)ctx;
+    const host_parcel_t *hp = rec->host;
+    const offline_mesh_t *mesh = &host.mesh;
+    int c = rec->cell;
+    real du = mesh->u[c] - hp->u[0];
+    real dv = mesh->v[c] - hp->u[1];
+    offline_env(g, mesh->T[c], mesh->p, mesh->mu[c], mesh->k[c], mesh->cp[c], sqrt(du*du + dv*dv), rec->q.Dp, Ts);
+    return 0;
+}
+
+// The synthetic jet is laminar: no k and epsilon.
+static int host_flow(void *ctx, const vap_record_t *rec, real grad[], real turb[2])
+{
+    (void)ctx;
+    memcpy(grad, &host.mesh.grad[FLA_N_GRAD*rec->cell], FLA_N_GRAD*sizeof(real));
+    turb[0] = turb[1] = 0.0;
+    return 0;
+}
+
+static int host_deposit(void *ctx, const vap_record_t *rec, const vap_rates_t *r)
+{
+    host_sources_t *s = ctx;
+    real N_P = rec->u[FLA_OFFSET + FLA_I_N_P];
+    s->vap[rec->cell] += N_P*r->vap_rate;
+    s->heat[rec->cell] += N_P*r->dh_dt;
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// DPM step of the host: the particle data of the step, the heat-mass and FLA
+// steps through the adapter, then motion and mass as offline_parcel_finish().
+// With FLA_MAGNUS the FLA step follows the motion, as there.
+static int host_step(const vap_host_t *h, host_parcel_t *hp)
+{
+    vap_record_t *rec = &hp->rec;
+    const offline_mesh_t *mesh = &host.mesh;
+    int c = rec->cell;
+    real du = mesh->u[c] - hp->u[0];
+    real dv = mesh->v[c] - hp->u[1];
+    real Re = mesh->p / (R_AIR*mesh->T[c])*sqrt(du*du + dv*dv)*rec->q.Dp / mesh->mu[c];
+    rec->q.dt = host.dt;
+    rec->q.tau = rec->q.rho*rec->q.Dp*rec->q.Dp / (mesh->mu[c]*drag_coeff(Re));
+
+    // the callbacks of this host do not fail, so a failure is the surface
+    // balance; the step is applied with its last iterate, as in the direct path
+    vap_rates_t r;
+    if (vap_host_heat_mass(h, rec, &r) != 0) {
+        hp->failed++;
+    }
+#ifndef FLA_MAGNUS
+    if (vap_host_fla(h, rec) != 0) {
+        return 0;
+    }
+#endif
+
+    real a = exp(-host.dt / rec->q.tau);
+    real u_g[2] = { mesh->u[c], mesh->v[c] };
+    for (int i = 0; i < 2; i++) {
+        real u_new = u_g[i] + (hp->u[i] - u_g[i])*a;
+        hp->x[i] += 0.5*(hp->u[i] + u_new)*host.dt;
+        hp->u[i] = u_new;
+    }
+    hp->m -= r.vap_rate*host.dt;
+    if (!(hp->m > 0.0)) {
+        return 0;
+    }
+    rec->q.rho = get_liquid_density(rec->u[VAP_I_T_AV]);
+    rec->q.Dp = DPM_DIAM_FROM_VOL(hp->m / rec->q.rho);
+    rec->cell = offline_mesh_cell(mesh, hp->x[0], hp->x[1]);
+    if (rec->cell < 0 || !(rec->q.Dp >= 1.e-7)) {
+        return 0;
+    }
+#ifdef FLA_MAGNUS
+    return vap_host_fla(h, rec) == 0;
+#else
+    return 1;
+#endif
+}
+
+static void *host_thread(void *arg)
+{
+    host_thread_t *th = arg;
+    vap_cells_t cells = { &th->src, host_gas, host_flow, host_deposit };
+    vap_host_t h = vap_generic_host(&cells);
+    double t0 = vap_wtime();
+    for (int i = th->first; i < th->last; i++) {
+        host_parcel_t *hp = &host.hp[i];
+        while (hp->alive && hp->steps < host.max_steps) {
+            hp->alive = host_step(&h, hp);
+            hp->steps++;
+        }
+    }
+    th->wall = vap_wtime() - t0;
+    return NULL;
+}
+
+// The same parcels advanced directly, with offline_parcel_step().
+static void *direct_thread(void *arg)
+{
+    host_thread_t *th = arg;
+    double t0 = vap_wtime();
+    for (int i = th->first; i < th->last; i++) {
+        offline_parcel_t *pp = &host.op[i];
+        for (int n = 0; n < host.max_steps && pp->alive; n++) {
+            real N_P = pp->fla[FLA_I_N_P];
+            offline_step_t out;
+            offline_parcel_step(pp, &host.mesh, host.dt, &out);
+            th->src.vap[out.cell] += N_P*out.vap_rate;
+            th->src.heat[out.cell] += N_P*out.dh_dt;
+        }
+    }
+    th->wall = vap_wtime() - t0;
+    return NULL;
+}
+
+// Runs entry on all threads; returns the longest wall time of a thread.
+static double run_threads(void *(*entry)(void *))
+{
+    double wall = 0.0;
+    for (int k = 0; k < host.n_threads; k++) {
+        pthread_create(&host.threads[k].id, NULL, entry, &host.threads[k]);
+    }
+    for (int k = 0; k < host.n_threads; k++) {
+        pthread_join(host.threads[k].id, NULL);
+        wall = MAX(wall, host.threads[k].wall);
+    }
+    return wall;
+}
+
+// Sums the per-thread sources into the buffers of thread 0 and resets the others.
+static void reduce_sources(int n_cells, host_sources_t *out)
+{
+    for (int c = 0; c < n_cells; c++) {
+        out->vap[c] = out->heat[c] = 0.0;
+        for (int k = 0; k < host.n_threads; k++) {
+            host_sources_t *s = &host.threads[k].src;
+            out->vap[c] += s->vap[c];
+            out->heat[c] += s->heat[c];
+            s->vap[c] = s->heat[c] = 0.0;
+        }
+    }
+}
+
+static real rel_diff(real a, real b)
+{
+    return ABS(a - b) / MAX(ABS(b), 1.e-30);
+}
+
+int main(int argc, char *argv[])
+{
+    host.n_parcels = 1000;
+    host.max_steps = 2000;
+    host.n_threads = 4;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            host.n_parcels = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            host.max_steps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            host.n_threads = atoi(argv[++i]);
+        } else {
+            Message("Usage: %s [-n parcels] [-s max_steps] [-t threads]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    host.n_parcels = MAX(1, host.n_parcels);
+    host.max_steps = MAX(1, host.max_steps);
+    host.n_threads = MAX(1, MIN(host.n_threads, host.n_parcels));
+
+    // spray into a hot air jet at 3 MPa, as fla-vap-pipeline.c
+    host.d0 = 20.e-6;
+    host.T0 = 300.0;
+    host.U_inj = 20.0;
+    host.delta = 2.e-3;
+    host.dt = DPM_DT;
+    vap_dispatch_init(0);
+    if (offline_mesh_init(&host.mesh, 400, 100, 0.1, 0.02, 10.0, 1.0, 100.0, host.delta, 800.0, 500.0, 3.e6) != 0) {
+        Message("Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    int n_cells = host.mesh.nx*host.mesh.ny;
+    host.hp = malloc(host.n_parcels*sizeof(host_parcel_t));
+    host.op = malloc(host.n_parcels*sizeof(offline_parcel_t));
+    host.threads = calloc(host.n_threads, sizeof(host_thread_t));
+    host_sources_t adapter, direct;
+    if (host.hp == NULL || host.op == NULL || host.threads == NULL
+        || sources_init(&adapter, n_cells) != 0 || sources_init(&direct, n_cells) != 0) {
+        Message("Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    for (int k = 0; k < host.n_threads; k++) {
+        host_thread_t *th = &host.threads[k];
+        th->first = (int)((long)k*host.n_parcels / host.n_threads);
+        th->last = (int)((long)(k + 1)*host.n_parcels / host.n_threads);
+        if (sources_init(&th->src, n_cells) != 0) {
+            Message("Out of memory\n");
+            return EXIT_FAILURE;
+        }
+    }
+    for (int i = 0; i < host.n_parcels; i++) {
+        real x = 0.5*host.mesh.dx, y = offline_parcel_y0(i, host.delta);
+        offline_parcel_t *pp = &host.op[i];
+        host_parcel_t *hp = &host.hp[i];
+        offline_parcel_init(pp, &host.mesh, x, y, host.U_inj, 0.0, host.d0, host.T0);
+        vap_record_init(&hp->rec, pp->d, pp->rho, host.T0);
+        hp->rec.cell = pp->cell;
+        hp->rec.host = hp;
+        hp->x[0] = x; hp->x[1] = y;
+        hp->u[0] = host.U_inj; hp->u[1] = 0.0;
+        hp->m = pp->m;
+        hp->alive = pp->alive;
+        hp->steps = 0;
+        hp->failed = 0;
+    }
+
+    double wall_adapter = run_threads(host_thread);
+    reduce_sources(n_cells, &adapter);
+    double wall_direct = run_threads(direct_thread);
+    reduce_sources(n_cells, &direct);
+
+    long steps = 0, failed = 0;
+    int mismatch = 0;
+    real e_Ts = 0.0, e_d = 0.0, e_N_P = 0.0, e_x = 0.0, e_vap = 0.0, e_heat = 0.0;
+    for (int i = 0; i < host.n_parcels; i++) {
+        const host_parcel_t *hp = &host.hp[i];
+        const offline_parcel_t *pp = &host.op[i];
+        steps += hp->steps;
+        failed += hp->failed;
+        mismatch += hp->alive != pp->alive;
+        e_Ts = MAX(e_Ts, ABS(hp->rec.u[VAP_I_T(N_INT)] - pp->s.T[N_INT]));
+        e_d = MAX(e_d, rel_diff(hp->rec.q.Dp, pp->d));
+        e_N_P = MAX(e_N_P, rel_diff(hp->rec.u[FLA_OFFSET + FLA_I_N_P], pp->fla[FLA_I_N_P]));
+        e_x = MAX(e_x, MAX(ABS(hp->x[0] - pp->x[0]), ABS(hp->x[1] - pp->x[1])));
+    }
+    real vap_max = 0.0, heat_max = 0.0;
+    for (int c = 0; c < n_cells; c++) {
+        vap_max = MAX(vap_max, ABS(direct.vap[c]));
+        heat_max = MAX(heat_max, ABS(direct.heat[c]));
+    }
+    for (int c = 0; c < n_cells; c++) {
+        e_vap = MAX(e_vap, ABS(adapter.vap[c] - direct.vap[c]) / MAX(vap_max, 1.e-30));
+        e_heat = MAX(e_heat, ABS(adapter.heat[c] - direct.heat[c]) / MAX(heat_max, 1.e-30));
+    }
+
+    Message("fluid: %s, parcels: %d, threads: %d, particle steps: %ld (%ld with a failed surface balance)\n",
+            FLUID_NAME, host.n_parcels, host.n_threads, steps, failed);
+    Message("adapter: %.3f s (%.0f steps/s), direct: %.3f s (%.0f steps/s)\n", wall_adapter,
+            steps / MAX(wall_adapter, 1.e-9), wall_direct, steps / MAX(wall_direct, 1.e-9));
+    Message("max difference: T_s %.3e K, d %.3e, N_P %.3e, x %.3e m, vapour source %.3e, heat source %.3e"
+            " (relative), parcels ending differently: %d\n", e_Ts, e_d, e_N_P, e_x, e_vap, e_heat, mismatch);
+
+    offline_mesh_free(&host.mesh);
+    free(adapter.vap); free(adapter.heat); free(direct.vap); free(direct.heat);
+    for (int k = 0; k < host.n_threads; k++) {
+        free(host.threads[k].src.vap); free(host.threads[k].src.heat);
+    }
+    free(host.threads); free(host.op); free(host.hp);
+    return mismatch == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
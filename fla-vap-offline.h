@@ -0,0 +1,496 @@
+/**********************************************************************
+Helpers shared by the offline drivers of fla-vap.c (benchmarks, spray
+processing tools): random numbers, gas properties, a single droplet in a
+uniform gas, a synthetic carrier flow on a structured mesh and a particle
+step that calls the production heat-mass and FLA kernels in the same order
+as a DPM step in Fluent.
+
+Include after fla-vap.c built with FLA_VAP_STANDALONE.
+
+Copyright (C) 2018 Oyuna Rybdylova, Timur Zaripov - All Rights Reserved
+You may use, distribute and modify this code under the terms of the MIT license
+***********************************************************************/
+#ifndef FLA_VAP_OFFLINE_H
+#define FLA_VAP_OFFLINE_H
+
+#include <string.h>
+#include <stdint.h>
+
+#if defined(WATER)
+#define FLUID_NAME "water"
+#define FLUID_MW   18.015
+#elif defined(ISOOCTANE)
+#define FLUID_NAME "isooctane"
+#define FLUID_MW   114.23
+#else
+#define FLUID_NAME "dodecane"
+#define FLUID_MW   170.34
+#endif
+
+#define R_AIR 287.01625988193461525183829875375 // as in vap_heat_mass()
+
+// Hash of x (splitmix64), the random numbers of the drivers.
+static inline uint64_t splitmix64(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30))*0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27))*0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+// Uniform number in [0, 1) from the 53 high bits of h.
+static inline real offline_uniform(uint64_t h)
+{
+    return (h >> 11)*(1.0 / 9007199254740992.0);
+}
+
+// Properties of air: Sutherland's law for mu and k, polynomial fit for c_p.
+static inline void air_properties(real T, real *mu, real *k, real *cp)
+{
+    *mu = 1.458e-6*pow(T, 1.5) / (T + 110.4);
+    *k = 2.495e-3*pow(T, 1.5) / (T + 194.0);
+    *cp = 1034.09 - 0.2849*T + 7.817e-4*T*T - 4.971e-7*T*T*T + 1.077e-10*T*T*T*T;
+}
+
+// Spherical drag as DragCoeff() in Fluent: 18 * C_D * Re / 24 (Schiller-Naumann).
+static inline real drag_coeff(real Re)
+{
+    return 18.0*(1.0 + 0.15*pow(Re, 0.687));
+}
+
+// Fills the gas state seen by a droplet; D as in the Diesel_binary_diffusivity UDF.
+static inline void offline_env(vap_env_t *g, real T_g, real p_g, real mu, real k, real cp,
+                               real rel_vel, real d, real Ts)
+{
+    real rho_g = p_g / (R_AIR*T_g);
+    g->temp = T_g;
+    g->pressure = p_g;
+    g->mu = mu;
+    g->tCond = k;
+    g->sHeat = cp;
+    g->rel_vel = rel_vel;
+    g->Re = rho_g*rel_vel*d / mu;
+    g->mw_vap = FLUID_MW;
+    g->D = get_vapour_binary_diffusivity(p_g, (2.0*Ts + T_g) / 3.0);
+    g->vap_limit = 1.0;
+}
+
+//-----------------------------------------------------------------------------
+// Single droplet in a uniform gas with a constant slip velocity, the case of
+// fla-vap-bench.c, fla-vap-uq.c and fla-vap-calib.c.
+typedef struct offline_droplet_s {
+    vap_state_t s;
+    real d, m, rho;
+} offline_droplet_t;
+
+static inline void offline_droplet_init(offline_droplet_t *dr, real d0, real T0)
+{
+    memset(dr, 0, sizeof(*dr));
+    for (int j = 0; j < N_INT + 1; j++) { dr->s.T[j] = T0; }
+    dr->s.T_av = T0;
+    dr->s.Nu = 2.0;
+    dr->d = d0;
+    dr->rho = get_liquid_density(T0);
+    dr->m = dr->rho*PI*d0*d0*d0 / 6.0;
+}
+
+// Gas state seen by the next step of dr in the gas at T_g, p_g.
+static inline void offline_droplet_env(const offline_droplet_t *dr, real T_g, real p_g, real u_rel, vap_env_t *g)
+{
+    real mu_g, k_g, cp_g;
+    air_properties(T_g, &mu_g, &k_g, &cp_g);
+    offline_env(g, T_g, p_g, mu_g, k_g, cp_g, u_rel, dr->d, dr->s.T[N_INT]);
+}
+
+// Mass, density and diameter of dr after the heat-mass update of its step of
+// dt, which returned status and the rates r. Returns as offline_droplet_step().
+static inline int offline_droplet_update(offline_droplet_t *dr, int status, const vap_rates_t *r, real dt)
+{
+    if (status != 0) {
+        return -1;
+    }
+    dr->m -= r->vap_rate*dt;
+    if (!(dr->m > 0.0)) {
+        return 0;
+    }
+    dr->rho = get_liquid_density(dr->s.T_av);
+    dr->d = DPM_DIAM_FROM_VOL(dr->m / dr->rho);
+    return 1;
+}
+
+// One step of dt in the gas at T_g, p_g (vap_heat_mass(), or
+// vap_heat_mass_multirate() with VAP_MULTIRATE), the rates in r. Returns 1,
+// or 0 if the droplet has evaporated within the step (d and rho are then
+// those before the step), or -1 if the surface balance did not converge (the
+// history is not valid from there on; m, d and rho are left as they were).
+static inline int offline_droplet_step(offline_droplet_t *dr, real T_g, real p_g, real u_rel, real dt, vap_rates_t *r)
+{
+    vap_env_t g;
+    offline_droplet_env(dr, T_g, p_g, u_rel, &g);
+#ifdef VAP_MULTIRATE
+    int status = vap_heat_mass_multirate(&dr->s, &g, dr->d, dr->rho, dt, r);
+#else
+    int status = vap_heat_mass(&dr->s, &g, dr->d, dr->rho, dt, r);
+#endif
+    return offline_droplet_update(dr, status, r, dt);
+}
+
+// How the history of a single droplet ended, see offline_history_step().
+#define OFFLINE_ALIVE      0
+#define OFFLINE_EVAPORATED 1 // d^2/d0^2 fell below OFFLINE_D2_END, or the mass to zero within a step
+#define OFFLINE_BOILING    2 // the surface reached the boiling point
+#define OFFLINE_FAILED     3 // the surface balance did not converge
+#define OFFLINE_D2_END     (0.01)
+
+typedef struct offline_history_s {
+    int n;          // steps taken
+    real d2_old;    // d^2/d0^2 and p_sat of the sample before
+    real p_sat_old;
+    int end;        // OFFLINE_*
+    real t_end;     // time of the end, interpolated to the crossing
+} offline_history_t;
+
+static inline void offline_history_init(offline_history_t *h)
+{
+    h->n = 0;
+    h->d2_old = 1.0;
+    h->p_sat_old = 0.0;
+    h->end = OFFLINE_ALIVE;
+    h->t_end = -1.0;
+}
+
+// Ends the history of dr (initial diameter d0) if its sample at t = n dt is
+// past d^2/d0^2 = OFFLINE_D2_END or at the boiling point at p_g, where the
+// surface balance breaks down; the time of the crossing is interpolated from
+// the sample before. Returns h->end.
+static inline int offline_history_check(offline_history_t *h, const offline_droplet_t *dr, real d0, real p_g,
+                                        real dt)
+{
+    real d2 = dr->d*dr->d / (d0*d0);
+    real p_sat = get_vapour_saturation_pressure(dr->s.T[N_INT]);
+    if (d2 < OFFLINE_D2_END) {
+        h->end = OFFLINE_EVAPORATED;
+        h->t_end = (h->n - (OFFLINE_D2_END - d2) / (h->d2_old - d2))*dt;
+    } else if (!(p_sat < p_g)) {
+        h->end = OFFLINE_BOILING;
+        h->t_end = h->n > 0 && p_sat > h->p_sat_old ? (h->n - (p_sat - p_g) / (p_sat - h->p_sat_old))*dt : h->n*dt;
+    }
+    h->d2_old = d2;
+    h->p_sat_old = p_sat;
+    return h->end;
+}
+
+// Accounts the step that offline_droplet_step() has taken from the mass m_old
+// with the result alive. A droplet that evaporates within the step ends at the
+// rate of the step. Returns h->end.
+static inline int offline_history_stepped(offline_history_t *h, const offline_droplet_t *dr, real m_old, int alive,
+                                          real dt)
+{
+    if (alive < 0) {
+        h->end = OFFLINE_FAILED;
+        h->t_end = h->n*dt;
+    } else if (alive == 0) {
+        h->end = OFFLINE_EVAPORATED;
+        h->t_end = (h->n + m_old / (m_old - dr->m))*dt;
+    }
+    h->n++;
+    return h->end;
+}
+
+// The next step of the history of dr in the gas at T_g, p_g: ends it as
+// offline_history_check(), otherwise takes the step of dt (rates in r).
+// Returns h->end, OFFLINE_ALIVE while the history goes on. The bench, the
+// uncertainty and the calibration drivers end their histories here alike.
+static inline int offline_history_step(offline_history_t *h, offline_droplet_t *dr, real d0, real T_g, real p_g,
+                                       real u_rel, real dt, vap_rates_t *r)
+{
+    if (offline_history_check(h, dr, d0, p_g, dt) != OFFLINE_ALIVE) {
+        return h->end;
+    }
+    real m_old = dr->m;
+    int alive = offline_droplet_step(dr, T_g, p_g, u_rel, dt, r);
+    return offline_history_stepped(h, dr, m_old, alive, dt);
+}
+
+// Name of the end of a history.
+static inline const char *offline_history_end_name(int end)
+{
+    static const char *name[] = { "alive", "evaporated", "boiling", "failed" };
+    return end >= 0 && end <= OFFLINE_FAILED ? name[end] : "?";
+}
+
+//-----------------------------------------------------------------------------
+// Synthetic carrier phase: steady planar jet u = U_co + U_0 exp(-(y/delta)^2)
+// along x in a plane strain field (S x, -S y), with the temperature following
+// the jet profile. Cell data are kept
+// in separate arrays as in the solver (C_U, C_T, C_DUDX, ...).
+typedef struct offline_mesh_s {
+    int nx, ny;
+    real dx, dy;
+    real Ly;            // domain [0, nx*dx] x [-Ly/2, Ly/2]
+    real p;             // pressure
+    real *u, *v, *T;
+    real *grad;         // FLA_N_GRAD per cell
+    real *mu, *k, *cp;
+} offline_mesh_t;
+
+static inline int offline_mesh_init(offline_mesh_t *m, int nx, int ny, real Lx, real Ly,
+                                    real U_0, real U_co, real S, real delta, real T_jet, real T_amb, real p)
+{
+    int n = nx*ny;
+    m->nx = nx; m->ny = ny;
+    m->dx = Lx / nx; m->dy = Ly / ny;
+    m->Ly = Ly;
+    m->p = p;
+    m->u = malloc(n*sizeof(real)); m->v = malloc(n*sizeof(real)); m->T = malloc(n*sizeof(real));
+    m->grad = malloc(FLA_N_GRAD*n*sizeof(real));
+    m->mu = malloc(n*sizeof(real)); m->k = malloc(n*sizeof(real)); m->cp = malloc(n*sizeof(real));
+    if (!m->u || !m->v || !m->T || !m->grad || !m->mu || !m->k || !m->cp) {
+        return -1;
+    }
+    for (int j = 0; j < ny; j++) {
+        real y = -0.5*Ly + (j + 0.5)*m->dy;
+        real e = exp(-(y / delta)*(y / delta));
+        for (int i = 0; i < nx; i++) {
+            int c = j*nx + i;
+            real x = (i + 0.5)*m->dx;
+            m->u[c] = U_co + U_0*e + S*x;
+            m->v[c] = -S*y;
+            m->T[c] = T_amb + (T_jet - T_amb)*e;
+            m->grad[FLA_N_GRAD*c + 0] = S;
+            m->grad[FLA_N_GRAD*c + 1] = -2.0*y / (delta*delta)*U_0*e;
+            m->grad[FLA_N_GRAD*c + 2] = 0.0;
+            m->grad[FLA_N_GRAD*c + 3] = -S;
+            air_properties(m->T[c], &m->mu[c], &m->k[c], &m->cp[c]);
+        }
+    }
+    return 0;
+}
+
+static inline void offline_mesh_free(offline_mesh_t *m)
+{
+    free(m->u); free(m->v); free(m->T); free(m->grad);
+    free(m->mu); free(m->k); free(m->cp);
+}
+
+// Cell containing (x, y), -1 outside the domain.
+static inline int offline_mesh_cell(const offline_mesh_t *m, real x, real y)
+{
+    int i = (int)floor(x / m->dx);
+    int j = (int)floor((y + 0.5*m->Ly) / m->dy);
+    if (i < 0 || i >= m->nx || j < 0 || j >= m->ny) {
+        return -1;
+    }
+    return j*m->nx + i;
+}
+
+// Injection position of parcel i, uniformly random across a jet core of
+// half-width delta.
+static inline real offline_parcel_y0(int i, real delta)
+{
+    return delta*(2.0*offline_uniform(splitmix64((uint64_t)i)) - 1.0);
+}
+
+//-----------------------------------------------------------------------------
+// Parcel with the same state as a tracked particle with the UDF user reals.
+typedef struct offline_parcel_s {
+    real x[2], u[2];
+    real d, m, rho;
+    real t;
+    int cell;
+    int alive;
+    vap_state_t s;
+    real fla[FLA_N_SCAL];
+} offline_parcel_t;
+
+// Contribution of one particle step to the carrier phase.
+typedef struct offline_step_s {
+    int cell;
+    real N_P;
+    real vap_rate;  // kg/s
+    real dh_dt;     // W
+} offline_step_t;
+
+// As the initialize branch of Diesel_droplet.
+static inline void offline_parcel_init(offline_parcel_t *pp, const offline_mesh_t *mesh,
+                                       real x, real y, real u, real v, real d0, real T0)
+{
+    memset(pp, 0, sizeof(*pp));
+    pp->x[0] = x; pp->x[1] = y;
+    pp->u[0] = u; pp->u[1] = v;
+    for (int j = 0; j < N_INT + 1; j++) { pp->s.T[j] = T0; }
+    pp->s.T_av = T0;
+    pp->s.Nu = 2.0;
+    pp->d = d0;
+    pp->rho = get_liquid_density(T0);
+    pp->m = pp->rho*PI*d0*d0*d0 / 6.0;
+    pp->cell = offline_mesh_cell(mesh, x, y);
+    pp->alive = pp->cell >= 0;
+    fla_init(pp->fla);
+}
+
+// Gas state of the parcel's cell; returns the cell index, -1 if outside.
+static inline int offline_parcel_env(const offline_parcel_t *pp, const offline_mesh_t *mesh, vap_env_t *g)
+{
+    int c = pp->cell;
+    real du = mesh->u[c] - pp->u[0];
+    real dv = mesh->v[c] - pp->u[1];
+    offline_env(g, mesh->T[c], mesh->p, mesh->mu[c], mesh->k[c], mesh->cp[c],
+                sqrt(du*du + dv*dv), pp->d, pp->s.T[N_INT]);
+    return c;
+}
+
+// Motion, mass and FLA update of the parcel after the heat-mass update, as in
+// the DPM step and Diesel_droplet. g is the gas state the heat-mass update used.
+// With FLA_MAGNUS the FLA step follows the motion and takes the gradients of
+// the parcel's new cell, the end of the step.
+static inline void offline_parcel_finish(offline_parcel_t *pp, const offline_mesh_t *mesh,
+                                         const vap_env_t *g, const vap_rates_t *r, real dt)
+{
+    int c = pp->cell;
+    // particle motion with the drag relaxation time, also used by the FLA
+    real tau = pp->rho*pp->d*pp->d / (g->mu*drag_coeff(g->Re));
+    real a = exp(-dt / tau);
+    real u_g[2] = { mesh->u[c], mesh->v[c] };
+    for (int i = 0; i < 2; i++) {
+        real u_new = u_g[i] + (pp->u[i] - u_g[i])*a;
+        pp->x[i] += 0.5*(pp->u[i] + u_new)*dt;
+        pp->u[i] = u_new;
+    }
+#ifndef FLA_MAGNUS
+    fla_advance(pp->fla, dt, tau, &mesh->grad[FLA_N_GRAD*c]);
+#endif
+
+    pp->m -= r->vap_rate*dt;
+    pp->t += dt;
+    if (!(pp->m > 0.0)) {
+        pp->alive = 0;
+        return;
+    }
+    pp->rho = get_liquid_density(pp->s.T_av);
+    pp->d = DPM_DIAM_FROM_VOL(pp->m / pp->rho);
+    pp->cell = offline_mesh_cell(mesh, pp->x[0], pp->x[1]);
+    // also stops parcels whose state is no longer finite
+    if (pp->cell < 0 || !(pp->d >= 1.e-7)) {
+        pp->alive = 0;
+    }
+#ifdef FLA_MAGNUS
+    if (pp->alive) {
+        fla_advance(pp->fla, dt, tau, &mesh->grad[FLA_N_GRAD*pp->cell]);
+    }
+#endif
+}
+
+// One particle step of dt: heat and mass transfer (vap_heat_mass), motion and
+// FLA (fla_advance); vap_heat_mass_multirate() with VAP_MULTIRATE. Returns 0 if
+// the parcel has left the domain or evaporated.
+static inline int offline_parcel_step(offline_parcel_t *pp, const offline_mesh_t *mesh, real dt, offline_step_t *out)
+{
+    vap_env_t g;
+    vap_rates_t r;
+    out->cell = offline_parcel_env(pp, mesh, &g);
+#ifdef VAP_MULTIRATE
+    vap_heat_mass_multirate(&pp->s, &g, pp->d, pp->rho, dt, &r);
+#else
+    vap_heat_mass(&pp->s, &g, pp->d, pp->rho, dt, &r);
+#endif
+    offline_parcel_finish(pp, mesh, &g, &r, dt);
+    out->N_P = pp->fla[FLA_I_N_P];
+    out->vap_rate = r.vap_rate;
+    out->dh_dt = r.dh_dt;
+    return pp->alive;
+}
+
+//-----------------------------------------------------------------------------
+// Interleaved stepping of a group of parcels: the group goes through the
+// stages of a step in lock-step. The cell data of all parcels are prefetched
+// first, so their misses are in flight together instead of one after the
+// other. Then the gas state of every parcel is gathered, the heat and mass
+// transfer of all of them runs in one vap_heat_mass_batch() call (parcels in
+// the SIMD lanes), and the motion and FLA of every parcel follow.
+#if defined(__GNUC__)
+#define OFFLINE_PREFETCH(a) __builtin_prefetch(a)
+#else
+#define OFFLINE_PREFETCH(a) ((void)(a))
+#endif
+
+static inline void offline_mesh_prefetch(const offline_mesh_t *m, int c)
+{
+    OFFLINE_PREFETCH(&m->u[c]); OFFLINE_PREFETCH(&m->v[c]); OFFLINE_PREFETCH(&m->T[c]);
+    OFFLINE_PREFETCH(&m->grad[FLA_N_GRAD*c]);
+    OFFLINE_PREFETCH(&m->mu[c]); OFFLINE_PREFETCH(&m->k[c]); OFFLINE_PREFETCH(&m->cp[c]);
+}
+
+// offline_parcel_step() of the n <= VAP_BATCH live parcels pp[]; b is scratch
+// space. Differs from offline_parcel_step() in rounding (batched series update).
+static inline void offline_group_step(offline_parcel_t *pp[], int n, const offline_mesh_t *mesh, real dt,
+                                      vap_batch_t *b, offline_step_t out[])
+{
+    vap_env_t g[VAP_BATCH];
+    vap_rates_t r[VAP_BATCH];
+    vap_state_t *s[VAP_BATCH];
+    const vap_env_t *gp[VAP_BATCH];
+    vap_rates_t *rp[VAP_BATCH];
+    real Dp[VAP_BATCH], rho_p[VAP_BATCH], dts[VAP_BATCH];
+    for (int l = 0; l < n; l++) {
+        offline_mesh_prefetch(mesh, pp[l]->cell);
+    }
+    for (int l = 0; l < n; l++) {
+        out[l].cell = offline_parcel_env(pp[l], mesh, &g[l]);
+        s[l] = &pp[l]->s;
+        gp[l] = &g[l];
+        rp[l] = &r[l];
+        Dp[l] = pp[l]->d;
+        rho_p[l] = pp[l]->rho;
+        dts[l] = dt;
+    }
+    vap_heat_mass_batch(b, n, s, gp, Dp, rho_p, dts, rp);
+    for (int l = 0; l < n; l++) {
+        offline_parcel_finish(pp[l], mesh, &g[l], &r[l], dt);
+        out[l].N_P = pp[l]->fla[FLA_I_N_P];
+        out[l].vap_rate = r[l].vap_rate;
+        out[l].dh_dt = r[l].dh_dt;
+    }
+}
+
+// Number density N_P at the cell centres of the mesh from the Lagrangian mesh
+// lm (see fla_lmesh_interpolate()), added to n[]. Each lattice cell is
+// visited once and only the mesh cells in its bounding box are tested.
+// Returns the number of mesh cells reached.
+static inline int offline_lmesh_deposit(const fla_lmesh_t *lm, const offline_mesh_t *mesh, real *n)
+{
+    int reached = 0;
+    for (int k = 0; k + 1 < lm->n_level; k++) {
+        for (int s = 0; s + 1 < lm->n_seed; s++) {
+            size_t i = (size_t)k*lm->n_seed + s;
+            size_t corner[4] = { i, i + 1, i + lm->n_seed, i + lm->n_seed + 1 };
+            real x_min = 1.e30, x_max = -1.e30, y_min = 1.e30, y_max = -1.e30;
+            int complete = 1;
+            for (int l = 0; l < 4; l++) {
+                complete = complete && lm->n_p[corner[l]] >= 0.0;
+                x_min = MIN(x_min, lm->x[corner[l]]); x_max = MAX(x_max, lm->x[corner[l]]);
+                y_min = MIN(y_min, lm->y[corner[l]]); y_max = MAX(y_max, lm->y[corner[l]]);
+            }
+            if (!complete) {
+                continue;
+            }
+            int i0 = MAX(0, (int)ceil(x_min / mesh->dx - 0.5));
+            int i1 = MIN(mesh->nx - 1, (int)floor(x_max / mesh->dx - 0.5));
+            int j0 = MAX(0, (int)ceil((y_min + 0.5*mesh->Ly) / mesh->dy - 0.5));
+            int j1 = MIN(mesh->ny - 1, (int)floor((y_max + 0.5*mesh->Ly) / mesh->dy - 0.5));
+            for (int jj = j0; jj <= j1; jj++) {
+                for (int ii = i0; ii <= i1; ii++) {
+                    real n_p;
+                    if (fla_lmesh_interpolate(lm, s, k, (ii + 0.5)*mesh->dx, -0.5*mesh->Ly + (jj + 0.5)*mesh->dy, &n_p)) {
+                        int c = jj*mesh->nx + ii;
+                        reached += n[c] == 0.0;
+                        n[c] += n_p;
+                    }
+                }
+            }
+        }
+    }
+    return reached;
+}
+
+#endif // FLA_VAP_OFFLINE_H
@@ -0,0 +1,669 @@
+/**********************************************************************
+Pipelined offline spray processing with the heat-mass and FLA kernels of
+fla-vap.c.
+
+Droplet parcels are injected into a synthetic jet (see fla-vap-offline.h) and
+processed in batches by three concurrent stages, each with its own pool of
+threads:
+1. advance  - particle steps: vap_heat_mass(), motion, fla_advance();
+2. deposit  - N_P weighted contributions (number density, vapour and heat
+              sources) accumulated into per-cell buffers, one set per thread
+              (full-mesh arrays, with -c 1 sparse FLA cell accumulators);
+3. output   - trajectories and per-parcel diagnostics written to files.
+With -g the parcels of a batch are advanced in interleaved groups of that
+size (offline_group_step()), with -m the mesh is refined by that factor in
+both directions, to measure the step rate on meshes beyond the caches.
+The memory of the deposition buffers and the time of their merge are
+reported, to compare the dense and the sparse (-c 1) buffers.
+With -l the parcels are seeded on a regular lattice across the jet instead
+of at random and sampled every lattice_every steps into a Lagrangian mesh
+(fla_lmesh_t); the number density is then also interpolated between the
+neighbouring trajectories onto the mesh and compared with the deposition.
+The stages are joined by bounded lock-free queues. A fixed number of batches
+circulates through the pipeline, so a slow stage throttles the ones upstream
+(backpressure) instead of growing the queues. The time each thread spends
+working and waiting is reported per stage.
+
+Build:
+    cc -O2 -pthread -o fla-vap-pipeline fla-vap-pipeline.c -lm
+Usage:
+    fla-vap-pipeline [-n parcels] [-b batch] [-s max_steps] [-q batches]
+                     [-a advance_threads] [-d deposit_threads] [-w output_threads]
+                     [-e output_every] [-l lattice_every] [-g group] [-m mesh_scale]
+                     [-c sparse] [-o outdir]
+Without -o the output stage writes to /dev/null.
+
+Copyright (C) 2018 Oyuna Rybdylova, Timur Zaripov - All Rights Reserved
+You may use, distribute and modify this code under the terms of the MIT license
+***********************************************************************/
+#define FLA_VAP_STANDALONE
+#include "fla-vap.c"
+
+#include "fla-vap-offline.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+//-----------------------------------------------------------------------------
+// Bounded multi-producer multi-consumer lock-free queue of pointers
+// (D. Vyukov's array queue). The capacity is a power of two.
+typedef struct lfq_slot_s {
+    atomic_size_t seq;
+    void *data;
+} lfq_slot_t;
+
+typedef struct lfq_s {
+    lfq_slot_t *slots;
+    size_t mask;
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+} lfq_t;
+
+static int lfq_init(lfq_t *q, size_t min_capacity)
+{
+    size_t n = 1;
+    while (n < min_capacity) {
+        n <<= 1;
+    }
+    q->slots = malloc(n*sizeof(lfq_slot_t));
+    if (q->slots == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        atomic_init(&q->slots[i].seq, i);
+    }
+    q->mask = n - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    return 0;
+}
+
+// Returns 0 if the queue is full.
+static int lfq_push(lfq_t *q, void *data)
+{
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    lfq_slot_t *slot;
+    for (;;) {
+        slot = &q->slots[pos & q->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+    slot->data = data;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return 1;
+}
+
+// Returns NULL if the queue is empty.
+static void *lfq_pop(lfq_t *q)
+{
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    lfq_slot_t *slot;
+    for (;;) {
+        slot = &q->slots[pos & q->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+    void *data = slot->data;
+    atomic_store_explicit(&slot->seq, pos + q->mask + 1, memory_order_release);
+    return data;
+}
+
+//-----------------------------------------------------------------------------
+// Pipeline data
+typedef struct pipe_rec_s {
+    offline_step_t step;
+    int parcel;
+    int n;          // step number of the parcel
+    int last;       // last step of the parcel
+    real t, x, y, d, Ts, T_av;
+} pipe_rec_t;
+
+typedef struct pipe_batch_s {
+    int first, count;   // parcels [first, first + count)
+    int n_rec;
+    pipe_rec_t *rec;
+} pipe_batch_t;
+
+static pipe_batch_t pipe_end; // end-of-stream marker
+
+typedef struct stage_stats_s {
+    double busy;
+    double wait;
+    long items;
+} stage_stats_t;
+
+enum { STAGE_ADVANCE, STAGE_DEPOSIT, STAGE_OUTPUT, N_STAGES };
+static const char *stage_name[N_STAGES] = { "advance", "deposit", "output" };
+
+// Per-cell accumulators of one deposition thread: the arrays, or with -c 1
+// acc (only the first thread has the arrays then, for the merged fields).
+typedef struct pipe_field_s {
+    real *w;     // residence time
+    real *n;     // N_P * dt
+    real *m;     // N_P * vap_rate * dt
+    real *h;     // N_P * dh_dt * dt
+    fla_acc_t acc;
+    real mass;   // evaporated mass, sum of vap_rate * dt
+} pipe_field_t;
+
+static struct {
+    int n_parcels, batch, max_steps, n_batches, output_every;
+    int n_threads[N_STAGES];
+    const char *outdir;
+    real d0, T0, U_inj, delta;
+    int lattice_every;  // 0: random seeds, no Lagrangian mesh
+    int group;          // parcels stepped interleaved, 0: one parcel at a time
+    int mesh_scale;
+    int sparse;         // deposition into fla_acc_t instead of full-mesh arrays
+    offline_mesh_t mesh;
+    fla_lmesh_t lmesh;
+    lfq_t free_q, advanced_q, deposited_q;
+    atomic_int next_parcel;
+    atomic_int active[N_STAGES];
+    atomic_long steps;
+    pipe_field_t *fields;
+} pipe;
+
+typedef struct pipe_thread_s {
+    pthread_t id;
+    int stage, k;
+    stage_stats_t st;
+} pipe_thread_t;
+
+static void queue_put(lfq_t *q, void *x, stage_stats_t *st)
+{
+    if (lfq_push(q, x)) {
+        return;
+    }
+    double t0 = vap_wtime();
+    while (!lfq_push(q, x)) {
+        sched_yield();
+    }
+    st->wait += vap_wtime() - t0;
+}
+
+static void *queue_get(lfq_t *q, stage_stats_t *st)
+{
+    void *x = lfq_pop(q);
+    if (x != NULL) {
+        return x;
+    }
+    double t0 = vap_wtime();
+    while ((x = lfq_pop(q)) == NULL) {
+        sched_yield();
+    }
+    st->wait += vap_wtime() - t0;
+    return x;
+}
+
+// Signals the end of the stream to the next stage when the last thread of
+// this stage is done.
+static void stage_done(int stage, lfq_t *next)
+{
+    if (atomic_fetch_sub(&pipe.active[stage], 1) == 1) {
+        stage_stats_t dummy = { 0 };
+        for (int i = 0; i < pipe.n_threads[stage + 1]; i++) {
+            queue_put(next, &pipe_end, &dummy);
+        }
+    }
+}
+
+// Injection position of parcel i, uniformly across the jet core: random or,
+// with the Lagrangian mesh, on the seed lattice.
+static real parcel_y0(int i)
+{
+    if (pipe.lattice_every > 0) {
+        return pipe.delta*(2.0*(i + 0.5) / pipe.n_parcels - 1.0);
+    }
+    return offline_parcel_y0(i, pipe.delta);
+}
+
+//-----------------------------------------------------------------------------
+// Stage 1: particle steps.
+static void parcel_start(offline_parcel_t *pp, int i)
+{
+    offline_parcel_init(pp, &pipe.mesh, 0.5*pipe.mesh.dx, parcel_y0(i), pipe.U_inj, 0.0, pipe.d0, pipe.T0);
+    if (pipe.lattice_every > 0) {
+        fla_lmesh_record(&pipe.lmesh, i, 0, pp->x[0], pp->x[1], pp->fla[FLA_I_N_P]);
+    }
+}
+
+// Completes the record r of step n of parcel i.
+static void parcel_record(pipe_rec_t *r, const offline_parcel_t *pp, int i, int n)
+{
+    r->parcel = i;
+    r->n = n;
+    r->last = !pp->alive || n == pipe.max_steps - 1;
+    r->t = pp->t; r->x = pp->x[0]; r->y = pp->x[1]; r->d = pp->d;
+    r->Ts = pp->s.T[N_INT]; r->T_av = pp->s.T_av;
+    // every parcel owns its column of the lattice, no locking
+    if (pipe.lattice_every > 0 && pp->alive && (n + 1) % pipe.lattice_every == 0) {
+        fla_lmesh_record(&pipe.lmesh, i, (n + 1) / pipe.lattice_every, pp->x[0], pp->x[1], pp->fla[FLA_I_N_P]);
+    }
+}
+
+static void advance_batch(pipe_batch_t *b)
+{
+    b->n_rec = 0;
+    long steps = 0;
+    for (int i = b->first; i < b->first + b->count; i++) {
+        offline_parcel_t pp;
+        parcel_start(&pp, i);
+        for (int n = 0; n < pipe.max_steps && pp.alive; n++) {
+            pipe_rec_t *r = &b->rec[b->n_rec++];
+            offline_parcel_step(&pp, &pipe.mesh, DPM_DT, &r->step);
+            parcel_record(r, &pp, i, n);
+            steps++;
+        }
+    }
+    atomic_fetch_add(&pipe.steps, steps);
+}
+
+// advance_batch() in interleaved groups of pipe.group parcels; vb is scratch space.
+static void advance_batch_grouped(pipe_batch_t *b, vap_batch_t *vb)
+{
+    b->n_rec = 0;
+    long steps = 0;
+    for (int i0 = b->first; i0 < b->first + b->count; i0 += pipe.group) {
+        int n_group = MIN(pipe.group, b->first + b->count - i0);
+        offline_parcel_t pp[VAP_BATCH];
+        for (int l = 0; l < n_group; l++) {
+            parcel_start(&pp[l], i0 + l);
+        }
+        for (int n = 0; n < pipe.max_steps; n++) {
+            offline_parcel_t *live[VAP_BATCH];
+            int idx[VAP_BATCH], m = 0;
+            for (int l = 0; l < n_group; l++) {
+                if (pp[l].alive) {
+                    live[m] = &pp[l];
+                    idx[m++] = l;
+                }
+            }
+            if (m == 0) {
+                break;
+            }
+            offline_step_t st[VAP_BATCH];
+            offline_group_step(live, m, &pipe.mesh, DPM_DT, vb, st);
+            for (int k = 0; k < m; k++) {
+                pipe_rec_t *r = &b->rec[b->n_rec++];
+                r->step = st[k];
+                parcel_record(r, live[k], i0 + idx[k], n);
+            }
+            steps += m;
+        }
+    }
+    atomic_fetch_add(&pipe.steps, steps);
+}
+
+static void *advance_thread(void *arg)
+{
+    pipe_thread_t *th = arg;
+    vap_batch_t *vb = NULL;
+    if (pipe.group > 0 && (vb = malloc(sizeof(vap_batch_t))) == NULL) {
+        Message("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (;;) {
+        pipe_batch_t *b = queue_get(&pipe.free_q, &th->st);
+        int first = atomic_fetch_add(&pipe.next_parcel, pipe.batch);
+        if (first >= pipe.n_parcels) {
+            queue_put(&pipe.free_q, b, &th->st);
+            break;
+        }
+        double t0 = vap_wtime();
+        b->first = first;
+        b->count = MIN(pipe.batch, pipe.n_parcels - first);
+        if (pipe.group > 0) {
+            advance_batch_grouped(b, vb);
+        } else {
+            advance_batch(b);
+        }
+        th->st.busy += vap_wtime() - t0;
+        th->st.items++;
+        queue_put(&pipe.advanced_q, b, &th->st);
+    }
+    free(vb);
+    stage_done(STAGE_ADVANCE, &pipe.advanced_q);
+    return NULL;
+}
+
+// Stage 2: deposition into the per-cell buffers of this thread.
+static void *deposit_thread(void *arg)
+{
+    pipe_thread_t *th = arg;
+    pipe_field_t *f = &pipe.fields[th->k];
+    for (;;) {
+        pipe_batch_t *b = queue_get(&pipe.advanced_q, &th->st);
+        if (b == &pipe_end) {
+            break;
+        }
+        double t0 = vap_wtime();
+        for (int i = 0; i < b->n_rec; i++) {
+            const offline_step_t *s = &b->rec[i].step;
+            int c = s->cell;
+            if (pipe.sparse) {
+                real *v = fla_acc_cell(&f->acc, c);
+                if (v != NULL) {
+                    v[FLA_ACC_W] += DPM_DT;
+                    v[FLA_ACC_N_P] += s->N_P*DPM_DT;
+                    v[FLA_ACC_MASS] += s->N_P*s->vap_rate*DPM_DT;
+                    v[FLA_ACC_HEAT] += s->N_P*s->dh_dt*DPM_DT;
+                    v[FLA_ACC_STEPS] += 1.0;
+                }
+            } else {
+                f->w[c] += DPM_DT;
+                f->n[c] += s->N_P*DPM_DT;
+                f->m[c] += s->N_P*s->vap_rate*DPM_DT;
+                f->h[c] += s->N_P*s->dh_dt*DPM_DT;
+            }
+            f->mass += s->vap_rate*DPM_DT;
+        }
+        th->st.busy += vap_wtime() - t0;
+        th->st.items++;
+        queue_put(&pipe.deposited_q, b, &th->st);
+    }
+    stage_done(STAGE_DEPOSIT, &pipe.deposited_q);
+    return NULL;
+}
+
+// Stage 3: trajectories every output_every steps and a diagnostics line per parcel.
+static void *output_thread(void *arg)
+{
+    pipe_thread_t *th = arg;
+    char name[1024];
+    FILE *traj, *diag;
+    if (pipe.outdir != NULL) {
+        snprintf(name, sizeof(name), "%s/traj-%d.csv", pipe.outdir, th->k);
+        traj = fopen(name, "w");
+        snprintf(name, sizeof(name), "%s/diag-%d.csv", pipe.outdir, th->k);
+        diag = fopen(name, "w");
+    } else {
+        traj = fopen("/dev/null", "w");
+        diag = fopen("/dev/null", "w");
+    }
+    if (traj == NULL || diag == NULL) {
+        Message("Cannot open output files\n");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(traj, "# parcel, t, x, y, d, T_s, T_av, N_P\n");
+    fprintf(diag, "# parcel, steps, t_end, d_end, T_av_end, N_P_end\n");
+    for (;;) {
+        pipe_batch_t *b = queue_get(&pipe.deposited_q, &th->st);
+        if (b == &pipe_end) {
+            break;
+        }
+        double t0 = vap_wtime();
+        for (int i = 0; i < b->n_rec; i++) {
+            const pipe_rec_t *r = &b->rec[i];
+            if (r->n % pipe.output_every == 0 || r->last) {
+                fprintf(traj, "%d, %e, %e, %e, %e, %e, %e, %e\n", r->parcel, r->t, r->x, r->y,
+                        r->d, r->Ts, r->T_av, r->step.N_P);
+            }
+            if (r->last) {
+                fprintf(diag, "%d, %d, %e, %e, %e, %e\n", r->parcel, r->n + 1, r->t, r->d,
+                        r->T_av, r->step.N_P);
+            }
+        }
+        th->st.busy += vap_wtime() - t0;
+        th->st.items++;
+        queue_put(&pipe.free_q, b, &th->st);
+    }
+    fclose(traj);
+    fclose(diag);
+    return NULL;
+}
+
+static int option(int argc, char *argv[], int *i, const char *name, int *value)
+{
+    if (strcmp(argv[*i], name) == 0 && *i + 1 < argc) {
+        *value = atoi(argv[++(*i)]);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    pipe.n_parcels = 2000;
+    pipe.batch = 16;
+    pipe.max_steps = 100;
+    pipe.n_batches = 32;
+    pipe.output_every = 10;
+    pipe.n_threads[STAGE_ADVANCE] = 4;
+    pipe.n_threads[STAGE_DEPOSIT] = 1;
+    pipe.n_threads[STAGE_OUTPUT] = 1;
+    pipe.outdir = NULL;
+    pipe.group = 0;
+    pipe.mesh_scale = 1;
+    for (int i = 1; i < argc; i++) {
+        if (option(argc, argv, &i, "-n", &pipe.n_parcels) || option(argc, argv, &i, "-b", &pipe.batch)
+            || option(argc, argv, &i, "-s", &pipe.max_steps) || option(argc, argv, &i, "-q", &pipe.n_batches)
+            || option(argc, argv, &i, "-a", &pipe.n_threads[STAGE_ADVANCE])
+            || option(argc, argv, &i, "-d", &pipe.n_threads[STAGE_DEPOSIT])
+            || option(argc, argv, &i, "-w", &pipe.n_threads[STAGE_OUTPUT])
+            || option(argc, argv, &i, "-e", &pipe.output_every)
+            || option(argc, argv, &i, "-l", &pipe.lattice_every)
+            || option(argc, argv, &i, "-g", &pipe.group) || option(argc, argv, &i, "-m", &pipe.mesh_scale)
+            || option(argc, argv, &i, "-c", &pipe.sparse)) {
+            continue;
+        }
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            pipe.outdir = argv[++i];
+            continue;
+        }
+        Message("Usage: %s [-n parcels] [-b batch] [-s max_steps] [-q batches] [-a advance_threads]"
+                 " [-d deposit_threads] [-w output_threads] [-e output_every] [-l lattice_every] [-g group]"
+                 " [-m mesh_scale] [-c sparse] [-o outdir]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    for (int s = 0; s < N_STAGES; s++) {
+        pipe.n_threads[s] = MAX(1, pipe.n_threads[s]);
+    }
+    pipe.batch = MAX(1, pipe.batch);
+    pipe.max_steps = MAX(1, pipe.max_steps);
+    pipe.output_every = MAX(1, pipe.output_every);
+    pipe.group = MAX(0, MIN(pipe.group, VAP_BATCH));
+    pipe.mesh_scale = MAX(1, pipe.mesh_scale);
+    pipe.n_batches = MAX(pipe.n_batches, pipe.n_threads[STAGE_ADVANCE]);
+
+    // spray into a hot air jet at 3 MPa
+    pipe.d0 = 20.e-6;
+    pipe.T0 = 300.0;
+    pipe.U_inj = 20.0;
+    pipe.delta = 2.e-3;
+    vap_dispatch_init(0);
+    if (offline_mesh_init(&pipe.mesh, 400*pipe.mesh_scale, 100*pipe.mesh_scale, 0.1, 0.02, 10.0, 1.0, 100.0, pipe.delta, 800.0, 500.0, 3.e6) != 0) {
+        Message("Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    int n_cells = pipe.mesh.nx*pipe.mesh.ny;
+    if (pipe.lattice_every > 0 && fla_lmesh_init(&pipe.lmesh, pipe.n_parcels, pipe.max_steps / pipe.lattice_every + 1) != 0) {
+        Message("Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t capacity = pipe.n_batches + pipe.n_threads[STAGE_DEPOSIT] + pipe.n_threads[STAGE_OUTPUT];
+    if (lfq_init(&pipe.free_q, capacity) || lfq_init(&pipe.advanced_q, capacity) || lfq_init(&pipe.deposited_q, capacity)) {
+        Message("Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    pipe_batch_t *batches = calloc(pipe.n_batches, sizeof(pipe_batch_t));
+    for (int i = 0; i < pipe.n_batches; i++) {
+        batches[i].rec = malloc((size_t)pipe.batch*pipe.max_steps*sizeof(pipe_rec_t));
+        if (batches[i].rec == NULL) {
+            Message("Out of memory\n");
+            return EXIT_FAILURE;
+        }
+        lfq_push(&pipe.free_q, &batches[i]);
+    }
+    pipe.fields = calloc(pipe.n_threads[STAGE_DEPOSIT], sizeof(pipe_field_t));
+    for (int k = 0; k < pipe.n_threads[STAGE_DEPOSIT]; k++) {
+        if (pipe.sparse && k > 0) {
+            continue;
+        }
+        pipe.fields[k].w = calloc(n_cells, sizeof(real));
+        pipe.fields[k].n = calloc(n_cells, sizeof(real));
+        pipe.fields[k].m = calloc(n_cells, sizeof(real));
+        pipe.fields[k].h = calloc(n_cells, sizeof(real));
+    }
+
+    atomic_init(&pipe.next_parcel, 0);
+    atomic_init(&pipe.steps, 0);
+    int n_all = 0;
+    for (int s = 0; s < N_STAGES; s++) {
+        atomic_init(&pipe.active[s], pipe.n_threads[s]);
+        n_all += pipe.n_threads[s];
+    }
+    pipe_thread_t *threads = calloc(n_all, sizeof(pipe_thread_t));
+    void *(*entry[N_STAGES])(void *) = { advance_thread, deposit_thread, output_thread };
+
+    double t0 = vap_wtime();
+    for (int s = 0, i = 0; s < N_STAGES; s++) {
+        for (int k = 0; k < pipe.n_threads[s]; k++, i++) {
+            threads[i].stage = s;
+            threads[i].k = k;
+            pthread_create(&threads[i].id, NULL, entry[s], &threads[i]);
+        }
+    }
+    for (int i = 0; i < n_all; i++) {
+        pthread_join(threads[i].id, NULL);
+    }
+    double wall = vap_wtime() - t0;
+
+    // merge the per-thread fields
+    pipe_field_t *f = &pipe.fields[0];
+    double t_merge = vap_wtime();
+    size_t bytes = 0;
+    long updates = 0;
+    if (pipe.sparse) {
+        // into the table of the first thread, then its touched cells into the arrays
+        for (int k = 1; k < pipe.n_threads[STAGE_DEPOSIT]; k++) {
+            bytes += fla_acc_bytes(&pipe.fields[k].acc);
+            updates += pipe.fields[k].acc.n;
+            if (fla_acc_merge(&f->acc, &pipe.fields[k].acc) != 0) {
+                Message("Out of memory\n");
+                return EXIT_FAILURE;
+            }
+            f->mass += pipe.fields[k].mass;
+        }
+        bytes += fla_acc_bytes(&f->acc);
+        updates += f->acc.n;
+        for (int i = 0; i < f->acc.n; i++) {
+            int slot = f->acc.touched[i];
+            int c = (int)f->acc.key[slot];
+            const real *v = &f->acc.v[FLA_ACC_N*slot];
+            f->w[c] = v[FLA_ACC_W];
+            f->n[c] = v[FLA_ACC_N_P];
+            f->m[c] = v[FLA_ACC_MASS];
+            f->h[c] = v[FLA_ACC_HEAT];
+        }
+    } else {
+        for (int k = 1; k < pipe.n_threads[STAGE_DEPOSIT]; k++) {
+            for (int c = 0; c < n_cells; c++) {
+                f->w[c] += pipe.fields[k].w[c];
+                f->n[c] += pipe.fields[k].n[c];
+                f->m[c] += pipe.fields[k].m[c];
+                f->h[c] += pipe.fields[k].h[c];
+            }
+            f->mass += pipe.fields[k].mass;
+        }
+        bytes = (size_t)pipe.n_threads[STAGE_DEPOSIT]*4*n_cells*sizeof(real);
+        updates = (long)pipe.n_threads[STAGE_DEPOSIT]*n_cells;
+    }
+    t_merge = vap_wtime() - t_merge;
+    int touched = 0;
+    real n_max = 0.0;
+    for (int c = 0; c < n_cells; c++) {
+        if (f->w[c] > 0.0) {
+            touched++;
+            n_max = MAX(n_max, f->n[c] / f->w[c]);
+        }
+    }
+
+    long steps = atomic_load(&pipe.steps);
+    Message("fluid: %s, parcels: %d, particle steps: %ld, wall time: %.3f s, %.1f steps/s\n",
+            FLUID_NAME, pipe.n_parcels, steps, wall, steps / wall);
+    Message("mesh: %d x %d cells, group: %d\n", pipe.mesh.nx, pipe.mesh.ny, pipe.group);
+    Message("cells touched: %d of %d, max mean N_P: %.4g, evaporated mass: %.6e kg\n",
+            touched, n_cells, n_max, f->mass);
+    Message("deposition buffers: %s, %.3f MB, merge: %ld cell updates, %.3e s\n",
+            pipe.sparse ? "sparse" : "dense", 1.e-6*bytes, updates, t_merge);
+    Message("%-8s %8s %8s %10s %10s %12s\n", "stage", "threads", "batches", "busy [%]", "wait [%]", "busy [s]");
+    for (int s = 0; s < N_STAGES; s++) {
+        stage_stats_t sum = { 0.0, 0.0, 0 };
+        for (int i = 0; i < n_all; i++) {
+            if (threads[i].stage == s) {
+                sum.busy += threads[i].st.busy;
+                sum.wait += threads[i].st.wait;
+                sum.items += threads[i].st.items;
+            }
+        }
+        real capacity_s = pipe.n_threads[s]*wall;
+        Message("%-8s %8d %8ld %10.1f %10.1f %12.3f\n", stage_name[s], pipe.n_threads[s], sum.items,
+                100.0*sum.busy / capacity_s, 100.0*sum.wait / capacity_s, sum.busy);
+    }
+
+    // concentration between the trajectories from the seed lattice
+    if (pipe.lattice_every > 0) {
+        real *n_l = calloc(n_cells, sizeof(real));
+        double t1 = vap_wtime();
+        int reached = offline_lmesh_deposit(&pipe.lmesh, &pipe.mesh, n_l);
+        double t_l = vap_wtime() - t1;
+        real nl_max = 0.0;
+        for (int c = 0; c < n_cells; c++) {
+            nl_max = MAX(nl_max, n_l[c]);
+        }
+        Message("Lagrangian mesh: %d x %d nodes, cells reached: %d (deposition: %d), max N_P: %.4g, %.3f s\n",
+                pipe.lmesh.n_seed, pipe.lmesh.n_level, reached, touched, nl_max, t_l);
+        if (pipe.outdir != NULL) {
+            char name[1024];
+            snprintf(name, sizeof(name), "%s/lmesh.csv", pipe.outdir);
+            FILE *out = fopen(name, "w");
+            if (out != NULL) {
+                fprintf(out, "# x, y, N_P (Lagrangian mesh), mean N_P (deposition)\n");
+                for (int c = 0; c < n_cells; c++) {
+                    fprintf(out, "%e, %e, %e, %e\n", (c % pipe.mesh.nx + 0.5)*pipe.mesh.dx,
+                            -0.5*pipe.mesh.Ly + (c / pipe.mesh.nx + 0.5)*pipe.mesh.dy, n_l[c],
+                            f->w[c] > 0.0 ? f->n[c] / f->w[c] : 0.0);
+                }
+                fclose(out);
+            }
+        }
+        free(n_l);
+        fla_lmesh_free(&pipe.lmesh);
+    }
+
+    for (int k = 0; k < pipe.n_threads[STAGE_DEPOSIT]; k++) {
+        free(pipe.fields[k].w); free(pipe.fields[k].n); free(pipe.fields[k].m); free(pipe.fields[k].h);
+        fla_acc_free(&pipe.fields[k].acc);
+    }
+    for (int i = 0; i < pipe.n_batches; i++) {
+        free(batches[i].rec);
+    }
+    free(pipe.fields); free(batches); free(threads);
+    free(pipe.free_q.slots); free(pipe.advanced_q.slots); free(pipe.deposited_q.slots);
+    offline_mesh_free(&pipe.mesh);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,31 @@
+/**********************************************************************
+Minimal replacement of udf.h for building the heating and evaporation
+kernels of fla-vap.c outside ANSYS Fluent (offline drivers and benchmarks).
+
+Define FLA_VAP_STANDALONE before including fla-vap.c. Only the property
+correlations and the Fluent independent kernels are compiled in this mode,
+all DEFINE_* UDFs are skipped.
+
+Copyright (C) 2018 Oyuna Rybdylova, Timur Zaripov - All Rights Reserved
+You may use, distribute and modify this code under the terms of the MIT license
+***********************************************************************/
+#ifndef FLA_VAP_STANDALONE_H
+#define FLA_VAP_STANDALONE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+typedef double real;
+
+#define Message printf
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define ABS(a)    ((a) < 0 ? -(a) : (a))
+
+// Same definitions as in Fluent's dpm.h
+#define DPM_AREA(d)          (PI*(d)*(d))
+#define DPM_DIAM_FROM_VOL(v) (cbrt(6.0*(v)/PI))
+
+#endif // FLA_VAP_STANDALONE_H
@@ -0,0 +1,380 @@
+/**********************************************************************
+Ensemble uncertainty quantification of the property correlations of
+fla-vap.c for a single droplet, run outside ANSYS Fluent.
+
+Every ensemble member scales the property correlations (saturation pressure,
+vapour c_p, diffusivity, latent heat, liquid density, viscosity, thermal
+conductivity and c_p) by log-normal factors with the relative standard
+deviations of the table below and integrates the droplet history with the
+production kernel vap_heat_mass(), as fla-vap-bench.c does for the nominal
+properties. Member 0 is the nominal one. The members are split into blocks,
+one per thread, and every thread runs its block in groups of VAP_BATCH
+members in lock-step: the series updates of a group run in the SIMD lanes of
+one vap_heat_mass_batch() call, each lane with the multipliers of its member
+(vap_prop_lanes). The ensemble is also run member by member with
+vap_heat_mass() (the scalar path) for the cost per member of both; the
+statistics are those of the batched run, which differs in rounding.
+Reported are the lifetime and its percentiles, and, with -o, the 5/50/95 %
+bands of T_s and d^2/d0^2 over time. A history ends when d^2/d0^2 < 0.01 or
+when the surface reaches the boiling point, where the model no longer
+applies. The lifetime is the time of the d^2/d0^2 = 0.01 crossing,
+interpolated within the step; the members ending at the boiling point have
+none and are reported separately with the percentiles of their boiling time
+(the crossing of p_sat(T_s) = p_g, also interpolated within the step).
+
+Build (the fluid is selected as in fla-vap.c, n-dodecane by default):
+    cc -O2 -pthread -o fla-vap-uq fla-vap-uq.c -lm
+Usage:
+    fla-vap-uq [-m members] [-t threads] [-s sigma_scale] [-o bands.csv]
+Not with VAP_MULTIRATE: the batched path takes full steps.
+
+Copyright (C) 2018 Oyuna Rybdylova, Timur Zaripov - All Rights Reserved
+You may use, distribute and modify this code under the terms of the MIT license
+***********************************************************************/
+#define FLA_VAP_STANDALONE
+#define VAP_PROP_UQ
+#include "fla-vap.c"
+
+#include "fla-vap-offline.h"
+
+#include <pthread.h>
+
+// Relative standard deviations of the property multipliers. The widest are
+// the vapour c_p (constant for iso-octane, see the FIXME) and the liquid c_p
+// (the iso-octane correlation is that of n-dodecane, see the typo comment).
+static const vap_prop_scale_t sigma = {
+    0.05,   // p_sat
+    0.10,   // c_v
+    0.10,   // D
+    0.03,   // L
+    0.01,   // rho_l
+    0.10,   // mu_l
+    0.05,   // k_l
+    0.05,   // c_l
+};
+
+// Droplet case, as "single" in fla-vap-bench.c.
+#define UQ_D0    (20.e-6)
+#define UQ_T0    (300.0)
+#define UQ_T_G   (880.0)
+#define UQ_P_G   (3.0e6)
+#define UQ_U_REL (1.0)
+#define UQ_T_END (20.e-3)
+#define UQ_N_T   ((int)(UQ_T_END / DPM_DT + 0.5) + 1)
+
+typedef struct uq_member_s {
+    vap_prop_scale_t scale;
+    int end;        // how the history ended, OFFLINE_ALIVE if it outlived t_end
+    real t_end;     // interpolated time of the end, see offline_history_t
+    real *Ts;       // [UQ_N_T], NaN after the end of the history
+    real *d2;
+} uq_member_t;
+
+static struct {
+    int n_members, n_threads;
+    int batched;    // run the blocks in groups of VAP_BATCH, see group_run()
+    uq_member_t *m;
+} uq;
+
+// Standard normal number k of member i (Box-Muller).
+static real normal(int i, int k)
+{
+    uint64_t h = splitmix64(((uint64_t)i << 8) + (uint64_t)k);
+    real u1 = offline_uniform(h) + 0.5 / 9007199254740992.0;
+    real u2 = offline_uniform(splitmix64(h)) + 0.5 / 9007199254740992.0;
+    return sqrt(-2.0*log(u1))*cos(2.0*PI*u2);
+}
+
+// Log-normal multipliers of member i; member 0 is nominal.
+static void member_scale(int i, real s, vap_prop_scale_t *sc)
+{
+    const real *sg = &sigma.p_sat;
+    real *f = &sc->p_sat;
+    int n = sizeof(vap_prop_scale_t) / sizeof(real);
+    for (int k = 0; k < n; k++) {
+        f[k] = i == 0 ? 1.0 : exp(s*sg[k]*normal(i, k));
+    }
+}
+
+// Droplet history of one member with its multipliers in vap_prop (the scalar path).
+static void member_run(uq_member_t *mb)
+{
+    vap_prop = mb->scale;
+    offline_droplet_t dr;
+    offline_droplet_init(&dr, UQ_D0, UQ_T0);
+
+    for (int n = 0; n < UQ_N_T; n++) {
+        mb->Ts[n] = NAN;
+        mb->d2[n] = NAN;
+    }
+    offline_history_t h;
+    offline_history_init(&h);
+    for (int n = 0; n < UQ_N_T && h.end == OFFLINE_ALIVE; n++) {
+        mb->Ts[n] = dr.s.T[N_INT];
+        mb->d2[n] = dr.d*dr.d / (UQ_D0*UQ_D0);
+        vap_rates_t r;
+        offline_history_step(&h, &dr, UQ_D0, UQ_T_G, UQ_P_G, UQ_U_REL, DPM_DT, &r);
+    }
+    mb->end = h.end;
+    mb->t_end = h.t_end;
+}
+
+// Droplet histories of the n <= VAP_BATCH members mb[] in lock-step, as
+// member_run() does for one. The members still alive take every step together
+// in one vap_heat_mass_batch() call with their multipliers in the lanes; the
+// parts around it (gas state, end of the history, mass update) set vap_prop
+// to the member's. A batch in which a surface balance failed is redone
+// member by member from the states before it, to find the failed members.
+// b is scratch space.
+static void group_run(uq_member_t *mb[], int n, vap_batch_t *b)
+{
+    offline_droplet_t dr[VAP_BATCH], dr_old[VAP_BATCH];
+    offline_history_t h[VAP_BATCH];
+    vap_prop_scale_t scale[VAP_BATCH];
+    vap_env_t g[VAP_BATCH];
+    vap_rates_t r[VAP_BATCH];
+    vap_state_t *s[VAP_BATCH];
+    const vap_env_t *gp[VAP_BATCH];
+    vap_rates_t *rp[VAP_BATCH];
+    real Dp[VAP_BATCH], rho_p[VAP_BATCH], dts[VAP_BATCH];
+    int lane[VAP_BATCH];    // member of every lane
+    for (int i = 0; i < n; i++) {
+        vap_prop = mb[i]->scale;
+        offline_droplet_init(&dr[i], UQ_D0, UQ_T0);
+        offline_history_init(&h[i]);
+        for (int k = 0; k < UQ_N_T; k++) {
+            mb[i]->Ts[k] = NAN;
+            mb[i]->d2[k] = NAN;
+        }
+    }
+    for (int k = 0; k < UQ_N_T; k++) {
+        int m = 0;
+        for (int i = 0; i < n; i++) {
+            if (h[i].end != OFFLINE_ALIVE) {
+                continue;
+            }
+            vap_prop = mb[i]->scale;
+            mb[i]->Ts[k] = dr[i].s.T[N_INT];
+            mb[i]->d2[k] = dr[i].d*dr[i].d / (UQ_D0*UQ_D0);
+            if (offline_history_check(&h[i], &dr[i], UQ_D0, UQ_P_G, DPM_DT) != OFFLINE_ALIVE) {
+                continue;
+            }
+            offline_droplet_env(&dr[i], UQ_T_G, UQ_P_G, UQ_U_REL, &g[m]);
+            dr_old[m] = dr[i];
+            scale[m] = mb[i]->scale;
+            s[m] = &dr[i].s;
+            gp[m] = &g[m];
+            rp[m] = &r[m];
+            Dp[m] = dr[i].d;
+            rho_p[m] = dr[i].rho;
+            dts[m] = DPM_DT;
+            lane[m++] = i;
+        }
+        if (m == 0) {
+            break;
+        }
+        vap_prop_lanes = scale;
+        int status = vap_heat_mass_batch(b, m, s, gp, Dp, rho_p, dts, rp);
+        vap_prop_lanes = NULL;
+        for (int l = 0; l < m; l++) {
+            int i = lane[l];
+            vap_prop = mb[i]->scale;
+            int st = status;
+            if (status != 0) {
+                dr[i] = dr_old[l];
+                st = vap_heat_mass(&dr[i].s, &g[l], dr[i].d, dr[i].rho, DPM_DT, &r[l]);
+            }
+            real m_old = dr[i].m;
+            int alive = offline_droplet_update(&dr[i], st, &r[l], DPM_DT);
+            offline_history_stepped(&h[i], &dr[i], m_old, alive, DPM_DT);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        mb[i]->end = h[i].end;
+        mb[i]->t_end = h[i].t_end;
+    }
+}
+
+// Thread k runs the block of members [k*n/n_threads, (k+1)*n/n_threads).
+static void *block_thread(void *arg)
+{
+    int k = (int)(intptr_t)arg;
+    int first = (int)((long)k*uq.n_members / uq.n_threads);
+    int last = (int)((long)(k + 1)*uq.n_members / uq.n_threads);
+    vap_batch_t *b = NULL;
+    if (uq.batched && (b = malloc(sizeof(vap_batch_t))) == NULL) {
+        Message("Out of memory, the members of thread %d run one by one\n", k);
+    }
+    for (int i = first; i < last; ) {
+        if (b != NULL) {
+            uq_member_t *mb[VAP_BATCH];
+            int n = 0;
+            while (n < VAP_BATCH && i < last) {
+                mb[n++] = &uq.m[i++];
+            }
+            group_run(mb, n, b);
+        } else {
+            member_run(&uq.m[i++]);
+        }
+    }
+    free(b);
+    return NULL;
+}
+
+// Runs the ensemble on uq.n_threads threads; returns the wall time, s.
+static double ensemble_run(int batched)
+{
+    uq.batched = batched;
+    double t0 = vap_wtime();
+    pthread_t *threads = malloc(uq.n_threads*sizeof(pthread_t));
+    for (int k = 0; k < uq.n_threads; k++) {
+        pthread_create(&threads[k], NULL, block_thread, (void *)(intptr_t)k);
+    }
+    for (int k = 0; k < uq.n_threads; k++) {
+        pthread_join(threads[k], NULL);
+    }
+    free(threads);
+    return vap_wtime() - t0;
+}
+
+static int compare_real(const void *a, const void *b)
+{
+    real x = *(const real *)a, y = *(const real *)b;
+    return (x > y) - (x < y);
+}
+
+// Percentile q of the n finite values in v (sorted in place); NaN if none.
+static real percentile(real v[], int n, real q)
+{
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+        if (isfinite(v[i])) {
+            v[m++] = v[i];
+        }
+    }
+    if (m == 0) {
+        return NAN;
+    }
+    qsort(v, m, sizeof(real), compare_real);
+    return v[(int)(q*(m - 1) + 0.5)];
+}
+
+int main(int argc, char *argv[])
+{
+    const char *out = NULL;
+    real sigma_scale = 1.0;
+    uq.n_members = 256;
+    uq.n_threads = 4;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            uq.n_members = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            uq.n_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            sigma_scale = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            out = argv[++i];
+        } else {
+            Message("Usage: %s [-m members] [-t threads] [-s sigma_scale] [-o bands.csv]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    uq.n_members = MAX(1, uq.n_members);
+    uq.n_threads = MAX(1, MIN(uq.n_threads, uq.n_members));
+
+    vap_dispatch_init(0);
+    uq.m = calloc(uq.n_members, sizeof(uq_member_t));
+    real *buf = malloc((size_t)2*uq.n_members*UQ_N_T*sizeof(real));
+    real *col = malloc((size_t)uq.n_members*sizeof(real));
+    if (uq.m == NULL || buf == NULL || col == NULL) {
+        Message("Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < uq.n_members; i++) {
+        member_scale(i, sigma_scale, &uq.m[i].scale);
+        uq.m[i].Ts = &buf[(size_t)2*i*UQ_N_T];
+        uq.m[i].d2 = &buf[(size_t)(2*i + 1)*UQ_N_T];
+    }
+
+    // the scalar path first, for its cost and its lifetimes
+    double wall_scalar = ensemble_run(0);
+    for (int i = 0; i < uq.n_members; i++) {
+        col[i] = uq.m[i].end == OFFLINE_EVAPORATED ? uq.m[i].t_end : NAN;
+    }
+    double wall = ensemble_run(1);
+    real dt_max = 0.0;
+    int changed = 0;
+    for (int i = 0; i < uq.n_members; i++) {
+        if (uq.m[i].end == OFFLINE_EVAPORATED && isfinite(col[i])) {
+            dt_max = MAX(dt_max, fabs(uq.m[i].t_end - col[i]));
+        } else {
+            changed += (uq.m[i].end == OFFLINE_EVAPORATED) != isfinite(col[i]);
+        }
+    }
+
+    int evaporated = 0, boiled = 0, failed = 0;
+    for (int i = 0; i < uq.n_members; i++) {
+        col[i] = uq.m[i].end == OFFLINE_EVAPORATED ? uq.m[i].t_end : NAN;
+        evaporated += uq.m[i].end == OFFLINE_EVAPORATED;
+        failed += uq.m[i].end == OFFLINE_FAILED;
+    }
+    real p5 = percentile(col, uq.n_members, 0.05);
+    real p50 = percentile(col, uq.n_members, 0.5);
+    real p95 = percentile(col, uq.n_members, 0.95);
+    for (int i = 0; i < uq.n_members; i++) {
+        col[i] = uq.m[i].end == OFFLINE_BOILING ? uq.m[i].t_end : NAN;
+        boiled += uq.m[i].end == OFFLINE_BOILING;
+    }
+    real b5 = percentile(col, uq.n_members, 0.05);
+    real b50 = percentile(col, uq.n_members, 0.5);
+    real b95 = percentile(col, uq.n_members, 0.95);
+
+    Message("fluid: %s, members: %d, threads: %d, sigma scale: %g, wall time: %.3f s (%.3f ms per member)\n",
+            FLUID_NAME, uq.n_members, uq.n_threads, sigma_scale, wall, 1.e3*wall / uq.n_members);
+    Message("scalar path: %.3f s (%.3f ms per member, %.2fx the batched cost), largest lifetime difference %.3e s, "
+            "%d members evaporated in one path only\n",
+            wall_scalar, 1.e3*wall_scalar / uq.n_members, wall_scalar / MAX(wall, 1.e-9), dt_max, changed);
+    if (uq.m[0].end == OFFLINE_EVAPORATED) {
+        Message("nominal lifetime [s]: %.4e\n", uq.m[0].t_end);
+    } else if (uq.m[0].end == OFFLINE_BOILING) {
+        Message("nominal boiling time [s]: %.4e\n", uq.m[0].t_end);
+    }
+    Message("lifetime [s] of the %d evaporated members: 5%% %.4e, median %.4e, 95%% %.4e\n", evaporated, p5, p50, p95);
+    Message("boiling time [s] of the %d members ending at the boiling point: 5%% %.4e, median %.4e, 95%% %.4e\n",
+            boiled, b5, b50, b95);
+    Message("members outliving t_end: %d, members whose surface balance failed: %d\n",
+            uq.n_members - evaporated - boiled - failed, failed);
+
+    if (out != NULL) {
+        FILE *f = fopen(out, "w");
+        if (f == NULL) {
+            Message("Cannot write %s\n", out);
+            return EXIT_FAILURE;
+        }
+        fprintf(f, "# t [s], T_s 5%%, T_s 50%%, T_s 95%%, d2 5%%, d2 50%%, d2 95%%, members alive\n");
+        for (int n = 0; n < UQ_N_T; n++) {
+            real b[6];
+            int alive = 0;
+            for (int i = 0; i < uq.n_members; i++) {
+                col[i] = uq.m[i].Ts[n];
+                alive += isfinite(col[i]);
+            }
+            if (alive == 0) {
+                break;
+            }
+            b[0] = percentile(col, uq.n_members, 0.05);
+            b[1] = percentile(col, uq.n_members, 0.5);
+            b[2] = percentile(col, uq.n_members, 0.95);
+            for (int i = 0; i < uq.n_members; i++) {
+                col[i] = uq.m[i].d2[n];
+            }
+            b[3] = percentile(col, uq.n_members, 0.05);
+            b[4] = percentile(col, uq.n_members, 0.5);
+            b[5] = percentile(col, uq.n_members, 0.95);
+            fprintf(f, "%e, %e, %e, %e, %e, %e, %e, %d\n", n*DPM_DT, b[0], b[1], b[2], b[3], b[4], b[5], alive);
+        }
+        fclose(f);
+    }
+    free(col); free(buf); free(uq.m);
+    return EXIT_SUCCESS;
+}
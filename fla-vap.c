@@ -31,31 +31,103 @@ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 ***********************************************************************/
+#ifdef FLA_VAP_STANDALONE
+#include "fla-vap-standalone.h"
+#else
 #include "udf.h"
+#endif
 #include <time.h>
+#include <string.h>
+#include <stdint.h>
 
 // user settings
+// the fluid can also be selected on the command line with -DWATER or -DISOOCTANE
+#if !defined(WATER) && !defined(ISOOCTANE)
 #define DODECANE
-#undef WATER
-#undef ISOOCTANE
+#endif
 #define FLA_AXISYM
+#undef FLA_TRACE // write per-node Chrome trace-event JSON of the DPM iterations, see fla_trace_*
+#undef FLA_BALANCE // per-rank load of every DPM pass printed by the host, see fla_balance_adjust
+#define CV_FRACTION (0.1) // multivap_control_variate: fraction of parcels that run the full model
+#undef FLA_TURB // turbulent FLA: diffusion correction of N_P from k and epsilon, see fla_turb_advance()
+#define FLA_TURB_SIGMA0 (1.e-4) // FLA_TURB: initial size of the seed puff (seed spacing), m
+#define FLA_TURB_C_L (0.15)     // FLA_TURB: T_L = C_L k / epsilon, as the time scale constant of Fluent's DRW model
+#undef FLA_MAGNUS // FLA jacobian by a second-order Magnus step with the gradients at both ends of the step, see fla_magnus_step()
+#undef FLA_FIELD // per-cell FLA fields in UDMs, reconstructed on a helper thread, see fla_field_*
+#define FLA_FIELD_UDM (0)       // FLA_FIELD: first of the 3 UDMs (mean N_P, max N_P, residence time)
+#define FLA_FIELD_SWEEPS (3)    // FLA_FIELD: layers of cells between trajectories that are filled in
+#undef FLA_FIELD_INCREMENTAL // FLA_FIELD: only the trajectories that changed since the last pass update the sums, see fla_traj_*
+#define FLA_FIELD_TOL (1.e-3)   // FLA_FIELD_INCREMENTAL: relative change of a trajectory's contribution to a cell that counts
+#define FLA_FIELD_REBUILD (20)  // FLA_FIELD_INCREMENTAL: passes between full rebuilds of the sums
+#undef VAP_TUNE // calibrate N_Lambda and the layer stride in the first iterations, see vap_tune_*
+#define VAP_TUNE_ITERS (5)        // VAP_TUNE: iterations of the calibration phase
+#define VAP_TUNE_FRACTION (0.01)  // VAP_TUNE: fraction of the particle steps sampled
+#define VAP_TUNE_TOL (1.e-3)      // VAP_TUNE: error tolerance relative to T_gas - T_s over a step
+#define VAP_BATCH (32)            // multivap_lagged: droplets per vectorised heat-mass batch
+#define VAP_LAG_TABLE (4096)      // multivap_lagged: slots per thread for the droplets' pending steps
+#define VAP_LAG_TOL (0.02)        // multivap_lagged: gas-state change over a step above which a lagged step is redone
+#undef VAP_OPERATOR // vap_heat_mass_batch: series update by cached operators per (h0, Fourier number) bucket, see vap_op_*
+#define VAP_OP_CACHE (64)         // VAP_OPERATOR: operators cached per thread
+#define VAP_OP_BIN (1.e-3)        // VAP_OPERATOR: relative width of the buckets of h0 + 1 and of the Fourier number
+#define VAP_OP_MIN_LANES (8)      // VAP_OPERATOR: lanes of a batch in an uncached bucket for which its operator is built
+#undef VAP_GRID_CLUSTER // droplet layers clustered toward the surface, see VAP_R
+#define VAP_GRID_BETA (2.0)       // VAP_GRID_CLUSTER: r = tanh(beta j / N_INT) / tanh(beta)
+#undef VAP_SAT_LIMIT // cell-local implicit limit of the vapour source of dense sprays, see vap_sat_*
+#define VAP_SAT_UDM (3)           // VAP_SAT_LIMIT: first of its 4 UDMs (after the FLA_FIELD ones)
+#undef FLA_ACC // sparse per-cell spray sums of every DPM pass, scattered into UDMs of the touched cells, see fla_acc_*
+#define FLA_ACC_UDM (7)           // FLA_ACC: first of its 7 UDMs (after the VAP_SAT_LIMIT ones)
+#undef VAP_MULTIRATE // surface balance every step, interior series every k steps with error control, see vap_heat_mass_multirate()
+#define VAP_MR_K_MAX (16)         // VAP_MULTIRATE: most steps between two interior solves
+#define VAP_MR_TOL (0.05)         // VAP_MULTIRATE: tolerated error of the extrapolated surface temperature, K
+#define VAP_MR_FO (0.2)           // VAP_MULTIRATE: largest Fourier number kappa lambda_1^2 t of an interval
+#define VAP_MR_YS_MAX (0.8)       // VAP_MULTIRATE: surface vapour fraction above which every step is solved
+#define VAP_CKPT_NAME "fla-vap-ckpt" // vap_ckpt_write/read: side-files <name>-<node>.bin
+#define VAP_DPM_RPVAR "dpm/iteration-interval" // vap_dpm_adjust: rpvar of the DPM iteration interval of the Fluent version
+#define VAP_DPM_MIN_INTERVAL (5)    // vap_dpm_adjust: fewest continuous-phase iterations between DPM passes
+#define VAP_DPM_MAX_INTERVAL (100)  // vap_dpm_adjust: most continuous-phase iterations between DPM passes
+#define VAP_DPM_DRIFT_TOL (0.01)    // vap_dpm_adjust: RMS change of the gas T, |u| (relative to their range) that calls for a pass
+#define VAP_DPM_SRC_TOL (0.01)      // vap_dpm_adjust: relative change of the droplet sources between passes of a converged spray
 
 #define DPM_DT (1.e-4)
 
 #define BM_MAX 1.E20
 #define BM_MIN -0.99999
 #define ACCURACY 1.e-6
+#define BT_MAX_ITER 100 // vap_surface_balance: cap of the BT iteration, which can cycle for unphysical properties
 #define PI 3.1415926535897932384626433832795
 #define N_Lambda 44 // number of terms in the series
 #define N_INT 100 // number of layers inside a droplet
 #define Delta_R 0.01 // = 1/N_INT
+// Radius of layer j (r = 1 at the surface) and dr/dxi with xi = j*Delta_R;
+// the layer integrals are Simpson's rule in xi, so T_s stays at r = 1 and
+// the weights follow the grid.
+#ifdef VAP_GRID_CLUSTER
+#define VAP_R(j)  (tanh(VAP_GRID_BETA*((double)(j))*Delta_R) / tanh(VAP_GRID_BETA))
+#define VAP_DR(j) (VAP_GRID_BETA*(1.0 - tanh(VAP_GRID_BETA*((double)(j))*Delta_R)*tanh(VAP_GRID_BETA*((double)(j))*Delta_R)) \
+                   / tanh(VAP_GRID_BETA))
+#else
+#define VAP_R(j)  (((double)(j))*Delta_R)
+#define VAP_DR(j) (1.0)
+#endif
 
-// 136 DPM_USER_REALs have to be enabled in ANSYS Fluent.
+// 136 DPM_USER_REALs (146 with FLA_TURB, 5 more with FLA_MAGNUS, VAP_MR_N more with VAP_MULTIRATE) have to be
+// enabled in ANSYS Fluent, VAP_CV_N more for multivap_control_variate.
 // there is a check in Heat and Mass transfer on the number of components
 #define NCOMPONENTS 1
 #define VAP_END (116)
 #define FLA_OFFSET (VAP_END + 4) // DPM_USER_REALs are required by VPA part
-#define FLA_N_SCAL (16)          // DPM_USER_REALs required by FLA part
+// FLA_MAGNUS keeps the gradients of the last FLA step and a flag that they
+// are set at the end of the FLA block, see fla_magnus_step().
+#ifdef FLA_MAGNUS
+#define FLA_N_MAGNUS (5)
+#else
+#define FLA_N_MAGNUS (0)
+#endif
+#ifdef FLA_TURB
+#define FLA_N_SCAL (26 + FLA_N_MAGNUS) // DPM_USER_REALs required by FLA part
+#else
+#define FLA_N_SCAL (16 + FLA_N_MAGNUS) // DPM_USER_REALs required by FLA part
+#endif
 
 #define P_VAP_dhdt(p)         P_USER_REAL(p, VAP_END)
 #define P_VAP_dhdt_scaled(p)  P_USER_REAL(p, VAP_END + 1)
@@ -91,6 +163,164 @@ SOFTWARE.
 // #define A_V_P(p)    P_USER_REAL(p, FLA_OFFSET + 15)  // velocity y-component
 // END FLA defines 
 
+// BEGIN VAP staging
+// The heating and evaporation model keeps its state in DPM_USER_REALs
+// [0, VAP_END). For nc == NCOMPONENTS the layout is:
+//   [0, nc)            x_surf    molar fractions at the surface
+//   [nc, 2nc)          Ys        mass fractions at the surface
+//   [2nc, 3nc)         vap_rate  evaporation rates
+//   3nc                h         heat transfer coefficient
+//   4nc ... 4nc+6      Ys_tot, tot_vap_rate, BM, BT, L_eff, Nu, T_av
+//   4nc+7 ...          temperature at the N_INT+1 layers, the last one is the surface
+//   ... VAP_END-1      coef, Nu_star, D, kgas (diagnostics)
+#define VAP_I_X_SURF(ns)   (ns)
+#define VAP_I_YS(ns)       (NCOMPONENTS + (ns))
+#define VAP_I_RATE(ns)     (2 * NCOMPONENTS + (ns))
+#define VAP_I_H            (3 * NCOMPONENTS)
+#define VAP_I_YS_TOT       (4 * NCOMPONENTS)
+#define VAP_I_TOT_RATE     (4 * NCOMPONENTS + 1)
+#define VAP_I_BM           (4 * NCOMPONENTS + 2)
+#define VAP_I_BT           (4 * NCOMPONENTS + 3)
+#define VAP_I_L_EFF        (4 * NCOMPONENTS + 4)
+#define VAP_I_NU           (4 * NCOMPONENTS + 5)
+#define VAP_I_T_AV         (4 * NCOMPONENTS + 6)
+#define VAP_I_T(j)         (4 * NCOMPONENTS + 7 + (j))
+#define VAP_I_COEF         VAP_I_T(N_INT + 1)
+#define VAP_I_NU_STAR      VAP_I_T(N_INT + 2)
+#define VAP_I_D            VAP_I_T(N_INT + 3)
+#define VAP_I_KGAS         VAP_I_T(N_INT + 4)
+// VAP_MULTIRATE keeps VAP_MR_N more values after the FLA block, see
+// vap_heat_mass_multirate(): surface and average temperature of the last
+// interior solve and their rates, time and steps since that solve, the steps
+// k between solves and the dt-weighted sums of h0, kappa and T_eff.
+#ifdef VAP_MULTIRATE
+#define VAP_MR_OFFSET      (FLA_OFFSET + FLA_N_SCAL)
+#define VAP_MR_N           (10)
+#else
+#define VAP_MR_N           (0)
+#endif
+#define VAP_MR_TS          (0)
+#define VAP_MR_TAV         (1)
+#define VAP_MR_DTS         (2)
+#define VAP_MR_DTAV        (3)
+#define VAP_MR_T           (4)
+#define VAP_MR_N_STEPS     (5)
+#define VAP_MR_K           (6)
+#define VAP_MR_H0          (7)
+#define VAP_MR_KAPPA       (8)
+#define VAP_MR_T_EFF       (9)
+// multivap_control_variate keeps the shadow lumped state of a sampled parcel
+// in VAP_CV_N more values after those: temperature, mass and a flag that they
+// are set. Only that hook touches them.
+#define VAP_CV_OFFSET      (FLA_OFFSET + FLA_N_SCAL + VAP_MR_N)
+#define VAP_CV_N           (3)
+#define VAP_CV_T           (0)
+#define VAP_CV_M           (1)
+#define VAP_CV_SET         (2)
+
+#if defined(_MSC_VER)
+#define VAP_ALIGN __declspec(align(64))
+#define VAP_THREAD_LOCAL __declspec(thread)
+#else
+#define VAP_ALIGN __attribute__((aligned(64)))
+#define VAP_THREAD_LOCAL __thread
+#endif
+
+// Per-thread objects of a node (tables, counters) that adjust functions sum
+// up between the DPM passes. A thread allocates its object on first use with
+// vap_registry_new() and keeps it in a VAP_THREAD_LOCAL pointer; the slot is
+// claimed atomically, so no lock is needed. The objects are aligned for the
+// VAP_ALIGN members of the kernel state.
+#define VAP_MAX_THREADS (256)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define VAP_FETCH_INC(x) (_InterlockedIncrement(x) - 1)
+#define vap_aligned_free(p) _aligned_free(p)
+#else
+#define VAP_FETCH_INC(x) __sync_fetch_and_add((x), 1)
+#define vap_aligned_free(p) free(p)
+#endif
+
+typedef struct vap_registry_s {
+    void *obj[VAP_MAX_THREADS];
+    volatile long n;        // claimed slots, may exceed VAP_MAX_THREADS
+} vap_registry_t;
+
+// Number of slots to loop over; a slot may still be NULL while its thread registers.
+#define VAP_REGISTRY_N(r) ((int)MIN((r)->n, VAP_MAX_THREADS))
+
+// New zeroed object of size bytes of the calling thread, registered in r;
+// NULL if out of memory or if there are more than VAP_MAX_THREADS threads.
+static void *vap_registry_new(vap_registry_t *r, size_t size)
+{
+#if defined(_MSC_VER)
+    void *obj = _aligned_malloc(size, 64);
+#else
+    void *obj = NULL;
+    if (posix_memalign(&obj, 64, size) != 0) {
+        obj = NULL;
+    }
+#endif
+    if (obj == NULL) {
+        return NULL;
+    }
+    memset(obj, 0, size);
+    long k = VAP_FETCH_INC(&r->n);
+    if (k >= VAP_MAX_THREADS) {
+        if (k == VAP_MAX_THREADS) {
+            Message("ALARM!!! More than %d threads record particle steps, the others are not accounted\n", VAP_MAX_THREADS);
+        }
+        vap_aligned_free(obj);
+        return NULL;
+    }
+    r->obj[k] = obj;
+    return obj;
+}
+
+// Frees the objects of r; their threads must not use them any more (library unload).
+void vap_registry_free(vap_registry_t *r)
+{
+    for (int k = 0; k < VAP_REGISTRY_N(r); k++) {
+        vap_aligned_free(r->obj[k]);
+        r->obj[k] = NULL;
+    }
+}
+
+// Wall clock, s; the one clock of the UDF and the offline drivers (the trace
+// scales it to us).
+double vap_wtime(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + 1.e-9*(double)ts.tv_nsec;
+}
+
+// Local copy of the hot user-real block of one particle. It is loaded once per
+// call by vap_read_user_real(), all the heating math works on it and it is
+// written back once by vap_update_user_real().
+typedef struct vap_state_s {
+    VAP_ALIGN real T[N_INT + 1];    // temperature at r = j*Delta_R, T[N_INT] at the surface
+    real x_surf[NCOMPONENTS];
+    real Ys[NCOMPONENTS];
+    real vap_rate[NCOMPONENTS];
+    real h;
+    real Ys_tot;
+    real tot_vap_rate;
+    real BM;
+    real BT;
+    real L_eff;
+    real Nu;
+    real T_av;
+    real coef;
+    real Nu_star;
+    real D;
+    real kgas;
+#ifdef VAP_MULTIRATE
+    real mr[VAP_MR_N];
+#endif
+} vap_state_t;
+// END VAP staging
+
 #ifdef WATER
 // Carl L. Yaws-Thermophysical Properties of Chemicals and Hydrocarbons-William 
 // Andrew (2008)
@@ -321,86 +551,450 @@ real get_liquid_c_p(real T)
 }
 #endif // isooctane
 
+// BEGIN property perturbations
+// Multipliers of the property correlations for uncertainty studies, see
+// fla-vap-uq.c. Compiled in with VAP_PROP_UQ only: the calls made by the
+// kernels below are then redirected to scaled versions, the multipliers are
+// thread local so that every thread can run its own ensemble member.
+#ifdef VAP_PROP_UQ
+typedef struct vap_prop_scale_s {
+    real p_sat;     // get_vapour_saturation_pressure
+    real c_v;       // get_vapour_c_p
+    real D;         // get_vapour_binary_diffusivity
+    real L;         // get_liquid_latent_heat
+    real rho_l;     // get_liquid_density
+    real mu_l;      // get_liquid_visc
+    real k_l;       // get_liquid_k
+    real c_l;       // get_liquid_c_p
+} vap_prop_scale_t;
+
+VAP_THREAD_LOCAL vap_prop_scale_t vap_prop = { 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0 };
+// Multipliers of the lanes of vap_heat_mass_batch(), which sets vap_prop to
+// those of a lane before the per-droplet parts of its step; NULL if all lanes
+// take vap_prop. Lets a batch hold droplets of different ensemble members.
+VAP_THREAD_LOCAL const vap_prop_scale_t *vap_prop_lanes = NULL;
+#define VAP_PROP_LANE(l) do { if (vap_prop_lanes != NULL) { vap_prop = vap_prop_lanes[l]; } } while (0)
+
+real uq_vapour_saturation_pressure(real T) { return vap_prop.p_sat*get_vapour_saturation_pressure(T); }
+real uq_vapour_c_p(real T) { return vap_prop.c_v*get_vapour_c_p(T); }
+real uq_vapour_binary_diffusivity(real p, real T) { return vap_prop.D*get_vapour_binary_diffusivity(p, T); }
+real uq_liquid_latent_heat(real T) { return vap_prop.L*get_liquid_latent_heat(T); }
+real uq_liquid_density(real T) { return vap_prop.rho_l*get_liquid_density(T); }
+real uq_liquid_visc(real T) { return vap_prop.mu_l*get_liquid_visc(T); }
+real uq_liquid_k(real T) { return vap_prop.k_l*get_liquid_k(T); }
+real uq_liquid_c_p(real T) { return vap_prop.c_l*get_liquid_c_p(T); }
+
+#define get_vapour_saturation_pressure uq_vapour_saturation_pressure
+#define get_vapour_c_p                 uq_vapour_c_p
+#define get_vapour_binary_diffusivity  uq_vapour_binary_diffusivity
+#define get_liquid_latent_heat         uq_liquid_latent_heat
+#define get_liquid_density             uq_liquid_density
+#define get_liquid_visc                uq_liquid_visc
+#define get_liquid_k                   uq_liquid_k
+#define get_liquid_c_p                 uq_liquid_c_p
+#else
+#define VAP_PROP_LANE(l)
+#endif // VAP_PROP_UQ
+// END property perturbations
 
 // BEGIN FLA functions 
-// Convenience function. Working with P_USER_REAL is cumbersome, hence we copy
-// data to local array.
-int fla_read_user_real(real y[], Tracked_Particle *p)
-{
-    for (int i=0; i<N_EQ; i++) {
-        y[i] = P_USER_REAL(p, FLA_OFFSET + i);
-    }
-    return 0;
-}
+// Positions of the FLA scalars in the local copy of the FLA block, see J11(p)...
+#define FLA_I_J_DET    (8)
+#define FLA_I_N_P      (9)
+#define FLA_I_N_J_SIGN (10)
+#define FLA_I_BETA     (11)
+#define FLA_I_R_0      (12)
 
-// Convenience function. Complements fla_read_user_real().
-int fla_update_user_real(const real y[], Tracked_Particle *p)
-{
-    for (int i=0; i<N_EQ; i++) {
-        P_USER_REAL(p, FLA_OFFSET + i) = y[i];
-    }
-    return 0;
-}
+// FLA_TURB: upper triangle of the covariance of the seed puff in
+// (x, y, u, v), P_00, P_01, P_02, P_03, P_11, ..., P_33.
+#define FLA_I_TURB     (16)
+#define FLA_N_TURB     (10)
+
+// Velocity gradients of the carrier phase used by fla_dydt(), in this order.
+#define FLA_N_GRAD (4) // du/dx, du/dy, dv/dx, dv/dy
+
+// FLA_MAGNUS: gradients of the last step, then the flag that they are set.
+#define FLA_I_MAGNUS   (FLA_N_SCAL - FLA_N_MAGNUS)
 
 // The system of ODE for Jacobian and W components, that we solve using RK4 method.
-int fla_dydt(const real y[], real f[], real tau, cell_t c, Thread *t)
+int fla_dydt(const real y[], real f[], real tau, const real grad[])
 {
     f[0] = y[4]; // dj11/dt = w11
     f[1] = y[5]; // dj12/dt = w12
     f[2] = y[6]; // dj21/dt = w21
     f[3] = y[7]; // dj22/dt = w22
-    f[4] = (y[0]*C_DUDX(c,t) + y[2]*C_DUDY(c,t) - y[4]) / tau; // w11
-    f[5] = (y[1]*C_DUDX(c,t) + y[3]*C_DUDY(c,t) - y[5]) / tau; // w12
-    f[6] = (y[0]*C_DVDX(c,t) + y[2]*C_DVDY(c,t) - y[6]) / tau; // w21
-    f[7] = (y[1]*C_DVDX(c,t) + y[3]*C_DVDY(c,t) - y[7]) / tau; // w22
+    f[4] = (y[0]*grad[0] + y[2]*grad[1] - y[4]) / tau; // w11
+    f[5] = (y[1]*grad[0] + y[3]*grad[1] - y[5]) / tau; // w12
+    f[6] = (y[0]*grad[2] + y[2]*grad[3] - y[6]) / tau; // w21
+    f[7] = (y[1]*grad[2] + y[3]*grad[3] - y[7]) / tau; // w22
     return EXIT_SUCCESS;
 }
 
-// 4th order Runge--Kutta method step (RK4).
-int fla_rk4_step(Tracked_Particle *p, cell_t c, Thread *t)
+// 4th order Runge--Kutta method step (RK4) of the first N_EQ components of
+// the local FLA block y over the time step h.
+int fla_rk4_step(real y[], real h, real tau, const real grad[])
 {
-    // Here we make sure, that we are using the same drag law, that is used by Fluent. 
-    // See DEFINE_DPM_DRAG in the manual.
-    real tau = P_RHO(p) * P_DIAM(p) * P_DIAM(p) / (p->cphase->mu * DragCoeff(p));
-    BETA(p) = 1.0/tau;
-    // Use the same Runge-Kutta time step as Fluent.
-    real h = P_DT(p);
-    real y[N_EQ];
-    fla_read_user_real(y, p);
     //---------------------------------------------------------------
     // Below is the classical RK4 method.
     //---------------------------------------------------------------
     real y_tmp[N_EQ];
     real k1[N_EQ], k2[N_EQ], k3[N_EQ], k4[N_EQ];
     // k1 = f(t, y)
-    fla_dydt(y, k1, tau, c, t);
+    fla_dydt(y, k1, tau, grad);
     // k2 = f(t + h/2, y + k1*h/2)
     for(int i = 0; i < N_EQ; i++){
         y_tmp[i] = y[i] + k1[i] * h/2;
     }
-    fla_dydt(y_tmp, k2, tau, c, t);
+    fla_dydt(y_tmp, k2, tau, grad);
     // k3 = f(t + h/2, y + k2*h/2)
     for(int i = 0; i < N_EQ; i++){
         y_tmp[i] = y[i] + k2[i] * h/2;
     }
-    fla_dydt(y_tmp, k3, tau, c, t);
+    fla_dydt(y_tmp, k3, tau, grad);
     // k4 = f(t + h, y + k3*h)
     for(int i = 0; i < N_EQ; i++){
         y_tmp[i] = y[i] + k3[i] * h;
     }
-    fla_dydt(y_tmp, k4, tau, c, t);
+    fla_dydt(y_tmp, k4, tau, grad);
     // y_{i+1} = y_i + (k_1 + 2*k_2 + 2*k_3 + k_4)*h/6
     for(int i = 0; i < N_EQ; i++){
         y[i] = y[i] + (k1[i] + 2 * k2[i] + 2 * k3[i] + k4[i]) * h/6;
     }
     //---------------------------------------------------------------
-    fla_update_user_real(y, p);
     return EXIT_SUCCESS;
 }
+
+#ifdef FLA_MAGNUS
+// E = exp(M) of a 4x4 matrix by scaling and squaring: Taylor series of
+// degree 10 of M/2^s with |M/2^s| <= 1/4, then s squarings.
+static void fla_expm4(real M[4][4], real E[4][4])
+{
+    real norm = 0.0;
+    for (int i = 0; i < 4; i++) {
+        norm = MAX(norm, fabs(M[i][0]) + fabs(M[i][1]) + fabs(M[i][2]) + fabs(M[i][3]));
+    }
+    int n_sq = 0;
+    real scale = 1.0;
+    while (norm*scale > 0.25 && n_sq < 64) {
+        scale *= 0.5;
+        n_sq++;
+    }
+    real P[4][4], Q[4][4];
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            M[i][j] *= scale;
+            E[i][j] = (i == j);
+        }
+    }
+    // Horner: E = I + M (I + M/2 (I + ... (I + M/10)))
+    for (int k = 10; k >= 1; k--) {
+        for (int i = 0; i < 4; i++) {
+            for (int j = 0; j < 4; j++) {
+                P[i][j] = (i == j) + (M[i][0]*E[0][j] + M[i][1]*E[1][j] + M[i][2]*E[2][j] + M[i][3]*E[3][j]) / k;
+            }
+        }
+        memcpy(E, P, sizeof(P));
+    }
+    for (int l = 0; l < n_sq; l++) {
+        for (int i = 0; i < 4; i++) {
+            for (int j = 0; j < 4; j++) {
+                Q[i][j] = E[i][0]*E[0][j] + E[i][1]*E[1][j] + E[i][2]*E[2][j] + E[i][3]*E[3][j];
+            }
+        }
+        memcpy(E, Q, sizeof(Q));
+    }
+}
+
+// Second-order Magnus step (exponential midpoint) of the first N_EQ
+// components of the local FLA block y over h. Both columns of (J, W) follow
+//   d/dt (j1, j2, w1, w2) = A (j1, j2, w1, w2),  A = [0 I; G/tau -I/tau],
+// with G the velocity gradient along the path. A at the middle of the step is
+// the mean of A with grad (the end of the step, as the cell of the particle
+// after its motion) and with the gradients of the previous step cached in y
+// (its start), so a particle crossing into cells with other gradients keeps
+// the second order. exp(h A) is exact for frozen gradients and stays bounded
+// for any h/tau, unlike RK4. The first step has no cache and freezes grad.
+int fla_magnus_step(real y[], real h, real tau, const real grad[])
+{
+    real *grad_old = &y[FLA_I_MAGNUS];
+    int cached = y[FLA_I_MAGNUS + FLA_N_GRAD] > 0.0;
+    real g[FLA_N_GRAD];
+    for (int i = 0; i < FLA_N_GRAD; i++) {
+        g[i] = cached ? 0.5*(grad_old[i] + grad[i]) : grad[i];
+    }
+    real a = h / tau;
+    real M[4][4] = {
+        { 0.0,     0.0,     h,   0.0 },
+        { 0.0,     0.0,     0.0, h   },
+        { a*g[0],  a*g[1],  -a,  0.0 },
+        { a*g[2],  a*g[3],  0.0, -a  },
+    };
+    real E[4][4];
+    fla_expm4(M, E);
+    // column c of (J, W) is y[c], y[2 + c], y[4 + c], y[6 + c]
+    for (int c = 0; c < 2; c++) {
+        real z[4] = { y[c], y[2 + c], y[4 + c], y[6 + c] };
+        for (int i = 0; i < 4; i++) {
+            y[2*i + c] = E[i][0]*z[0] + E[i][1]*z[1] + E[i][2]*z[2] + E[i][3]*z[3];
+        }
+    }
+    for (int i = 0; i < FLA_N_GRAD; i++) {
+        grad_old[i] = grad[i];
+    }
+    y[FLA_I_MAGNUS + FLA_N_GRAD] = 1.0;
+    return EXIT_SUCCESS;
+}
+#endif // FLA_MAGNUS
+
+// Advances the local FLA block y over h: the jacobian with RK4 (with
+// FLA_MAGNUS by fla_magnus_step()), then its determinant, the number density
+// and the count of sign changes.
+int fla_advance_generic(real y[], real h, real tau, const real grad[])
+{
+    y[FLA_I_BETA] = 1.0/tau;
+#ifdef FLA_MAGNUS
+    fla_magnus_step(y, h, tau, grad);
+#else
+    fla_rk4_step(y, h, tau, grad);
+#endif
+    // Compute new determinant of the jacobian:
+    real div = y[0]*y[3] - y[1]*y[2];
+    // Check if jacobian changed sign:
+    if (signbit(y[FLA_I_J_DET]) != signbit(div)) {
+        y[FLA_I_N_J_SIGN]++;
+    }
+    y[FLA_I_J_DET] = div;
+    y[FLA_I_N_P] = 1./fabs(div);
+    return EXIT_SUCCESS;
+}
+
+// Variant of fla_advance_generic() for the CPU, see VAP dispatch.
+int (*fla_advance_p)(real y[], real h, real tau, const real grad[]) = fla_advance_generic;
+
+int fla_advance(real y[], real h, real tau, const real grad[])
+{
+    return fla_advance_p(y, h, tau, grad);
+}
+
+// Initial FLA block: J = I, W = 0, N_P = 1.
+int fla_init(real y[])
+{
+    for (int i = 0; i < FLA_N_SCAL; i++) {
+        y[i] = 0.;
+    }
+    y[0] = 1.; y[3] = 1.;
+    y[FLA_I_J_DET] = 1.; y[FLA_I_N_P] = 1.;
+#ifdef FLA_TURB
+    y[FLA_I_TURB + 0] = FLA_TURB_SIGMA0*FLA_TURB_SIGMA0; // P_00
+    y[FLA_I_TURB + 4] = FLA_TURB_SIGMA0*FLA_TURB_SIGMA0; // P_11
+#endif
+    return EXIT_SUCCESS;
+}
+
+#ifdef FLA_TURB
+// Turbulent FLA. The seed is a puff of size FLA_TURB_SIGMA0 whose deviations
+// z = (dx, dy, du, dv) from the deterministic trajectory follow the same
+// linearised equations as the jacobian, dz/dt = F z, plus the turbulent
+// velocity of the gas seen as white noise. The covariance P = <z z^T> obeys
+//     dP/dt = F P + P F^T + Q,  Q_uu = Q_vv = 2 u'^2 T_L / tau^2,
+// with u'^2 = 2k/3 and T_L = C_L k/eps, so the puff spreads with the long
+// time particle diffusivity u'^2 T_L. Without turbulence P_xx = sigma0^2 J J^T
+// and N_P = sigma0^2 / sqrt(det P_xx) is the laminar 1/|det J|; with it the
+// puff stays finite at caustics and N_P is the mean concentration of a single
+// deterministic trajectory instead of an average over stochastic tries.
+static const int fla_turb_index[4][4] = {
+    { 0, 1, 2, 3 },
+    { 1, 4, 5, 6 },
+    { 2, 5, 7, 8 },
+    { 3, 6, 8, 9 },
+};
+
+int fla_turb_dydt(const real P[], real f[], real tau, const real grad[], real q)
+{
+    real F[4][4] = {
+        { 0.0, 0.0, 1.0, 0.0 },
+        { 0.0, 0.0, 0.0, 1.0 },
+        { grad[0] / tau, grad[1] / tau, -1.0 / tau, 0.0 },
+        { grad[2] / tau, grad[3] / tau, 0.0, -1.0 / tau },
+    };
+    for (int i = 0; i < 4; i++) {
+        for (int j = i; j < 4; j++) {
+            real FP = 0.0;
+            for (int k = 0; k < 4; k++) {
+                FP += F[i][k]*P[fla_turb_index[k][j]] + P[fla_turb_index[i][k]]*F[j][k];
+            }
+            f[fla_turb_index[i][j]] = FP;
+        }
+    }
+    f[fla_turb_index[2][2]] += q;
+    f[fla_turb_index[3][3]] += q;
+    return EXIT_SUCCESS;
+}
+
+// Number density from the covariance P: area of the puff relative to the seed.
+real fla_turb_n_p(const real P[])
+{
+    real det = P[0]*P[4] - P[1]*P[1];
+    return FLA_TURB_SIGMA0*FLA_TURB_SIGMA0 / sqrt(MAX(det, 1.e-12*FLA_TURB_SIGMA0*FLA_TURB_SIGMA0*FLA_TURB_SIGMA0*FLA_TURB_SIGMA0));
+}
+
+// Advances the puff covariance of the FLA block y over h (RK4, as the
+// jacobian) and replaces N_P by the turbulent number density. Call after
+// fla_advance(); k and eps are the turbulence quantities of the cell.
+int fla_turb_advance(real y[], real h, real tau, const real grad[], real k, real eps)
+{
+    real q = 0.0;
+    if (k > 0.0 && eps > 0.0) {
+        real T_L = FLA_TURB_C_L*k / eps;
+        q = 2.0*(2.0 / 3.0*k)*T_L / (tau*tau);
+    }
+    real *P = &y[FLA_I_TURB];
+    real P_tmp[FLA_N_TURB];
+    real k1[FLA_N_TURB], k2[FLA_N_TURB], k3[FLA_N_TURB], k4[FLA_N_TURB];
+    fla_turb_dydt(P, k1, tau, grad, q);
+    for (int i = 0; i < FLA_N_TURB; i++) { P_tmp[i] = P[i] + k1[i] * h/2; }
+    fla_turb_dydt(P_tmp, k2, tau, grad, q);
+    for (int i = 0; i < FLA_N_TURB; i++) { P_tmp[i] = P[i] + k2[i] * h/2; }
+    fla_turb_dydt(P_tmp, k3, tau, grad, q);
+    for (int i = 0; i < FLA_N_TURB; i++) { P_tmp[i] = P[i] + k3[i] * h; }
+    fla_turb_dydt(P_tmp, k4, tau, grad, q);
+    for (int i = 0; i < FLA_N_TURB; i++) {
+        P[i] = P[i] + (k1[i] + 2 * k2[i] + 2 * k3[i] + k4[i]) * h/6;
+    }
+    y[FLA_I_N_P] = fla_turb_n_p(P);
+    return EXIT_SUCCESS;
+}
+#endif // FLA_TURB
+
+#ifndef FLA_VAP_STANDALONE
+// Convenience function. Working with P_USER_REAL is cumbersome, hence we copy
+// the FLA block (FLA_N_SCAL values) to local array.
+int fla_read_user_real(real y[], Tracked_Particle *p)
+{
+    for (int i=0; i<FLA_N_SCAL; i++) {
+        y[i] = P_USER_REAL(p, FLA_OFFSET + i);
+    }
+    return 0;
+}
+
+// Convenience function. Complements fla_read_user_real().
+int fla_update_user_real(const real y[], Tracked_Particle *p)
+{
+    for (int i=0; i<FLA_N_SCAL; i++) {
+        P_USER_REAL(p, FLA_OFFSET + i) = y[i];
+    }
+    return 0;
+}
+
+// Cell velocity gradients in the order of FLA_N_GRAD.
+int fla_read_gradients(real grad[], cell_t c, Thread *t)
+{
+    grad[0] = C_DUDX(c,t);
+    grad[1] = C_DUDY(c,t);
+    grad[2] = C_DVDX(c,t);
+    grad[3] = C_DVDY(c,t);
+    return 0;
+}
+#endif // FLA_VAP_STANDALONE
 // END FLA functions 
 
+// BEGIN FLA Lagrangian mesh
+// Concentration between trajectories from the topology of the seeds
+// (Osiptsov). Trajectories are seeded on a lattice of initial positions with
+// index s along the injection line and sampled every few particle steps
+// (level k). Node (s, k) keeps the position and N_P of trajectory s at level
+// k, so the neighbours of a trajectory are an index lookup and every lattice
+// cell [s, s+1]x[k, k+1] is a quadrilateral in physical space over which N_P
+// is interpolated bilinearly. Overlapping cells (folds of the particle
+// field) add up, as the branches of the FLA do.
+typedef struct fla_lmesh_s {
+    int n_seed, n_level;
+    real *x, *y;    // node positions, [k*n_seed + s]
+    real *n_p;      // N_P at the node, < 0 if the trajectory has no sample
+} fla_lmesh_t;
+
+int fla_lmesh_init(fla_lmesh_t *m, int n_seed, int n_level)
+{
+    size_t n = (size_t)n_seed*n_level;
+    m->n_seed = n_seed;
+    m->n_level = n_level;
+    m->x = malloc(n*sizeof(real));
+    m->y = malloc(n*sizeof(real));
+    m->n_p = malloc(n*sizeof(real));
+    if (m->x == NULL || m->y == NULL || m->n_p == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        m->n_p[i] = -1.0;
+    }
+    return 0;
+}
+
+void fla_lmesh_free(fla_lmesh_t *m)
+{
+    free(m->x); free(m->y); free(m->n_p);
+}
+
+// Sample of trajectory s at level k.
+void fla_lmesh_record(fla_lmesh_t *m, int s, int k, real x, real y, real n_p)
+{
+    if (s < 0 || s >= m->n_seed || k < 0 || k >= m->n_level) {
+        return;
+    }
+    size_t i = (size_t)k*m->n_seed + s;
+    m->x[i] = x;
+    m->y[i] = y;
+    m->n_p[i] = n_p;
+}
+
+// N_P at (px, py) interpolated in the lattice cell (s, k). Returns 0 if the
+// cell is incomplete or does not contain the point. The bilinear map of the
+// cell is inverted with Newton's method.
+int fla_lmesh_interpolate(const fla_lmesh_t *m, int s, int k, real px, real py, real *n_p)
+{
+    size_t i00 = (size_t)k*m->n_seed + s, i10 = i00 + 1;
+    size_t i01 = i00 + m->n_seed, i11 = i01 + 1;
+    if (m->n_p[i00] < 0.0 || m->n_p[i10] < 0.0 || m->n_p[i01] < 0.0 || m->n_p[i11] < 0.0) {
+        return 0;
+    }
+    // x(a, b) = x00 + a*ex + b*ey + a*b*exy
+    real ex[2] = { m->x[i10] - m->x[i00], m->y[i10] - m->y[i00] };
+    real ey[2] = { m->x[i01] - m->x[i00], m->y[i01] - m->y[i00] };
+    real exy[2] = { m->x[i00] - m->x[i10] - m->x[i01] + m->x[i11], m->y[i00] - m->y[i10] - m->y[i01] + m->y[i11] };
+    real a = 0.5, b = 0.5;
+    for (int it = 0; it < 8; it++) {
+        real fx = m->x[i00] + a*ex[0] + b*ey[0] + a*b*exy[0] - px;
+        real fy = m->y[i00] + a*ex[1] + b*ey[1] + a*b*exy[1] - py;
+        real j11 = ex[0] + b*exy[0], j12 = ey[0] + a*exy[0];
+        real j21 = ex[1] + b*exy[1], j22 = ey[1] + a*exy[1];
+        real det = j11*j22 - j12*j21;
+        if (fabs(det) < 1.e-30) {
+            return 0;
+        }
+        a -= (j22*fx - j12*fy) / det;
+        b -= (j11*fy - j21*fx) / det;
+    }
+    // half-open, so a point on a shared edge belongs to one lattice cell only
+    const real eps = 1.e-9;
+    if (!(a >= -eps && a < 1.0 - eps && b >= -eps && b < 1.0 - eps)) {
+        return 0;
+    }
+    // Newton does not converge in strongly twisted cells
+    real fx = m->x[i00] + a*ex[0] + b*ey[0] + a*b*exy[0] - px;
+    real fy = m->y[i00] + a*ex[1] + b*ey[1] + a*b*exy[1] - py;
+    if (fabs(fx) + fabs(fy) > 1.e-6*(fabs(ex[0]) + fabs(ex[1]) + fabs(ey[0]) + fabs(ey[1]))) {
+        return 0;
+    }
+    *n_p = (1.0 - a)*(1.0 - b)*m->n_p[i00] + a*(1.0 - b)*m->n_p[i10]
+         + (1.0 - a)*b*m->n_p[i01] + a*b*m->n_p[i11];
+    return 1;
+}
+// END FLA Lagrangian mesh
+
 // BEGIN VAP functions 
-int Lambda(real h_0, real lambda[])
+// Roots lambda_n of lambda cos(lambda) + h_0 sin(lambda) = 0, first n of them,
+// n <= N_Lambda; the rest of lambda[] is set to -1.
+int Lambda_n_generic(real h_0, real lambda[], int n)
 {
     FILE * fout;
     int i;
@@ -410,7 +1004,7 @@ int Lambda(real h_0, real lambda[])
 
     for (i = 0; i < N_Lambda; i++) lambda[i] = -1.0;
 
-    for (i = 0; i < N_Lambda; i++)
+    for (i = 0; i < n; i++)
     {
         lambda_left = ((double)(i))*PI + step;
         lambda_right = (((double)(i + 1)) - 0.5)*PI - step;
@@ -454,285 +1048,3949 @@ int Lambda(real h_0, real lambda[])
     //  Message("Lambdas are printed in lambda.txt\n");
     return 0;
 }
-// END VAP functions
 
+int (*Lambda_n_p)(real h_0, real lambda[], int n) = Lambda_n_generic;
 
-/* convection diffusion controlled vaporisation model as implemented into Fluent
-   p    ... tracked particle struct
-   Cp   ... particle heat capacity
-   hgas ... enthalpy of formation for gas species
-   hvap ... vaporization enthalpy
-   cvap_surf ... molar concentration of vapor at surface
-   Z    ... compressibility factor
-   dydt ... temperature / component mass source terms for particle 
-            dydt[0] = temperature equation, 
-            dydt[1+ns] = mass equation of particle species ns
-   dzdt ... temperature / species mass source terms for gas phase
-            dzdt->energy = convective heat transfer in Watt
-            dzdt->species[n_gas] = mass source for gas species n_gas in kg/s
- */
+int Lambda_n(real h_0, real lambda[], int n)
+{
+    return Lambda_n_p(h_0, lambda, n);
+}
 
-// 4*N_component + 7 (x_i, y_i, dm_i, Mw_i, y_tot, dm_tot, D, BM, BT, diam1, diam2) + N_INT+1 
-// for temperature distribution inside a droplet USER_REAL variables 
-// 116 for single component n-dodecane
-DEFINE_DPM_HEAT_MASS(multivap_conv_diffusion_new, p, Cp, hgas, hvap, cvap_surf, Z, dydt, dzdt)
+int Lambda(real h_0, real lambda[])
 {
-    //-------------------------------------------------------------------------
-    /* molecular weight of gas species */
-    /* molwt_bulk is first the reciproke of the real molecular weight to avoid additional divisions */
-    real molwt_bulk = 0.;
-    int ns;
-    Thread *t0 = P_CELL_THREAD(p);
-    Material *gas_mix = THREAD_MATERIAL(DPM_THREAD(t0, p));
-	cphase_state_t *c = p->cphase;  /* continuous phase struct, caching variables of the cell */
+    return Lambda_n(h_0, lambda, N_Lambda);
+}
 
-    mixture_species_loop_i(gas_mix, ns)
-    {
-        molwt_bulk += c->yi[ns] / solver_par.molWeight[ns]; /* c->yi[ns] contains mass fraction of fluid cell */
-        //P_USER_REAL(p, 3 * nc + ns) = solver_par.molWeight[ns];
+#ifndef FLA_VAP_STANDALONE
+// Convenience function. Copies the hot user-real block [0, VAP_END) of the
+// particle to the local struct, see VAP staging above.
+int vap_read_user_real(vap_state_t *s, Tracked_Particle *p)
+{
+    for (int ns = 0; ns < NCOMPONENTS; ns++) {
+        s->x_surf[ns] = P_USER_REAL(p, VAP_I_X_SURF(ns));
+        s->Ys[ns] = P_USER_REAL(p, VAP_I_YS(ns));
+        s->vap_rate[ns] = P_USER_REAL(p, VAP_I_RATE(ns));
     }
-    molwt_bulk = MAX(molwt_bulk, DPM_SMALL);
-    molwt_bulk = 1. / molwt_bulk;
-    
+    s->h = P_USER_REAL(p, VAP_I_H);
+    s->Ys_tot = P_USER_REAL(p, VAP_I_YS_TOT);
+    s->tot_vap_rate = P_USER_REAL(p, VAP_I_TOT_RATE);
+    s->BM = P_USER_REAL(p, VAP_I_BM);
+    s->BT = P_USER_REAL(p, VAP_I_BT);
+    s->L_eff = P_USER_REAL(p, VAP_I_L_EFF);
+    s->Nu = P_USER_REAL(p, VAP_I_NU);
+    s->T_av = P_USER_REAL(p, VAP_I_T_AV);
+    for (int j = 0; j < N_INT + 1; j++) {
+        s->T[j] = P_USER_REAL(p, VAP_I_T(j));
+    }
+    s->coef = P_USER_REAL(p, VAP_I_COEF);
+    s->Nu_star = P_USER_REAL(p, VAP_I_NU_STAR);
+    s->D = P_USER_REAL(p, VAP_I_D);
+    s->kgas = P_USER_REAL(p, VAP_I_KGAS);
+#ifdef VAP_MULTIRATE
+    for (int i = 0; i < VAP_MR_N; i++) {
+        s->mr[i] = P_USER_REAL(p, VAP_MR_OFFSET + i);
+    }
+#endif
+    return 0;
+}
 
-    /* when not using Runge Kutta solver, increase limiting time for the next integration step */
-    // ANSYS stuff
-    if (!p->in_rk) {
-        p->limiting_time = P_DT(p)*1.01;
+// Convenience function. Complements vap_read_user_real().
+int vap_update_user_real(const vap_state_t *s, Tracked_Particle *p)
+{
+    for (int ns = 0; ns < NCOMPONENTS; ns++) {
+        P_USER_REAL(p, VAP_I_X_SURF(ns)) = s->x_surf[ns];
+        P_USER_REAL(p, VAP_I_YS(ns)) = s->Ys[ns];
+        P_USER_REAL(p, VAP_I_RATE(ns)) = s->vap_rate[ns];
+    }
+    P_USER_REAL(p, VAP_I_H) = s->h;
+    P_USER_REAL(p, VAP_I_YS_TOT) = s->Ys_tot;
+    P_USER_REAL(p, VAP_I_TOT_RATE) = s->tot_vap_rate;
+    P_USER_REAL(p, VAP_I_BM) = s->BM;
+    P_USER_REAL(p, VAP_I_BT) = s->BT;
+    P_USER_REAL(p, VAP_I_L_EFF) = s->L_eff;
+    P_USER_REAL(p, VAP_I_NU) = s->Nu;
+    P_USER_REAL(p, VAP_I_T_AV) = s->T_av;
+    for (int j = 0; j < N_INT + 1; j++) {
+        P_USER_REAL(p, VAP_I_T(j)) = s->T[j];
     }
+    P_USER_REAL(p, VAP_I_COEF) = s->coef;
+    P_USER_REAL(p, VAP_I_NU_STAR) = s->Nu_star;
+    P_USER_REAL(p, VAP_I_D) = s->D;
+    P_USER_REAL(p, VAP_I_KGAS) = s->kgas;
+#ifdef VAP_MULTIRATE
+    for (int i = 0; i < VAP_MR_N; i++) {
+        P_USER_REAL(p, VAP_MR_OFFSET + i) = s->mr[i];
+    }
+#endif
+    return 0;
+}
 
-    //-------------------------------------------------------------------------
-    // Calculate molar fractions of the components at the droplet surface
-    real xs_tot = 0.e-15;
-    real xsM_tot = 0.e-15;
-    real P_sat = 0.0; // Saturation pressure
-    real x_surf =0.0; // molar fraction of component at droplet surface
+#endif // FLA_VAP_STANDALONE
 
-    int nc = TP_N_COMPONENTS(p);
-	real Tp = P_USER_REAL(p, 4 * nc + 7 + N_INT); //Dropet temperature at the surface
-	if (nc != NCOMPONENTS) {
-        Message("ALARM!!! nc != NCOMPONENTS.");
+// Run-time resolution of the series solution, at most the compiled N_Lambda
+// and N_INT. The layers stay those of the user-real layout; with stride > 1
+// the series is evaluated on every stride-th layer only and interpolated
+// linearly in between. Lowered by the auto-tuner, see VAP_TUNE.
+typedef struct vap_res_s {
+    int n_lambda;   // terms of the series, <= N_Lambda
+    int stride;     // N_INT / stride has to be even (Simpson's rule)
+} vap_res_t;
+
+vap_res_t vap_res = { N_Lambda, 1 };
+
+// Resolution of the calling thread: vap_res, or a candidate that the
+// auto-tuner tries on this thread only, see vap_tune_run().
+VAP_THREAD_LOCAL const vap_res_t *vap_res_trial = NULL;
+#define VAP_RES (vap_res_trial != NULL ? vap_res_trial : &vap_res)
+
+// Advances the temperature distribution T[] over dt using the series solution
+// with VAP_RES->n_lambda terms; I_n are integrated with Simpson's rule over the
+// layers. sin(lambda_n r_j) is computed once per term and layer and shared by
+// I_n and the reconstruction, which accumulates into a local profile.
+int vap_series_update_generic(real T[], real h0, real zeta, real kappa, real T_eff, real dt)
+{
+    int n_lambda = VAP_RES->n_lambda;
+    int st = VAP_RES->stride;
+    real lambda[N_Lambda];
+    VAP_ALIGN real r[N_INT + 1];     // radius of the layer
+    VAP_ALIGN real Tr[N_INT + 1];    // T*r*dr/dxi, the integrand of I_n without sin
+    VAP_ALIGN real sn[N_INT + 1];    // sin(lambda_n * r)
+    VAP_ALIGN real T_new[N_INT + 1];
+
+    Lambda_n(h0, lambda, n_lambda);
+
+    for (int j = 0; j < N_INT + 1; j++) {
+        r[j] = VAP_R(j);
+        Tr[j] = T[j]*r[j]*VAP_DR(j);
+        T_new[j] = T_eff;
     }
-    for (int ns = 0; ns < nc; ns++) {
-        int gas_index = TP_COMPONENT_INDEX_I(p, ns); /* gas species index of vaporization */
-        if (gas_index >= 0) {
-            // Saturation pressure for n-dodecane vapour
-            P_sat = get_vapour_saturation_pressure(Tp);
-            x_surf = P_sat / c->pressure; //Saturation pressure for n-Dodecane from Abramzon&Sazhin 2006
-            //above for x_surf will be modified for multicoponent droplet case
-            P_USER_REAL(p, ns) = x_surf;
-            xs_tot += x_surf*solver_par.molWeight[ns];
-            xsM_tot += x_surf;
+    sn[0] = 0.0;
+    for (int i = 0; i < n_lambda; i++) {
+        real b_n = 0.5*(1.0 + h0 / (h0*h0 + lambda[i] * lambda[i]));
+        for (int j = st; j < N_INT + 1; j += st) {
+            sn[j] = sin(lambda[i] * r[j]);
         }
-    }
-    
-    xs_tot += (1.0 - xsM_tot)*28.967; //air
-    
-    //-------------------------------------------------------------------------
-    // Calculate mass fractions of the components at the droplet surface
-    real Ys = 0.e-15;
-    real Y_inf = 0.e-15;
-    real L_eff = 0.e-15;
-    real Ys_tot = 0.e-15;
-    for (int ns = 0; ns < nc; ns++) {
-        /* gas species index of vaporization */
-        int gas_index = TP_COMPONENT_INDEX_I(p, ns);
-        if (gas_index >= 0) {
-            Ys = P_USER_REAL(p, ns)* solver_par.molWeight[gas_index] / xs_tot;//!!
-            Y_inf += c->yi[gas_index];
-            //L_eff += Ys * p->hvap[gas_index]; // TODO Try for water
-            
-            L_eff += Ys*get_liquid_latent_heat(Tp);
+        // r[N_INT] == 1, so sn[N_INT] == sin(lambda_n)
+        real I_n = Tr[N_INT]*sn[N_INT];
+        for (int j = st; j < N_INT; j += 2*st) {
+            I_n += 4.0 * Tr[j]*sn[j];
+        }
+        for (int j = 2*st; j < N_INT; j += 2*st) {
+            I_n += 2.0 * Tr[j]*sn[j];
+        }
+        I_n = I_n*(st*Delta_R) / 3.0;
+        real series = (I_n - sn[N_INT] / lambda[i] / lambda[i] * zeta)*exp(0.0 - kappa*lambda[i] * lambda[i] * dt) / b_n;
 
-            //Latent heat as above will be calculated separately for multicomponent droplet
-            Ys_tot += Ys;
-            P_USER_REAL(p, nc + ns) = Ys;
+        T_new[0] += series * lambda[i];
+        for (int j = st; j < N_INT + 1; j += st) {
+            T_new[j] += series * sn[j] / r[j];
         }
     }
-    L_eff = L_eff / Ys_tot;
-    P_USER_REAL(p, 4 * nc) = Ys_tot;
+    for (int j = 0; j < N_INT; j += st) {
+        for (int l = 1; l < st; l++) {
+            T_new[j + l] = T_new[j] + (T_new[j + st] - T_new[j])*l / st;
+        }
+    }
+    for (int j = 0; j < N_INT + 1; j++) { T[j] = T_new[j]; }
+    return 0;
+}
 
-    //-------------------------------------------------------------------------
-    // Calculate Nusselt number and total evaporation rate
-    real T_ref = (c->temp + 2.0*Tp) / 3.0; //Sazhin, Progress in Energy and Combustion Science 32 (2006) 162–214 
-    real rho_gas_s = c->pressure / (287.01625988193461525183829875375*T_ref); // ideal gas law
+int (*vap_series_update_p)(real T[], real h0, real zeta, real kappa, real T_eff, real dt) = vap_series_update_generic;
 
-    real c_p_die = get_vapour_c_p(T_ref);
-      //D = 0.527*pow(T_ref / 300.0, 1.583) / c->pressure; //2015.10.29
+int vap_series_update(real T[], real h0, real zeta, real kappa, real T_eff, real dt)
+{
+    return vap_series_update_p(T, h0, zeta, kappa, T_eff, dt);
+}
 
-	Material *cond_mix = P_MATERIAL(p);
-	Material * cond_c = MIXTURE_COMPONENT(cond_mix, 0);
-	real D = DPM_BINARY_DIFFUSIVITY(p, cond_c, Tp);
-    real Sc = c->mu / (rho_gas_s * D);  //Schmidt number
+// Droplet average temperature from the distribution T[] (Simpson's rule on
+// every VAP_RES->stride-th layer).
+real vap_average_temperature(const real T[])
+{
+    int st = VAP_RES->stride;
+    real T_av = T[N_INT]*VAP_DR(N_INT);
+    for (int j = st; j < N_INT; j += 2*st) {
+        T_av += 4.0 * T[j]*VAP_R(j)*VAP_R(j)*VAP_DR(j);
+    }
+    for (int j = 2*st; j < N_INT; j += 2*st) {
+        T_av += 2.0 * T[j]*VAP_R(j)*VAP_R(j)*VAP_DR(j);
+    }
+    return T_av*(st*Delta_R);
+}
+// END VAP functions
 
-    real kgas = c->tCond;
-    real Re = p->Re;
-    real Pr = c->sHeat * c->mu / kgas;
-    //  BM = (Ys_tot - Y_inf) / (1.0 - Ys_tot);
-    real BM = (Ys_tot) / (1.0 - Ys_tot); //assuming zero mass fraction in the ambient gas
-    real FBM = pow(1.0 + BM, 0.7)*log(1.0 + BM) / BM;
+
+// BEGIN VAP kernel
+// Gas state around the droplet as seen by the heating and evaporation model.
+// In Fluent it is filled from the cphase cache of the particle, see
+// multivap_conv_diffusion_new; offline drivers fill it themselves.
+typedef struct vap_env_s {
+    real temp;      // gas temperature, K
+    real pressure;  // Pa
+    real mu;        // gas dynamic viscosity
+    real tCond;     // gas thermal conductivity
+    real sHeat;     // gas specific heat
+    real rel_vel;   // |u_gas - u_p|
+    real Re;        // particle Reynolds number
+    real mw_vap;    // molecular weight of the vapour
+    real D;         // binary diffusivity of the vapour at the surface temperature
+    real vap_limit; // fraction of the evaporation rate the cell takes, 1 without VAP_SAT_LIMIT
+} vap_env_t;
+
+// Rates of the droplet that are not kept in vap_state_t.
+typedef struct vap_rates_s {
+    real vap_rate;  // evaporation rate, kg/s (single component)
+    real dh_dt;     // convective heat supplied to the droplet, W
+    real Sh_Star;   // modified Sherwood number, for the mass transfer coefficient
+} vap_rates_t;
+
+// Fixed-point map of the heat transfer Spalding number, BT' = (1 + BM)^phi - 1
+// with phi = coef / Nu*(BT); Nu_0 is the Re, Pr part of Nu*. Nu* in *Nu_star.
+static inline real vap_bt_update(real BT, real BM, real coef, real Nu_0, real *Nu_star)
+{
+    real FBT = pow(1.0 + BT, 0.7)*log(1.0 + BT) / BT;
+    *Nu_star = 2.0 + Nu_0 / FBT;
+    real phi = coef / *Nu_star;
+    return pow(1.0 + BM, phi) - 1.0;
+}
+
+// Surface balance of the droplet with the surface temperature s->T[N_INT]:
+// vapour fraction at the surface, Spalding numbers, Nusselt number and
+// evaporation rate (Abramzon & Sirignano). Sets the surface quantities of s
+// and returns the modified Sherwood number in *Sh_Star. Close to the boiling
+// point the BT iteration can cycle; it then falls back to bisection within
+// the bracket of the root its iterates have found. Returns -1 if BT did not
+// converge within BT_MAX_ITER steps of either, 0 otherwise.
+int vap_surface_balance(vap_state_t *s, const vap_env_t *g, real Dp, real *Sh_Star_out)
+{
+    //-------------------------------------------------------------------------
+    // Calculate molar and mass fractions at the droplet surface
+    real Tp = s->T[N_INT]; //Dropet temperature at the surface
+    // Saturation pressure for n-dodecane vapour
+    real P_sat = get_vapour_saturation_pressure(Tp);
+    real x_surf = P_sat / g->pressure; //Saturation pressure for n-Dodecane from Abramzon&Sazhin 2006
+    //above for x_surf will be modified for multicoponent droplet case
+    s->x_surf[0] = x_surf;
+    real xs_tot = x_surf*g->mw_vap + (1.0 - x_surf)*28.967; //air
+
+    real Ys = x_surf*g->mw_vap / xs_tot;
+    //L_eff += Ys * p->hvap[gas_index]; // TODO Try for water
+    real L_eff = get_liquid_latent_heat(Tp);
+    //Latent heat as above will be calculated separately for multicomponent droplet
+    real Ys_tot = Ys;
+    s->Ys[0] = Ys;
+    s->Ys_tot = Ys_tot;
+
+    //-------------------------------------------------------------------------
+    // Calculate Nusselt number and total evaporation rate
+    real T_ref = (g->temp + 2.0*Tp) / 3.0; //Sazhin, Progress in Energy and Combustion Science 32 (2006) 162–214 
+    real rho_gas_s = g->pressure / (287.01625988193461525183829875375*T_ref); // ideal gas law
+
+    real c_p_die = get_vapour_c_p(T_ref);
+      //D = 0.527*pow(T_ref / 300.0, 1.583) / c->pressure; //2015.10.29
+
+    real D = g->D;
+    real Sc = g->mu / (rho_gas_s * D);  //Schmidt number
+
+    real kgas = g->tCond;
+    real Re = g->Re;
+    real Pr = g->sHeat * g->mu / kgas;
+    //  BM = (Ys_tot - Y_inf) / (1.0 - Ys_tot);
+    real BM = (Ys_tot) / (1.0 - Ys_tot); //assuming zero mass fraction in the ambient gas
+    real FBM = pow(1.0 + BM, 0.7)*log(1.0 + BM) / BM;
     real Sh_Star = 2.0 + (pow(1.0 + Re*Sc, 1.0 / 3.0)*MAX(1.0, pow(Re, 0.077)) - 1.0) / FBM;
     real Sh = log(1.0 + BM)*Sh_Star;
     //Sh = log(1.0 + BM)*(2.0 + 0.6*sqrt(Re)*pow(Sc, 1.0 / 3.0));
-	real Dp = P_DIAM(p);
-	real Ap = DPM_AREA(Dp);
-	real tot_vap_rate = Ap * D * rho_gas_s * Sh / Dp; // total evaporation rate
-    
-    P_USER_REAL(p, 4 * nc + 1) = tot_vap_rate;
+    real Ap = DPM_AREA(Dp);
+    real tot_vap_rate = Ap * D * rho_gas_s * Sh / Dp * g->vap_limit; // total evaporation rate
+    s->tot_vap_rate = tot_vap_rate;
+
+    real BT = BM;
+    real BT_i = BT;
+    real dif = 1.0;
+    real coef = c_p_die * rho_gas_s * D / kgas * Sh_Star;
+    real Nu_0 = pow(1.0 + Re*Pr, 1.0 / 3.0)*MAX(1.0, pow(Re, 0.077)) - 1.0;
+    real Nu_star;
+    real lo = -HUGE_VAL, hi = HUGE_VAL; // BT' > BT below the root, BT' < BT above
+    int it = 0;
+    // find BT iteratively
+    while (dif > ACCURACY && it < BT_MAX_ITER) {
+        BT = vap_bt_update(BT_i, BM, coef, Nu_0, &Nu_star);
+        if (isfinite(BT) && BT > BT_i) {
+            lo = MAX(lo, BT_i);
+        } else if (isfinite(BT)) {
+            hi = MIN(hi, BT_i);
+        }
+        dif = fabs(BT - BT_i);
+        BT_i = BT;
+        it++;
+    }
+    if (!(dif <= ACCURACY) && isfinite(lo) && isfinite(hi)) {
+        // in geometric steps while the bracket spans orders of magnitude
+        for (int k = 0; hi - lo > ACCURACY && k < BT_MAX_ITER; k++) {
+            BT = lo > 0.0 && hi > 2.0*lo ? sqrt(lo*hi) : 0.5*(lo + hi);
+            if (vap_bt_update(BT, BM, coef, Nu_0, &Nu_star) > BT) {
+                lo = BT;
+            } else {
+                hi = BT;
+            }
+        }
+        BT = 0.5*(lo + hi);
+        vap_bt_update(BT, BM, coef, Nu_0, &Nu_star);
+        dif = hi - lo;
+    }
+
+    real Nu = log(1.0 + BT) * Nu_star / BT; // Nusselt number
+
+    s->vap_rate[0] = Ys * tot_vap_rate / Ys_tot; //!!
+    s->BM = BM;
+    s->BT = BT;
+    s->L_eff = L_eff; // used in temperature calculations
+    s->Nu = Nu; //used in temperature calculations
+    s->coef = coef;
+    s->Nu_star = Nu_star;
+    s->D = D;
+    s->kgas = kgas;
+    s->h = Nu * kgas / Dp;
+    *Sh_Star_out = Sh_Star;
+    return dif <= ACCURACY ? 0 : -1;
+}
+
+// Coefficients of the series solution of one heat-mass step.
+typedef struct vap_series_coef_s {
+    real h0;
+    real zeta;
+    real kappa;
+    real T_eff;
+} vap_series_coef_t;
+
+// First part of vap_heat_mass(): surface balance and the coefficients of the
+// series solution. Returns the status of vap_surface_balance().
+int vap_heat_mass_prepare(vap_state_t *s, const vap_env_t *g, real Dp, real rho_p, vap_series_coef_t *c, real *Sh_Star)
+{
+    int status = vap_surface_balance(s, g, Dp, Sh_Star);
+    real Re = g->Re;
+    real BM = s->BM;
+    real Nu = s->Nu;
+    real kgas = s->kgas;
+    real L_eff = s->L_eff;
+    real tot_vap_rate = s->tot_vap_rate;
+
+    //-------------------------------------------------------------------------
+    // Temperature distribution calculations
+    real T_av = s->T_av;
+    real Visc_l = get_liquid_visc(T_av);
+    real k_l = get_liquid_k(T_av);
+    real C_pl = get_liquid_c_p(T_av);
+
+    real Pe = 12.69 / 16.0*rho_p*0.5*Dp* C_pl / k_l*g->rel_vel*g->mu / Visc_l*pow(Re, 1.0 / 3.0) / (1.0 + BM);
+    real k_eff = (1.86 + 0.86*tanh(2.225*log10(Pe / 30.0)))*k_l;  // effective thermal conductivity to take into account recirculation Abramzon B, Sirignano WA. Int J Heat Mass Transfer 1989;32:1605–18.
+    if (fabs(Pe) < 1.e-12) {
+        k_eff = k_l;
+    }
+
+    real T_eff = g->temp - tot_vap_rate*L_eff / PI / Dp / Nu / kgas;
+    real h0 = kgas*Nu*0.5 / k_eff - 1.0;
+    c->h0 = h0;
+    c->zeta = (h0 + 1.0)*T_eff;
+    c->kappa = k_eff / (C_pl*rho_p*0.25*Dp*Dp);
+    c->T_eff = T_eff;
+    return status;
+}
+
+// Last part of vap_heat_mass(), after the series update of s->T.
+int vap_heat_mass_finish(vap_state_t *s, const vap_env_t *g, real Dp, real Sh_Star, vap_rates_t *out)
+{
+    // Re-calculate droplet avarage temperature T_av
+    real T_av = vap_average_temperature(s->T);
+    s->T_av = T_av;
+
+    // evaporation rates - source terms, droplet mass
+    out->vap_rate = s->vap_rate[0];
+    out->dh_dt = s->Nu * s->kgas * DPM_AREA(Dp) / Dp * (g->temp - T_av);
+    out->Sh_Star = Sh_Star;
+    return 0;
+}
+
+// Heating and evaporation of a single component droplet of diameter Dp and
+// density rho_p over dt. Works on the staged state s only and does not touch
+// Fluent data, so it can be driven outside Fluent. Returns -1 if the surface
+// balance did not converge (the step is taken with its last iterate), 0
+// otherwise.
+int vap_heat_mass(vap_state_t *s, const vap_env_t *g, real Dp, real rho_p, real dt, vap_rates_t *out)
+{
+    real Sh_Star;
+    vap_series_coef_t c;
+    int status = vap_heat_mass_prepare(s, g, Dp, rho_p, &c, &Sh_Star);
+    vap_series_update(s->T, c.h0, c.zeta, c.kappa, c.T_eff, dt);
+    // Now we know temperature at each layer
+    vap_heat_mass_finish(s, g, Dp, Sh_Star, out);
+    return status;
+}
+
+#ifdef VAP_MULTIRATE
+// Multirate version of vap_heat_mass(). The surface balance runs every step
+// with T_s and T_av extrapolated linearly from the last two interior solves.
+// The series update of the interior runs every k-th step only, over the
+// interval since the last solve, with the dt-weighted mean coefficients of its
+// steps. The difference between the solved and the extrapolated T_s at the
+// end of the interval is the error estimate; as the extrapolation error grows
+// with the square of the interval, k is scaled by sqrt(VAP_MR_TOL / error).
+// The interval is also kept below the Fourier number VAP_MR_FO of the slowest
+// interior mode; beyond it the interior relaxes within the interval and the
+// extrapolation fails (small droplets, long steps). Close to the boiling
+// point (Ys_tot > VAP_MR_YS_MAX) the evaporation rate is too stiff in T_s to be
+// extrapolated, and every step is solved.
+// Between solves T[0, N_INT) keeps the profile of the last solve. With k = 1
+// the step is that of vap_heat_mass(); k = 0 (new droplet, restored
+// checkpoint) takes a full step and starts the extrapolation.
+int vap_heat_mass_multirate(vap_state_t *s, const vap_env_t *g, real Dp, real rho_p, real dt, vap_rates_t *out)
+{
+    real *mr = s->mr;
+    if (mr[VAP_MR_K] < 1.0) {
+        real Ts = s->T[N_INT];
+        real T_av = s->T_av;
+        int status = vap_heat_mass(s, g, Dp, rho_p, dt, out);
+        memset(mr, 0, VAP_MR_N*sizeof(real));
+        mr[VAP_MR_TS] = s->T[N_INT];
+        mr[VAP_MR_TAV] = s->T_av;
+        mr[VAP_MR_DTS] = (s->T[N_INT] - Ts) / dt;
+        mr[VAP_MR_DTAV] = (s->T_av - T_av) / dt;
+        mr[VAP_MR_K] = 1.0;
+        return status;
+    }
+
+    real t = mr[VAP_MR_T];
+    s->T[N_INT] = mr[VAP_MR_TS] + mr[VAP_MR_DTS]*t;
+    s->T_av = mr[VAP_MR_TAV] + mr[VAP_MR_DTAV]*t;
+    real Sh_Star;
+    vap_series_coef_t c;
+    int status = vap_heat_mass_prepare(s, g, Dp, rho_p, &c, &Sh_Star);
+    mr[VAP_MR_H0] += c.h0*dt;
+    mr[VAP_MR_KAPPA] += c.kappa*dt;
+    mr[VAP_MR_T_EFF] += c.T_eff*dt;
+    t += dt;
+    mr[VAP_MR_N_STEPS] += 1.0;
+
+    if (mr[VAP_MR_N_STEPS] >= mr[VAP_MR_K]) {
+        real h0 = mr[VAP_MR_H0] / t;
+        real T_eff = mr[VAP_MR_T_EFF] / t;
+        real Ts_ext = mr[VAP_MR_TS] + mr[VAP_MR_DTS]*t;
+        s->T[N_INT] = mr[VAP_MR_TS];
+        vap_series_update(s->T, h0, (h0 + 1.0)*T_eff, mr[VAP_MR_KAPPA] / t, T_eff, t);
+        s->T_av = vap_average_temperature(s->T);
+        real err = ABS(s->T[N_INT] - Ts_ext);
+        real f = err > 0.0 ? MIN(MAX(0.9*sqrt(VAP_MR_TOL / err), 0.5), 2.0) : 2.0;
+        // the interior has to relax slowly over the interval, lambda_1^2 from
+        // its limits 3 (h0 + 1) for small h0 + 1 and pi^2 for large h0
+        real Fo = c.kappa*MIN(3.0*(c.h0 + 1.0), PI*PI)*dt;
+        real k = MIN(MIN(floor(mr[VAP_MR_K]*f + 0.5), floor(VAP_MR_FO / Fo)), VAP_MR_K_MAX);
+        k = s->Ys_tot > VAP_MR_YS_MAX ? 1.0 : MAX(k, 1.0);
+        real dTs = (s->T[N_INT] - mr[VAP_MR_TS]) / t;
+        real dTav = (s->T_av - mr[VAP_MR_TAV]) / t;
+        memset(mr, 0, VAP_MR_N*sizeof(real));
+        mr[VAP_MR_TS] = s->T[N_INT];
+        mr[VAP_MR_TAV] = s->T_av;
+        mr[VAP_MR_DTS] = dTs;
+        mr[VAP_MR_DTAV] = dTav;
+        mr[VAP_MR_K] = k;
+    } else {
+        mr[VAP_MR_T] = t;
+        s->T[N_INT] = mr[VAP_MR_TS] + mr[VAP_MR_DTS]*t;
+        s->T_av = mr[VAP_MR_TAV] + mr[VAP_MR_DTAV]*t;
+    }
+
+    out->vap_rate = s->vap_rate[0];
+    out->dh_dt = s->Nu * s->kgas * DPM_AREA(Dp) / Dp * (g->temp - s->T_av);
+    out->Sh_Star = Sh_Star;
+    return status;
+}
+#endif
+// Lumped (infinite liquid thermal conductivity) version of vap_heat_mass(): the
+// same surface balance with a uniform droplet temperature, integrated exactly
+// over dt. A profile left by vap_heat_mass() is first replaced by its average,
+// so a droplet can switch between the two models at any step. Far cheaper than
+// the series solution and used for the parcels outside the control-variate
+// sample and the shadows of those in it, see multivap_control_variate.
+int vap_heat_mass_lumped(vap_state_t *s, const vap_env_t *g, real Dp, real rho_p, real dt, vap_rates_t *out)
+{
+    real T_p = s->T_av;
+    for (int j = 0; j < N_INT + 1; j++) { s->T[j] = T_p; }
+
+    real Sh_Star;
+    int status = vap_surface_balance(s, g, Dp, &Sh_Star);
+    real Nu = s->Nu;
+    real kgas = s->kgas;
+
+    // m c_l dT/dt = pi Dp Nu kgas (T_eff - T)
+    real T_eff = g->temp - s->tot_vap_rate*s->L_eff / PI / Dp / Nu / kgas;
+    real m_c = rho_p*PI*Dp*Dp*Dp / 6.0*get_liquid_c_p(T_p);
+    T_p = T_eff + (T_p - T_eff)*exp(-PI*Dp*Nu*kgas*dt / m_c);
+    for (int j = 0; j < N_INT + 1; j++) { s->T[j] = T_p; }
+    s->T_av = T_p;
+
+    out->vap_rate = s->vap_rate[0];
+    out->dh_dt = Nu * kgas * DPM_AREA(Dp) / Dp * (g->temp - T_p);
+    out->Sh_Star = Sh_Star;
+    return status;
+}
+
+// Steps of up to VAP_BATCH droplets evaluated together: the surface balance
+// and the roots per droplet, the series update with the droplets in the SIMD
+// lanes. The arrays are layer (term) major with one lane per droplet. Instead
+// of a sin() call per layer, sin(lambda_n r_j) on the equidistant layers
+// comes from the recurrence sin((k+1)a) = 2 cos(a) sin(ka) - sin((k-1)a),
+// which vectorises; it differs from vap_series_update_generic() in rounding.
+// The clustered layers of VAP_GRID_CLUSTER take sin() calls.
+typedef struct vap_batch_s {
+    int n;
+    VAP_ALIGN real T[N_INT + 1][VAP_BATCH];
+    VAP_ALIGN real Tr[N_INT + 1][VAP_BATCH];
+    VAP_ALIGN real sn[N_INT + 1][VAP_BATCH];
+    VAP_ALIGN real lambda[N_Lambda][VAP_BATCH];
+    real h0[VAP_BATCH];
+    real zeta[VAP_BATCH];
+    real kappa[VAP_BATCH];
+    real T_eff[VAP_BATCH];
+    real dt[VAP_BATCH];
+} vap_batch_t;
+
+// Series update of the b->n temperature profiles in b->T, see vap_series_update_generic().
+int vap_series_update_batch_generic(vap_batch_t *b)
+{
+    int n = b->n;
+    int n_lambda = VAP_RES->n_lambda;
+    int st = VAP_RES->stride;
+    real lambda[N_Lambda];
+    real I_n[VAP_BATCH], series[VAP_BATCH], c2[VAP_BATCH];
+
+    for (int l = 0; l < n; l++) {
+        Lambda_n(b->h0[l], lambda, n_lambda);
+        for (int i = 0; i < n_lambda; i++) { b->lambda[i][l] = lambda[i]; }
+    }
+    for (int j = 0; j < N_INT + 1; j++) {
+        real r = VAP_R(j)*VAP_DR(j);
+        for (int l = 0; l < n; l++) {
+            b->Tr[j][l] = b->T[j][l]*r;
+            b->T[j][l] = b->T_eff[l];
+        }
+    }
+    for (int i = 0; i < n_lambda; i++) {
+        const real *lam = b->lambda[i];
+#ifdef VAP_GRID_CLUSTER
+        for (int j = 0; j < N_INT + 1; j += st) {
+            real r = VAP_R(j);
+            for (int l = 0; l < n; l++) { b->sn[j][l] = sin(lam[l] * r); }
+        }
+#else
+        for (int l = 0; l < n; l++) {
+            b->sn[0][l] = 0.0;
+            b->sn[st][l] = sin(lam[l] * (st*Delta_R));
+            c2[l] = 2.0*cos(lam[l] * (st*Delta_R));
+        }
+        for (int j = 2*st; j < N_INT + 1; j += st) {
+            for (int l = 0; l < n; l++) { b->sn[j][l] = c2[l]*b->sn[j - st][l] - b->sn[j - 2*st][l]; }
+        }
+#endif
+        for (int l = 0; l < n; l++) { I_n[l] = b->Tr[N_INT][l]*b->sn[N_INT][l]; }
+        for (int j = st; j < N_INT; j += 2*st) {
+            for (int l = 0; l < n; l++) { I_n[l] += 4.0 * b->Tr[j][l]*b->sn[j][l]; }
+        }
+        for (int j = 2*st; j < N_INT; j += 2*st) {
+            for (int l = 0; l < n; l++) { I_n[l] += 2.0 * b->Tr[j][l]*b->sn[j][l]; }
+        }
+        for (int l = 0; l < n; l++) {
+            real b_n = 0.5*(1.0 + b->h0[l] / (b->h0[l]*b->h0[l] + lam[l] * lam[l]));
+            I_n[l] = I_n[l]*(st*Delta_R) / 3.0;
+            series[l] = (I_n[l] - b->sn[N_INT][l] / lam[l] / lam[l] * b->zeta[l])
+                        *exp(0.0 - b->kappa[l]*lam[l] * lam[l] * b->dt[l]) / b_n;
+            b->T[0][l] += series[l] * lam[l];
+        }
+        for (int j = st; j < N_INT + 1; j += st) {
+            real r = VAP_R(j);
+            for (int l = 0; l < n; l++) { b->T[j][l] += series[l] * b->sn[j][l] / r; }
+        }
+    }
+    for (int j = 0; j < N_INT; j += st) {
+        for (int m = 1; m < st; m++) {
+            for (int l = 0; l < n; l++) { b->T[j + m][l] = b->T[j][l] + (b->T[j + st][l] - b->T[j][l])*m / st; }
+        }
+    }
+    return 0;
+}
+
+int (*vap_series_update_batch_p)(vap_batch_t *b) = vap_series_update_batch_generic;
+
+int vap_series_update_batch(vap_batch_t *b)
+{
+    return vap_series_update_batch_p(b);
+}
+
+// Series-update operators. With zeta = (h0 + 1) T_eff the series update is
+// affine in the old profile: on the layers it evaluates (every stride-th),
+// T_new = A T + v T_eff, where A and v depend on h0 and the Fourier number
+// kappa dt only. Operators are cached per thread for buckets of h0 + 1 and
+// of the Fourier number of relative width VAP_OP_BIN, evaluated at the
+// bucket centre, and the lanes of a batch that share a bucket are advanced
+// by one matrix product. Building an operator costs about as much as the
+// batched direct update of six lanes, so only buckets shared by
+// VAP_OP_MIN_LANES lanes of a batch, or already cached, use one.
+#define VAP_OP_LD ((N_INT + 1 + 7) / 8 * 8)   // row length of A
+#define VAP_OP_KB (32)                        // rows of B per block of vap_op_gemm()
+
+typedef struct vap_op_s {
+    int valid;
+    long q_h0, q_fo;        // bucket of h0 + 1 and of kappa dt
+    int n_lambda, stride;   // vap_res the operator was built for
+    VAP_ALIGN real A[N_INT + 1][VAP_OP_LD];
+    VAP_ALIGN real v[N_INT + 1];
+} vap_op_t;
+
+typedef struct vap_op_cache_s {
+    vap_op_t op[VAP_OP_CACHE];  // direct mapped by bucket
+    long lanes;                 // lanes advanced by an operator
+    long direct;                // lanes left to vap_series_update_batch()
+    long built;
+} vap_op_cache_t;
+
+static VAP_THREAD_LOCAL vap_op_cache_t *vap_op_cache = NULL;
+static vap_registry_t vap_op_threads;   // the caches of the node's threads, see vap_lag_adjust
+
+// Bucket of x > 0 (the centre is exp(q log(1 + VAP_OP_BIN))); 0 if x is not
+// a positive finite number, which is left to the direct update.
+static int vap_op_bucket(real x, long *q)
+{
+    if (!(x > 0.0 && x < 1.e300)) {
+        return 0;
+    }
+    *q = lround(log(x) / log1p(VAP_OP_BIN));
+    return 1;
+}
+
+static int vap_op_slot(long q_h0, long q_fo)
+{
+    unsigned long h = (unsigned long)q_h0*2654435761ul ^ (unsigned long)q_fo*40503ul;
+    return (int)(h % VAP_OP_CACHE);
+}
+
+// Operator of the bucket (q_h0, q_fo) with the current vap_res: sin(lambda_n r_k)
+// once per term and layer, then A = sum_n phi_n(r_j) c_n w_k r_k sin(lambda_n r_k)
+// with the reconstruction phi_n(r) = sin(lambda_n r) / r (lambda_n at r = 0),
+// c_n = exp(-lambda_n^2 Fo) / b_n and the Simpson weights w_k of I_n (with dr/dxi).
+int vap_op_build(vap_op_t *op, long q_h0, long q_fo)
+{
+    int n_lambda = VAP_RES->n_lambda;
+    int st = VAP_RES->stride;
+    int n = N_INT / st + 1;
+    real h0 = exp(q_h0*log1p(VAP_OP_BIN)) - 1.0;
+    real fo = exp(q_fo*log1p(VAP_OP_BIN));
+    real lambda[N_Lambda];
+    VAP_ALIGN real sn[N_INT + 1];   // sin(lambda_n r_k), compact layers
+    VAP_ALIGN real u[N_INT + 1];    // c_n w_k r_k sin(lambda_n r_k)
+
+    Lambda_n(h0, lambda, n_lambda);
+    for (int j = 0; j < n; j++) {
+        for (int k = 0; k < n; k++) { op->A[j][k] = 0.0; }
+        op->v[j] = 1.0;
+    }
+    for (int i = 0; i < n_lambda; i++) {
+        real lam = lambda[i];
+        real b_n = 0.5*(1.0 + h0 / (h0*h0 + lam*lam));
+        real c = exp(0.0 - lam*lam*fo) / b_n;
+        real w = (st*Delta_R) / 3.0;
+        sn[0] = 0.0;
+        u[0] = 0.0;
+        for (int k = 1; k < n; k++) {
+            real r = VAP_R(k*st);
+            sn[k] = sin(lam*r);
+            u[k] = c*(k == n - 1 ? 1.0 : (k % 2 ? 4.0 : 2.0))*w*r*VAP_DR(k*st)*sn[k];
+        }
+        // zeta = (h0 + 1) T_eff; r[N_INT] == 1
+        real zeta = c*sn[n - 1] / (lam*lam)*(h0 + 1.0);
+        for (int j = 0; j < n; j++) {
+            real phi = j == 0 ? lam : sn[j] / VAP_R(j*st);
+            real *a = op->A[j];
+            for (int k = 1; k < n; k++) { a[k] += phi*u[k]; }
+            op->v[j] -= phi*zeta;
+        }
+    }
+    op->valid = 1;
+    op->q_h0 = q_h0;
+    op->q_fo = q_fo;
+    op->n_lambda = n_lambda;
+    op->stride = st;
+    return 0;
+}
+
+// C = A B for the n x n operator A (row length VAP_OP_LD) and the m columns
+// of B; B is traversed in blocks of VAP_OP_KB rows that stay in the L1 cache
+// while all rows of A pass over them, the columns are the SIMD lanes.
+int vap_op_gemm_generic(int n, int m, const real *A, real B[][VAP_BATCH], real C[][VAP_BATCH])
+{
+    for (int j = 0; j < n; j++) {
+        for (int l = 0; l < m; l++) { C[j][l] = 0.0; }
+    }
+    for (int k0 = 0; k0 < n; k0 += VAP_OP_KB) {
+        int k1 = MIN(n, k0 + VAP_OP_KB);
+        for (int j = 0; j < n; j++) {
+            const real *a = &A[(size_t)j*VAP_OP_LD];
+            real *c = C[j];
+            for (int k = k0; k < k1; k++) {
+                real a_jk = a[k];
+                const real *bk = B[k];
+                for (int l = 0; l < m; l++) { c[l] += a_jk*bk[l]; }
+            }
+        }
+    }
+    return 0;
+}
+
+int (*vap_op_gemm_p)(int n, int m, const real *A, real B[][VAP_BATCH], real C[][VAP_BATCH]) = vap_op_gemm_generic;
+
+int vap_op_gemm(int n, int m, const real *A, real B[][VAP_BATCH], real C[][VAP_BATCH])
+{
+    return vap_op_gemm_p(n, m, A, B, C);
+}
+
+// Advances the lanes of b whose bucket has (or gets) a cached operator;
+// use[l] is set for them. The other lanes are left untouched. b->Tr and b->sn
+// hold the gathered profiles and their products.
+int vap_op_update_batch(vap_batch_t *b, int use[])
+{
+    int n = b->n;
+    int st = VAP_RES->stride;
+    int nc = N_INT / st + 1;
+    vap_op_cache_t *oc = vap_op_cache;
+    long q_h0[VAP_BATCH], q_fo[VAP_BATCH];
+    int ok[VAP_BATCH];
+
+    for (int l = 0; l < n; l++) { use[l] = 0; }
+    if (oc == NULL) {
+        oc = vap_op_cache = vap_registry_new(&vap_op_threads, sizeof(vap_op_cache_t));
+        if (oc == NULL) {
+            Message("ALARM!!! Out of memory for the series-update operators, the updates are evaluated directly.\n");
+            return 0;
+        }
+    }
+    for (int l = 0; l < n; l++) {
+        ok[l] = vap_op_bucket(b->h0[l] + 1.0, &q_h0[l]) && vap_op_bucket(b->kappa[l]*b->dt[l], &q_fo[l]);
+    }
+    for (int l = 0; l < n; l++) {
+        if (!ok[l] || use[l]) {
+            continue;
+        }
+        // lanes of the bucket of lane l
+        int lanes[VAP_BATCH], m = 0;
+        for (int i = l; i < n; i++) {
+            if (ok[i] && !use[i] && q_h0[i] == q_h0[l] && q_fo[i] == q_fo[l]) {
+                lanes[m++] = i;
+            }
+        }
+        vap_op_t *op = &oc->op[vap_op_slot(q_h0[l], q_fo[l])];
+        int cached = op->valid && op->q_h0 == q_h0[l] && op->q_fo == q_fo[l]
+                     && op->n_lambda == VAP_RES->n_lambda && op->stride == st;
+        if (!cached) {
+            if (m < VAP_OP_MIN_LANES) {
+                for (int i = 0; i < m; i++) { ok[lanes[i]] = 0; }
+                continue;
+            }
+            vap_op_build(op, q_h0[l], q_fo[l]);
+            oc->built++;
+        }
+        for (int k = 0; k < nc; k++) {
+            for (int i = 0; i < m; i++) { b->Tr[k][i] = b->T[k*st][lanes[i]]; }
+        }
+        vap_op_gemm(nc, m, &op->A[0][0], b->Tr, b->sn);
+        for (int i = 0; i < m; i++) {
+            int li = lanes[i];
+            for (int j = 0; j < nc; j++) { b->T[j*st][li] = b->sn[j][i] + op->v[j]*b->T_eff[li]; }
+            for (int j = 0; j < N_INT; j += st) {
+                for (int k = 1; k < st; k++) { b->T[j + k][li] = b->T[j][li] + (b->T[j + st][li] - b->T[j][li])*k / st; }
+            }
+            use[li] = 1;
+        }
+        oc->lanes += m;
+    }
+    return 0;
+}
+
+// vap_heat_mass() of n <= VAP_BATCH droplets; b is scratch space. With
+// VAP_OPERATOR the lanes in buckets with an operator are advanced by it and
+// the rest by vap_series_update_batch(). Returns -1 if the surface balance of
+// a droplet did not converge.
+int vap_heat_mass_batch(vap_batch_t *b, int n, vap_state_t *s[], const vap_env_t *g[], const real Dp[],
+                        const real rho_p[], const real dt[], vap_rates_t *out[])
+{
+    real Sh_Star[VAP_BATCH];
+    vap_series_coef_t c[VAP_BATCH];
+    int use[VAP_BATCH];
+    int status = 0;
+    for (int l = 0; l < n; l++) {
+        VAP_PROP_LANE(l);
+        int prepared = vap_heat_mass_prepare(s[l], g[l], Dp[l], rho_p[l], &c[l], &Sh_Star[l]);
+        status = MIN(status, prepared);
+        use[l] = 0;
+    }
+#ifdef VAP_OPERATOR
+    b->n = n;
+    for (int l = 0; l < n; l++) {
+        b->h0[l] = c[l].h0;
+        b->kappa[l] = c[l].kappa;
+        b->T_eff[l] = c[l].T_eff;
+        b->dt[l] = dt[l];
+        for (int j = 0; j < N_INT + 1; j++) { b->T[j][l] = s[l]->T[j]; }
+    }
+    vap_op_update_batch(b, use);
+    for (int l = 0; l < n; l++) {
+        if (use[l]) {
+            for (int j = 0; j < N_INT + 1; j++) { s[l]->T[j] = b->T[j][l]; }
+        }
+    }
+#endif
+    // the remaining lanes, compacted
+    int lane[VAP_BATCH], m = 0;
+    for (int l = 0; l < n; l++) {
+        if (use[l]) {
+            continue;
+        }
+        b->h0[m] = c[l].h0;
+        b->zeta[m] = c[l].zeta;
+        b->kappa[m] = c[l].kappa;
+        b->T_eff[m] = c[l].T_eff;
+        b->dt[m] = dt[l];
+        for (int j = 0; j < N_INT + 1; j++) { b->T[j][m] = s[l]->T[j]; }
+        lane[m++] = l;
+    }
+    if (m > 0) {
+        b->n = m;
+        vap_series_update_batch(b);
+        for (int i = 0; i < m; i++) {
+            for (int j = 0; j < N_INT + 1; j++) { s[lane[i]]->T[j] = b->T[j][i]; }
+        }
+    }
+#ifdef VAP_OPERATOR
+    if (vap_op_cache != NULL) {
+        vap_op_cache->direct += m;
+    }
+#endif
+    for (int l = 0; l < n; l++) {
+        VAP_PROP_LANE(l);
+        vap_heat_mass_finish(s[l], g[l], Dp[l], Sh_Star[l], out[l]);
+    }
+    return status;
+}
+
+// BEGIN VAP tune
+// Auto-tuner of vap_res. For sampled particle steps the heat-mass update is
+// repeated at coarser settings of one parameter at a time and compared with
+// the compiled resolution (N_Lambda terms, all layers). The error of a step
+// is max(|dT_s|, |dT_av|) / max(|T_gas - T_s|, 1 K). After the calibration
+// phase the coarsest settings whose largest sampled error is within
+// VAP_TUNE_TOL / 2 each are chosen. The candidates run on the sampling thread
+// only (vap_res_trial) and every thread keeps its own errors, which
+// vap_tune_adjust combines. The time step is not tuned: a coarser DPM_DT
+// would also change the motion, the mass loss and the stability of the FLA
+// step, which a heat-mass sample cannot bound.
+#define VAP_TUNE_N_LAMBDA (6)
+#define VAP_TUNE_N_STRIDE (4)
+static const int vap_tune_n_lambda[VAP_TUNE_N_LAMBDA] = { N_Lambda, 32, 24, 16, 12, 8 };
+static const int vap_tune_stride[VAP_TUNE_N_STRIDE] = { 1, 2, 5, 10 };
+
+typedef struct vap_tune_s {
+    real err_lambda[VAP_TUNE_N_LAMBDA];
+    real err_stride[VAP_TUNE_N_STRIDE];
+    int samples;
+    int done;
+} vap_tune_t;
+
+vap_tune_t vap_tune = { { 0.0 }, { 0.0 }, 0, 0 };   // combined errors, done once vap_res is set
+static vap_registry_t vap_tune_threads;               // errors of the threads that sample
+static VAP_THREAD_LOCAL vap_tune_t *vap_tune_mine = NULL;
+
+#define VAP_TUNE_FAIL (1.e30) // error of a setting that overshoots to boiling
+
+// Runs a step of dt on s at the resolution res. Returns 0 if it would start
+// at or above the boiling point, where the surface balance breaks down, or
+// if the surface balance does not converge.
+static int vap_tune_run(vap_state_t *s, const vap_env_t *g, real Dp, real rho_p, real dt, const vap_res_t *res)
+{
+    vap_rates_t r;
+    if (!isfinite(s->T[N_INT]) || get_vapour_saturation_pressure(s->T[N_INT]) >= g->pressure) {
+        return 0;
+    }
+    vap_res_trial = res;
+    int status = vap_heat_mass(s, g, Dp, rho_p, dt, &r);
+    vap_res_trial = NULL;
+    return status == 0 && isfinite(s->T[N_INT]) && isfinite(s->T_av);
+}
+
+// Error of the state s against ref after a step from s0.
+static real vap_tune_error(const vap_state_t *s0, const vap_state_t *s, const vap_state_t *ref, const vap_env_t *g)
+{
+    real scale = MAX(fabs(g->temp - s0->T[N_INT]), 1.0);
+    return MAX(fabs(s->T[N_INT] - ref->T[N_INT]), fabs(s->T_av - ref->T_av)) / scale;
+}
+
+// Accounts the errors of one particle step of dt from the state s0 in the
+// errors of the calling thread.
+int vap_tune_sample(const vap_state_t *s0, const vap_env_t *g, real Dp, real rho_p, real dt)
+{
+    if (vap_tune_mine == NULL) {
+        vap_tune_mine = vap_registry_new(&vap_tune_threads, sizeof(vap_tune_t));
+    }
+    vap_tune_t *t = vap_tune_mine;
+    vap_res_t fine = { N_Lambda, 1 };
+    vap_state_t ref = *s0;
+    if (t == NULL || !vap_tune_run(&ref, g, Dp, rho_p, dt, &fine)) {
+        return 0;
+    }
+
+    for (int i = 0; i < VAP_TUNE_N_LAMBDA; i++) {
+        vap_res_t res = fine;
+        res.n_lambda = MIN(vap_tune_n_lambda[i], N_Lambda);
+        vap_state_t s = *s0;
+        real e = vap_tune_run(&s, g, Dp, rho_p, dt, &res) ? vap_tune_error(s0, &s, &ref, g) : VAP_TUNE_FAIL;
+        t->err_lambda[i] = MAX(t->err_lambda[i], e);
+    }
+    for (int i = 0; i < VAP_TUNE_N_STRIDE; i++) {
+        vap_res_t res = fine;
+        res.stride = vap_tune_stride[i];
+        if (N_INT % res.stride != 0 || (N_INT / res.stride) % 2 != 0) {
+            t->err_stride[i] = VAP_TUNE_FAIL;
+            continue;
+        }
+        vap_state_t s = *s0;
+        real e = vap_tune_run(&s, g, Dp, rho_p, dt, &res) ? vap_tune_error(s0, &s, &ref, g) : VAP_TUNE_FAIL;
+        t->err_stride[i] = MAX(t->err_stride[i], e);
+    }
+    t->samples++;
+    return 0;
+}
+
+// Combines the errors of the threads into t (maxima, sum of the samples).
+void vap_tune_combine(vap_tune_t *t)
+{
+    memset(t, 0, sizeof(*t));
+    for (int k = 0; k < VAP_REGISTRY_N(&vap_tune_threads); k++) {
+        const vap_tune_t *m = vap_tune_threads.obj[k];
+        if (m == NULL) {
+            continue;
+        }
+        for (int i = 0; i < VAP_TUNE_N_LAMBDA; i++) {
+            t->err_lambda[i] = MAX(t->err_lambda[i], m->err_lambda[i]);
+        }
+        for (int i = 0; i < VAP_TUNE_N_STRIDE; i++) {
+            t->err_stride[i] = MAX(t->err_stride[i], m->err_stride[i]);
+        }
+        t->samples += m->samples;
+    }
+}
+
+// Index of the coarsest setting with err[0..i] <= tol.
+static int vap_tune_pick(const real err[], int n, real tol)
+{
+    int i = 0;
+    while (i + 1 < n && err[i + 1] <= tol) {
+        i++;
+    }
+    return i;
+}
+
+// Sets vap_res from the accumulated errors (globally reduced in parallel)
+// and logs the choice if log is set.
+int vap_tune_select(int log)
+{
+    real tol = VAP_TUNE_TOL / 2.0;
+    int il = vap_tune_pick(vap_tune.err_lambda, VAP_TUNE_N_LAMBDA, tol);
+    int is = vap_tune_pick(vap_tune.err_stride, VAP_TUNE_N_STRIDE, tol);
+    vap_res.n_lambda = MIN(vap_tune_n_lambda[il], N_Lambda);
+    vap_res.stride = vap_tune_stride[is];
+    vap_tune.done = 1;
+    if (!log) {
+        return 0;
+    }
+    Message("VAP tune (%d samples): N_Lambda %d (err %.3e), layer stride %d (%d layers, err %.3e)\n",
+            vap_tune.samples, vap_res.n_lambda, vap_tune.err_lambda[il], vap_res.stride, N_INT / vap_res.stride,
+            vap_tune.err_stride[is]);
+    return 0;
+}
+// END VAP tune
+// END VAP kernel
+
+// BEGIN VAP dispatch
+// The hot kernels (series update, eigenvalue roots, FLA advance, batched
+// series update, operator product) are built
+// in several ISA variants in one library: the generic code and, with GCC or
+// clang on x86, AVX2/FMA and AVX-512 copies of it (flatten inlines the whole
+// call tree into each copy). vap_dispatch_init() keeps the variants the CPU
+// supports, times each of them on a short probe and points the kernels to
+// the fastest. Results of the variants differ in rounding only (FMA).
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VAP_DISPATCH
+#define VAP_TARGET_AVX2   __attribute__((target("avx2,fma"), flatten))
+#define VAP_TARGET_AVX512 __attribute__((target("avx512f,avx512dq,avx2,fma"), flatten))
+
+VAP_TARGET_AVX2 int fla_advance_avx2(real y[], real h, real tau, const real grad[])
+{
+    return fla_advance_generic(y, h, tau, grad);
+}
+
+VAP_TARGET_AVX512 int fla_advance_avx512(real y[], real h, real tau, const real grad[])
+{
+    return fla_advance_generic(y, h, tau, grad);
+}
+
+VAP_TARGET_AVX2 int Lambda_n_avx2(real h_0, real lambda[], int n)
+{
+    return Lambda_n_generic(h_0, lambda, n);
+}
+
+VAP_TARGET_AVX512 int Lambda_n_avx512(real h_0, real lambda[], int n)
+{
+    return Lambda_n_generic(h_0, lambda, n);
+}
+
+VAP_TARGET_AVX2 int vap_series_update_avx2(real T[], real h0, real zeta, real kappa, real T_eff, real dt)
+{
+    return vap_series_update_generic(T, h0, zeta, kappa, T_eff, dt);
+}
+
+VAP_TARGET_AVX512 int vap_series_update_avx512(real T[], real h0, real zeta, real kappa, real T_eff, real dt)
+{
+    return vap_series_update_generic(T, h0, zeta, kappa, T_eff, dt);
+}
+
+VAP_TARGET_AVX2 int vap_series_update_batch_avx2(vap_batch_t *b)
+{
+    return vap_series_update_batch_generic(b);
+}
+
+VAP_TARGET_AVX512 int vap_series_update_batch_avx512(vap_batch_t *b)
+{
+    return vap_series_update_batch_generic(b);
+}
+
+VAP_TARGET_AVX2 int vap_op_gemm_avx2(int n, int m, const real *A, real B[][VAP_BATCH], real C[][VAP_BATCH])
+{
+    return vap_op_gemm_generic(n, m, A, B, C);
+}
+
+VAP_TARGET_AVX512 int vap_op_gemm_avx512(int n, int m, const real *A, real B[][VAP_BATCH], real C[][VAP_BATCH])
+{
+    return vap_op_gemm_generic(n, m, A, B, C);
+}
+#endif // VAP_DISPATCH
+
+#define VAP_N_VARIANTS (3)
+static const char *vap_variant_name[VAP_N_VARIANTS] = { "generic", "avx2", "avx512" };
+
+#define VAP_N_KERNELS (5)
+
+// Best of three timings of the probe of kernel k (0 series, 1 roots, 2 FLA,
+// 3 batched series, 4 operator product) with the currently selected variant.
+static double vap_dispatch_probe(int k)
+{
+    static vap_batch_t b;
+    static real A[N_INT + 1][VAP_OP_LD];
+    double best = 1.e30;
+    for (int rep = 0; rep < 3; rep++) {
+        VAP_ALIGN real T[N_INT + 1];
+        real lambda[N_Lambda];
+        real y[FLA_N_SCAL];
+        real grad[FLA_N_GRAD] = { 100.0, 300.0, 0.0, -100.0 };
+        for (int j = 0; j < N_INT + 1; j++) { T[j] = 300.0 + 100.0*j*Delta_R; }
+        fla_init(y);
+        b.n = 4;
+        for (int l = 0; l < b.n; l++) {
+            for (int j = 0; j < N_INT + 1; j++) { b.T[j][l] = T[j]; }
+            b.h0[l] = 2.0 + 0.1*l;
+            b.zeta[l] = (b.h0[l] + 1.0)*800.0;
+            b.kappa[l] = 1.e3;
+            b.T_eff[l] = 800.0;
+            b.dt[l] = 1.e-5;
+        }
+        double t0 = vap_wtime();
+        for (int i = 0; i < 20; i++) {
+            if (k == 0) {
+                vap_series_update(T, 2.0, 3.0*800.0, 1.e3, 800.0, 1.e-5);
+            } else if (k == 1) {
+                Lambda_n(0.5 + 0.1*i, lambda, N_Lambda);
+            } else if (k == 2) {
+                for (int l = 0; l < 50; l++) { fla_advance(y, 1.e-4, 1.e-3, grad); }
+            } else if (k == 4) {
+                vap_op_gemm(N_INT + 1, VAP_BATCH, &A[0][0], b.T, b.sn);
+            } else if (i % 4 == 0) {
+                vap_series_update_batch(&b);
+            }
+        }
+        best = MIN(best, vap_wtime() - t0);
+    }
+    return best;
+}
+
+// Selects the fastest supported variant of every kernel and logs the choice
+// with the label rank (the node id in Fluent).
+int vap_dispatch_init(int rank)
+{
+    int supported[VAP_N_VARIANTS] = { 1, 0, 0 };
+#ifdef VAP_DISPATCH
+    __builtin_cpu_init();
+    supported[1] = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    supported[2] = supported[1] && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq");
+    int (*series[VAP_N_VARIANTS])(real[], real, real, real, real, real) =
+        { vap_series_update_generic, vap_series_update_avx2, vap_series_update_avx512 };
+    int (*roots[VAP_N_VARIANTS])(real, real[], int) = { Lambda_n_generic, Lambda_n_avx2, Lambda_n_avx512 };
+    int (*fla[VAP_N_VARIANTS])(real[], real, real, const real[]) =
+        { fla_advance_generic, fla_advance_avx2, fla_advance_avx512 };
+    int (*batch[VAP_N_VARIANTS])(vap_batch_t *) =
+        { vap_series_update_batch_generic, vap_series_update_batch_avx2, vap_series_update_batch_avx512 };
+    int (*gemm[VAP_N_VARIANTS])(int, int, const real *, real[][VAP_BATCH], real[][VAP_BATCH]) =
+        { vap_op_gemm_generic, vap_op_gemm_avx2, vap_op_gemm_avx512 };
+#endif
+    int chosen[VAP_N_KERNELS] = { 0, 0, 0, 0, 0 };
+    double t_chosen[VAP_N_KERNELS];
+    for (int k = 0; k < VAP_N_KERNELS; k++) {
+        t_chosen[k] = 1.e30;
+        for (int v = 0; v < VAP_N_VARIANTS; v++) {
+            if (!supported[v]) {
+                continue;
+            }
+#ifdef VAP_DISPATCH
+            vap_series_update_p = series[k == 0 ? v : chosen[0]];
+            Lambda_n_p = roots[k == 1 ? v : chosen[1]];
+            fla_advance_p = fla[k == 2 ? v : chosen[2]];
+            vap_series_update_batch_p = batch[k == 3 ? v : chosen[3]];
+            vap_op_gemm_p = gemm[k == 4 ? v : chosen[4]];
+#endif
+            double t = vap_dispatch_probe(k);
+            if (t < t_chosen[k]) {
+                t_chosen[k] = t;
+                chosen[k] = v;
+            }
+        }
+    }
+#ifdef VAP_DISPATCH
+    vap_series_update_p = series[chosen[0]];
+    Lambda_n_p = roots[chosen[1]];
+    fla_advance_p = fla[chosen[2]];
+    vap_series_update_batch_p = batch[chosen[3]];
+    vap_op_gemm_p = gemm[chosen[4]];
+#endif
+    Message("VAP dispatch, rank %d: series %s (%.1f us), roots %s (%.1f us), FLA %s (%.1f us), batch %s (%.1f us), "
+            "operator %s (%.1f us)\n",
+            rank, vap_variant_name[chosen[0]], 1.e6*t_chosen[0], vap_variant_name[chosen[1]], 1.e6*t_chosen[1],
+            vap_variant_name[chosen[2]], 1.e6*t_chosen[2], vap_variant_name[chosen[3]], 1.e6*t_chosen[3],
+            vap_variant_name[chosen[4]], 1.e6*t_chosen[4]);
+    return 0;
+}
+// END VAP dispatch
+
+// BEGIN VAP checkpoint
+// Compact record of the droplet state that the next step cannot recompute,
+// for the checkpoint side-files of vap_ckpt_write/vap_ckpt_read: surface and
+// average temperature, the profile quantised to 16 bit between its extremes
+// (error below 1/131070 of its range), J and W, the count of sign changes of
+// det J, r_0 and, with FLA_TURB, the puff covariance. About 310 bytes instead
+// of the 1088 of the user reals; the rates and surface quantities are
+// recomputed by the next heat-mass step, det J and N_P from J (P).
+#define VAP_CKPT_VERSION (1)
+#define VAP_CKPT_MAX_INT (1000) // most layers of a profile that can be read
+#define VAP_CKPT_MAX_RECORD (4 + 4*8 + 2*VAP_CKPT_MAX_INT + 9*8 + 2 + 8*FLA_N_TURB)
+#define VAP_N_USER_REALS (FLA_OFFSET + FLA_N_SCAL + VAP_MR_N)
+
+typedef struct vap_ckpt_header_s {
+    char magic[8];      // "FLAVAPCK"
+    int32_t version;
+    int32_t n_int;      // layers of the profile
+    int32_t n_turb;     // values of the puff covariance, 0 without FLA_TURB
+    int32_t n_files;    // side-files of the checkpoint (compute nodes)
+    int64_t n_records;
+} vap_ckpt_header_t;
+
+int vap_ckpt_header_init(vap_ckpt_header_t *h, int n_files, int64_t n_records)
+{
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, "FLAVAPCK", 8);
+    h->version = VAP_CKPT_VERSION;
+    h->n_int = N_INT;
+#ifdef FLA_TURB
+    h->n_turb = FLA_N_TURB;
+#endif
+    h->n_files = n_files;
+    h->n_records = n_records;
+    return 0;
+}
+
+// 0 if the side-file can be read by this build.
+int vap_ckpt_header_check(const vap_ckpt_header_t *h)
+{
+    if (memcmp(h->magic, "FLAVAPCK", 8) != 0 || h->version != VAP_CKPT_VERSION) {
+        return -1;
+    }
+    if (h->n_int < 2 || h->n_int > VAP_CKPT_MAX_INT || (h->n_turb != 0 && h->n_turb != FLA_N_TURB)) {
+        return -1;
+    }
+    return 0;
+}
+
+int vap_ckpt_record_size(const vap_ckpt_header_t *h)
+{
+    return 4 + 4*8 + 2*h->n_int + 9*8 + 2 + 8*h->n_turb;
+}
+
+static unsigned char *vap_ckpt_put(unsigned char *b, double x)
+{
+    memcpy(b, &x, 8);
+    return b + 8;
+}
+
+static const unsigned char *vap_ckpt_get(const unsigned char *b, double *x)
+{
+    memcpy(x, b, 8);
+    return b + 8;
+}
+
+// Packs the user-real block u[] (VAP_N_USER_REALS values) of droplet id into buf.
+int vap_ckpt_pack(unsigned char *buf, int id, const real u[])
+{
+    unsigned char *b = buf;
+    int32_t id32 = id;
+    memcpy(b, &id32, 4);
+    b += 4;
+    const real *T = &u[VAP_I_T(0)];
+    real T_lo = T[0], T_hi = T[0];
+    for (int j = 1; j < N_INT; j++) {
+        T_lo = MIN(T_lo, T[j]);
+        T_hi = MAX(T_hi, T[j]);
+    }
+    real step = (T_hi - T_lo) / 65535.0;
+    b = vap_ckpt_put(b, T[N_INT]);
+    b = vap_ckpt_put(b, u[VAP_I_T_AV]);
+    b = vap_ckpt_put(b, T_lo);
+    b = vap_ckpt_put(b, step);
+    for (int j = 0; j < N_INT; j++) {
+        uint16_t q = step > 0.0 ? (uint16_t)((T[j] - T_lo) / step + 0.5) : 0;
+        memcpy(b, &q, 2);
+        b += 2;
+    }
+    const real *y = &u[FLA_OFFSET];
+    for (int i = 0; i < 8; i++) {
+        b = vap_ckpt_put(b, y[i]);
+    }
+    b = vap_ckpt_put(b, y[FLA_I_R_0]);
+    int16_t n_sign = (int16_t)y[FLA_I_N_J_SIGN];
+    memcpy(b, &n_sign, 2);
+    b += 2;
+#ifdef FLA_TURB
+    for (int i = 0; i < FLA_N_TURB; i++) {
+        b = vap_ckpt_put(b, y[FLA_I_TURB + i]);
+    }
+#endif
+    return (int)(b - buf);
+}
+
+// Restores a record of the side-file with header h into the user-real block
+// u[]; the fields the record does not hold are left as they are. A profile on
+// a different number of layers is interpolated linearly onto N_INT layers.
+// Returns the droplet id.
+int vap_ckpt_unpack(const unsigned char *buf, const vap_ckpt_header_t *h, real u[])
+{
+    const unsigned char *b = buf;
+    int32_t id;
+    memcpy(&id, b, 4);
+    b += 4;
+    double T_s, T_av, T_lo, step, x;
+    b = vap_ckpt_get(b, &T_s);
+    b = vap_ckpt_get(b, &T_av);
+    b = vap_ckpt_get(b, &T_lo);
+    b = vap_ckpt_get(b, &step);
+    int n = h->n_int;
+    real T_old[VAP_CKPT_MAX_INT + 1];
+    for (int j = 0; j < n; j++) {
+        uint16_t q;
+        memcpy(&q, b, 2);
+        b += 2;
+        T_old[j] = T_lo + q*step;
+    }
+    T_old[n] = T_s;
+    real *T = &u[VAP_I_T(0)];
+    for (int j = 0; j < N_INT; j++) {
+        real r = (real)j*n / N_INT;
+        int i = (int)r;
+        T[j] = T_old[i] + (T_old[i + 1] - T_old[i])*(r - i);
+    }
+    T[N_INT] = T_s;
+    u[VAP_I_T_AV] = n == N_INT ? T_av : vap_average_temperature(T);
+
+    real *y = &u[FLA_OFFSET];
+    for (int i = 0; i < 8; i++) {
+        b = vap_ckpt_get(b, &x);
+        y[i] = x;
+    }
+    b = vap_ckpt_get(b, &x);
+    y[FLA_I_R_0] = x;
+    int16_t n_sign;
+    memcpy(&n_sign, b, 2);
+    b += 2;
+    y[FLA_I_N_J_SIGN] = n_sign;
+    y[FLA_I_J_DET] = y[0]*y[3] - y[1]*y[2];
+    y[FLA_I_N_P] = 1./fabs(y[FLA_I_J_DET]);
+#ifdef FLA_TURB
+    if (h->n_turb == FLA_N_TURB) {
+        for (int i = 0; i < FLA_N_TURB; i++) {
+            b = vap_ckpt_get(b, &x);
+            y[FLA_I_TURB + i] = x;
+        }
+        y[FLA_I_N_P] = fla_turb_n_p(&y[FLA_I_TURB]);
+    }
+#endif
+#ifdef FLA_MAGNUS
+    // the gradients of the last step are not kept, the next step freezes its own
+    memset(&y[FLA_I_MAGNUS], 0, FLA_N_MAGNUS*sizeof(real));
+#endif
+#ifdef VAP_MULTIRATE
+    // the next step restarts the extrapolation from the restored profile
+    memset(&u[VAP_MR_OFFSET], 0, VAP_MR_N*sizeof(real));
+#endif
+    return id;
+}
+// END VAP checkpoint
+
+// BEGIN VAP host adapter
+// The particle steps reach their CFD host through the callbacks of vap_host_t
+// only: particle data, the stored droplet and FLA state, the gas state and
+// the velocity gradients of the particle's cell, and the deposition of the
+// sources. vap_fluent_host() implements them with the Fluent macros,
+// vap_generic_host() with flat records and per-cell callbacks for any other
+// host (a stand-in host is fla-vap-host.c). p is the particle handle of the
+// host, ctx the host's data; the callbacks return 0 on success.
+typedef struct vap_particle_s {
+    real Dp;    // diameter, m
+    real rho;   // density, kg/m^3
+    real dt;    // step, s
+    real tau;   // momentum relaxation time of the host's drag law, s
+} vap_particle_t;
+
+typedef struct vap_host_s {
+    void *ctx;
+    int (*particle)(void *ctx, void *p, vap_particle_t *q);
+    int (*read_state)(void *ctx, void *p, vap_state_t *s);
+    // gas state seen by the particle, see vap_env_t
+    int (*gas)(void *ctx, void *p, const vap_state_t *s, vap_env_t *g);
+    // stores the advanced state and deposits the rates of the step
+    int (*apply)(void *ctx, void *p, const vap_state_t *s, const vap_rates_t *r);
+    int (*read_fla)(void *ctx, void *p, real y[]);
+    int (*write_fla)(void *ctx, void *p, const real y[]);
+    // FLA_N_GRAD velocity gradients and k, epsilon of the particle's cell
+    int (*flow)(void *ctx, void *p, real grad[], real turb[2]);
+} vap_host_t;
+
+// Heat and mass transfer step of particle p, as multivap_conv_diffusion_new
+// (with VAP_MULTIRATE vap_heat_mass_multirate()). Returns -1 if a callback
+// failed or the surface balance did not converge (the step is then applied
+// with its last iterate), 0 otherwise.
+int vap_host_heat_mass(const vap_host_t *h, void *p, vap_rates_t *r)
+{
+    vap_particle_t q;
+    vap_state_t s;
+    vap_env_t g;
+    if (h->particle(h->ctx, p, &q) != 0 || h->read_state(h->ctx, p, &s) != 0 || h->gas(h->ctx, p, &s, &g) != 0) {
+        return -1;
+    }
+#ifdef VAP_MULTIRATE
+    int status = vap_heat_mass_multirate(&s, &g, q.Dp, q.rho, q.dt, r);
+#else
+    int status = vap_heat_mass(&s, &g, q.Dp, q.rho, q.dt, r);
+#endif
+    int applied = h->apply(h->ctx, p, &s, r);
+    return MIN(status, applied);
+}
+
+// FLA step of particle p, as the FLA calculation of Diesel_droplet. Without
+// turbulence data (epsilon = 0) FLA_TURB leaves N_P to fla_advance().
+int vap_host_fla(const vap_host_t *h, void *p)
+{
+    vap_particle_t q;
+    real y[FLA_N_SCAL];
+    real grad[FLA_N_GRAD];
+    real turb[2] = { 0.0, 0.0 };
+    if (h->particle(h->ctx, p, &q) != 0 || h->read_fla(h->ctx, p, y) != 0 || h->flow(h->ctx, p, grad, turb) != 0) {
+        return -1;
+    }
+    fla_advance(y, q.dt, q.tau, grad);
+#ifdef FLA_TURB
+    if (turb[1] > 0.0) {
+        fla_turb_advance(y, q.dt, q.tau, grad, turb[0], turb[1]);
+    }
+#endif
+    return h->write_fla(h->ctx, p, y);
+}
+
+// Copies the hot block of the user reals u (VAP_I_*) to s, as vap_read_user_real().
+int vap_state_unpack(vap_state_t *s, const real u[])
+{
+    for (int ns = 0; ns < NCOMPONENTS; ns++) {
+        s->x_surf[ns] = u[VAP_I_X_SURF(ns)];
+        s->Ys[ns] = u[VAP_I_YS(ns)];
+        s->vap_rate[ns] = u[VAP_I_RATE(ns)];
+    }
+    s->h = u[VAP_I_H];
+    s->Ys_tot = u[VAP_I_YS_TOT];
+    s->tot_vap_rate = u[VAP_I_TOT_RATE];
+    s->BM = u[VAP_I_BM];
+    s->BT = u[VAP_I_BT];
+    s->L_eff = u[VAP_I_L_EFF];
+    s->Nu = u[VAP_I_NU];
+    s->T_av = u[VAP_I_T_AV];
+    for (int j = 0; j < N_INT + 1; j++) {
+        s->T[j] = u[VAP_I_T(j)];
+    }
+    s->coef = u[VAP_I_COEF];
+    s->Nu_star = u[VAP_I_NU_STAR];
+    s->D = u[VAP_I_D];
+    s->kgas = u[VAP_I_KGAS];
+#ifdef VAP_MULTIRATE
+    for (int i = 0; i < VAP_MR_N; i++) {
+        s->mr[i] = u[VAP_MR_OFFSET + i];
+    }
+#endif
+    return 0;
+}
+
+// Complements vap_state_unpack().
+int vap_state_pack(const vap_state_t *s, real u[])
+{
+    for (int ns = 0; ns < NCOMPONENTS; ns++) {
+        u[VAP_I_X_SURF(ns)] = s->x_surf[ns];
+        u[VAP_I_YS(ns)] = s->Ys[ns];
+        u[VAP_I_RATE(ns)] = s->vap_rate[ns];
+    }
+    u[VAP_I_H] = s->h;
+    u[VAP_I_YS_TOT] = s->Ys_tot;
+    u[VAP_I_TOT_RATE] = s->tot_vap_rate;
+    u[VAP_I_BM] = s->BM;
+    u[VAP_I_BT] = s->BT;
+    u[VAP_I_L_EFF] = s->L_eff;
+    u[VAP_I_NU] = s->Nu;
+    u[VAP_I_T_AV] = s->T_av;
+    for (int j = 0; j < N_INT + 1; j++) {
+        u[VAP_I_T(j)] = s->T[j];
+    }
+    u[VAP_I_COEF] = s->coef;
+    u[VAP_I_NU_STAR] = s->Nu_star;
+    u[VAP_I_D] = s->D;
+    u[VAP_I_KGAS] = s->kgas;
+#ifdef VAP_MULTIRATE
+    for (int i = 0; i < VAP_MR_N; i++) {
+        u[VAP_MR_OFFSET + i] = s->mr[i];
+    }
+#endif
+    return 0;
+}
+
+// Particle record of the generic host: the user reals in the layout of the
+// UDF (so vap_ckpt_pack() applies) and the particle data of the step, which
+// the host fills in. host points to the host's own particle, if any.
+typedef struct vap_record_s {
+    real u[VAP_N_USER_REALS];
+    vap_particle_t q;
+    int cell;
+    void *host;
+} vap_record_t;
+
+// Cell data of the generic host. deposit receives the rates of one droplet;
+// the droplets a parcel stands for are N_P(rec) = rec->u[FLA_OFFSET + FLA_I_N_P].
+typedef struct vap_cells_s {
+    void *ctx;
+    int (*gas)(void *ctx, const vap_record_t *rec, real Ts, vap_env_t *g);
+    int (*flow)(void *ctx, const vap_record_t *rec, real grad[], real turb[2]);
+    int (*deposit)(void *ctx, const vap_record_t *rec, const vap_rates_t *r);
+} vap_cells_t;
+
+// As the initialize branch of Diesel_droplet.
+int vap_record_init(vap_record_t *rec, real Dp, real rho, real T0)
+{
+    memset(rec, 0, sizeof(*rec));
+    for (int j = 0; j < N_INT + 1; j++) {
+        rec->u[VAP_I_T(j)] = T0;
+    }
+    rec->u[VAP_I_T_AV] = T0;
+    rec->u[VAP_I_NU] = 2.0;
+    rec->q.Dp = Dp;
+    rec->q.rho = rho;
+    return fla_init(&rec->u[FLA_OFFSET]);
+}
+
+static int vap_generic_particle(void *ctx, void *p, vap_particle_t *q)
+{
+    (void)ctx;
+    *q = ((vap_record_t *)p)->q;
+    return 0;
+}
+
+static int vap_generic_read_state(void *ctx, void *p, vap_state_t *s)
+{
+    (void)ctx;
+    return vap_state_unpack(s, ((vap_record_t *)p)->u);
+}
+
+static int vap_generic_gas(void *ctx, void *p, const vap_state_t *s, vap_env_t *g)
+{
+    vap_cells_t *cells = ctx;
+    return cells->gas(cells->ctx, p, s->T[N_INT], g);
+}
+
+static int vap_generic_apply(void *ctx, void *p, const vap_state_t *s, const vap_rates_t *r)
+{
+    vap_cells_t *cells = ctx;
+    vap_record_t *rec = p;
+    vap_state_pack(s, rec->u);
+    rec->u[VAP_END] = r->dh_dt;
+    rec->u[VAP_END + 2] = r->vap_rate;
+    return cells->deposit(cells->ctx, rec, r);
+}
+
+static int vap_generic_read_fla(void *ctx, void *p, real y[])
+{
+    (void)ctx;
+    memcpy(y, &((vap_record_t *)p)->u[FLA_OFFSET], FLA_N_SCAL*sizeof(real));
+    return 0;
+}
+
+static int vap_generic_write_fla(void *ctx, void *p, const real y[])
+{
+    (void)ctx;
+    vap_record_t *rec = p;
+    memcpy(&rec->u[FLA_OFFSET], y, FLA_N_SCAL*sizeof(real));
+    rec->u[VAP_END + 1] = rec->u[VAP_END]*y[FLA_I_N_P];
+    rec->u[VAP_END + 3] = rec->u[VAP_END + 2]*y[FLA_I_N_P];
+    return 0;
+}
+
+static int vap_generic_flow(void *ctx, void *p, real grad[], real turb[2])
+{
+    vap_cells_t *cells = ctx;
+    return cells->flow(cells->ctx, p, grad, turb);
+}
+
+// Host adapter over vap_record_t particles and the cell callbacks of cells.
+vap_host_t vap_generic_host(vap_cells_t *cells)
+{
+    vap_host_t h = { cells, vap_generic_particle, vap_generic_read_state, vap_generic_gas, vap_generic_apply,
+                     vap_generic_read_fla, vap_generic_write_fla, vap_generic_flow };
+    return h;
+}
+// END VAP host adapter
+
+// BEGIN FLA cell accumulators
+// Per-cell sums of the droplet steps of a DPM pass. A spray touches a small
+// fraction of the cells, so the sums are kept in an open-addressing hash table
+// (linear probing) keyed by the cell, together with the list of the touched
+// slots. Clearing, merging and scattering cost O(touched cells) instead of
+// O(mesh). The table doubles at half load; keys are >= 0.
+#define FLA_ACC_W     (0) // residence time, s
+#define FLA_ACC_N_P   (1) // N_P dt
+#define FLA_ACC_HEAT  (2) // N_P dh/dt dt, J
+#define FLA_ACC_MASS  (3) // N_P dm/dt dt, kg
+#define FLA_ACC_STEPS (4) // particle steps
+#define FLA_ACC_D     (5) // N_P d dt
+#define FLA_ACC_T     (6) // N_P T_av dt
+#define FLA_ACC_N     (7)
+
+// Cell key of the accumulators: zone id and cell index.
+#define FLA_ACC_KEY(c, t) (((int64_t)THREAD_ID(t) << 32) | (int64_t)(uint32_t)(c))
+
+typedef struct fla_acc_s {
+    int capacity;       // slots, a power of two
+    int n;              // touched cells
+    int64_t *key;       // [capacity], -1 if free
+    real *v;            // [FLA_ACC_N*capacity]
+    int *touched;       // [capacity/2], slots in the order of their first touch
+} fla_acc_t;
+
+void fla_acc_free(fla_acc_t *a)
+{
+    free(a->key); free(a->v); free(a->touched);
+    memset(a, 0, sizeof(*a));
+}
+
+// Empty table for about capacity/2 cells; 0 on success.
+int fla_acc_init(fla_acc_t *a, int capacity)
+{
+    memset(a, 0, sizeof(*a));
+    int n = 16;
+    while (n < capacity) {
+        n *= 2;
+    }
+    a->key = malloc(n*sizeof(int64_t));
+    a->v = calloc((size_t)FLA_ACC_N*n, sizeof(real));
+    a->touched = malloc(n / 2*sizeof(int));
+    if (a->key == NULL || a->v == NULL || a->touched == NULL) {
+        fla_acc_free(a);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        a->key[i] = -1;
+    }
+    a->capacity = n;
+    return 0;
+}
+
+// Slot of key, or the free slot it goes to.
+static inline int fla_acc_slot(const fla_acc_t *a, int64_t key)
+{
+    int mask = a->capacity - 1;
+    int i = (int)(((uint64_t)key*UINT64_C(0x9E3779B97F4A7C15)) >> 40) & mask;
+    while (a->key[i] != key && a->key[i] >= 0) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// Sums of cell key, zeros if it is new; NULL if out of memory.
+real *fla_acc_cell(fla_acc_t *a, int64_t key)
+{
+    if (a->capacity == 0 && fla_acc_init(a, 0) != 0) {
+        return NULL;
+    }
+    int i = fla_acc_slot(a, key);
+    if (a->key[i] == key) {
+        return &a->v[FLA_ACC_N*i];
+    }
+    if (2*(a->n + 1) > a->capacity) {
+        // rehash into the double size, in the order of the first touch
+        fla_acc_t b;
+        if (fla_acc_init(&b, 2*a->capacity) != 0) {
+            return NULL;
+        }
+        for (int k = 0; k < a->n; k++) {
+            int s = a->touched[k];
+            int j = fla_acc_slot(&b, a->key[s]);
+            b.key[j] = a->key[s];
+            memcpy(&b.v[FLA_ACC_N*j], &a->v[FLA_ACC_N*s], FLA_ACC_N*sizeof(real));
+            b.touched[b.n++] = j;
+        }
+        fla_acc_free(a);
+        *a = b;
+        i = fla_acc_slot(a, key);
+    }
+    a->key[i] = key;
+    a->touched[a->n++] = i;
+    return &a->v[FLA_ACC_N*i];
+}
+
+// Empties the table; only the touched slots are written.
+void fla_acc_clear(fla_acc_t *a)
+{
+    for (int k = 0; k < a->n; k++) {
+        int s = a->touched[k];
+        a->key[s] = -1;
+        memset(&a->v[FLA_ACC_N*s], 0, FLA_ACC_N*sizeof(real));
+    }
+    a->n = 0;
+}
+
+// Adds the sums of src to dst; 0 on success.
+int fla_acc_merge(fla_acc_t *dst, const fla_acc_t *src)
+{
+    for (int k = 0; k < src->n; k++) {
+        int s = src->touched[k];
+        real *v = fla_acc_cell(dst, src->key[s]);
+        if (v == NULL) {
+            return -1;
+        }
+        for (int q = 0; q < FLA_ACC_N; q++) {
+            v[q] += src->v[FLA_ACC_N*s + q];
+        }
+    }
+    return 0;
+}
+
+// Memory of the table, bytes.
+size_t fla_acc_bytes(const fla_acc_t *a)
+{
+    return (size_t)a->capacity*(sizeof(int64_t) + FLA_ACC_N*sizeof(real)) + (size_t)a->capacity / 2*sizeof(int);
+}
+// END FLA cell accumulators
+
+#ifndef FLA_VAP_STANDALONE
+
+// BEGIN FLA trace
+// Timeline of the DPM iterations in Chrome trace-event JSON (chrome://tracing,
+// ui.perfetto.dev). Every compute node writes fla-trace-<myid>.json with
+// pid = myid; fla_trace_merge (on demand) joins them into fla-trace.json.
+// Kernel calls are far too many to be written one by one: per iteration the
+// tracking span runs from the first to the last DPM callback and the
+// heat-mass/FLA spans carry the accumulated time and the number of calls.
+// Every tracking thread accounts its calls into its own fla_trace_thread_t,
+// fla_trace_flush_iteration merges them. The reductions and the output of the
+// adjust and on-demand functions are spans of their own on lane 0.
+// Timestamps are wall clock in us, so the ranks line up if the node clocks do.
+#define FLA_TRACE_HEAT_MASS 0
+#define FLA_TRACE_FLA       1
+#define FLA_TRACE_N_KERNELS 2
+
+#ifdef FLA_TRACE
+static const char *fla_trace_kernel_name[FLA_TRACE_N_KERNELS] = { "heat_mass", "fla_update" };
+
+static struct {
+    FILE *f;
+} fla_trace = { NULL };
+
+typedef struct fla_trace_thread_s {
+    double first;                          // first kernel call in this iteration, < 0 if none
+    double last;                           // end of the last kernel call
+    double total[FLA_TRACE_N_KERNELS];     // accumulated time of the kernel
+    long calls[FLA_TRACE_N_KERNELS];
+} fla_trace_thread_t;
+
+static vap_registry_t fla_trace_threads;
+static VAP_THREAD_LOCAL fla_trace_thread_t *fla_trace_mine = NULL;
+
+static FILE *fla_trace_file(void)
+{
+    if (fla_trace.f == NULL) {
+        char name[64];
+        sprintf(name, "fla-trace-%d.json", myid);
+        fla_trace.f = fopen(name, "w");
+        if (fla_trace.f == NULL) {
+            Message("ALARM!!! Cannot open %s\n", name);
+            return NULL;
+        }
+        // the closing bracket is optional in the JSON array format
+        fprintf(fla_trace.f, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"node %d\"}},\n", myid, myid);
+    }
+    return fla_trace.f;
+}
+
+// Complete event [ts, ts + dur] on lane tid; calls < 0 omits the args.
+void fla_trace_span(const char *name, int tid, double ts, double dur, long calls)
+{
+    FILE *f = fla_trace_file();
+    if (f == NULL) {
+        return;
+    }
+    fprintf(f, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f", name, myid, tid, ts, dur);
+    if (calls >= 0) {
+        fprintf(f, ",\"args\":{\"calls\":%ld}", calls);
+    }
+    fprintf(f, "},\n");
+}
+
+// Accounts one kernel call [t0, t1] of the calling thread.
+void fla_trace_kernel(int k, double t0, double t1)
+{
+    fla_trace_thread_t *tt = fla_trace_mine;
+    if (tt == NULL) {
+        tt = fla_trace_mine = vap_registry_new(&fla_trace_threads, sizeof(fla_trace_thread_t));
+        if (tt == NULL) {
+            return;
+        }
+        tt->first = -1.0;
+    }
+    if (tt->first < 0.0) {
+        tt->first = t0;
+    }
+    tt->last = t1;
+    tt->total[k] += t1 - t0;
+    tt->calls[k]++;
+}
+
+// Writes the spans of the DPM pass since the last call, if there was one:
+// the tracking span from the first to the last call of any thread, the kernel
+// spans with the time and the calls summed over the threads.
+void fla_trace_flush_iteration(void)
+{
+    double first = -1.0, last = -1.0, total[FLA_TRACE_N_KERNELS] = { 0.0 };
+    long calls[FLA_TRACE_N_KERNELS] = { 0 };
+    for (int i = 0; i < VAP_REGISTRY_N(&fla_trace_threads); i++) {
+        fla_trace_thread_t *tt = fla_trace_threads.obj[i];
+        if (tt == NULL || tt->first < 0.0) {
+            continue;
+        }
+        if (first < 0.0 || tt->first < first) {
+            first = tt->first;
+        }
+        last = MAX(last, tt->last);
+        for (int k = 0; k < FLA_TRACE_N_KERNELS; k++) {
+            total[k] += tt->total[k];
+            calls[k] += tt->calls[k];
+            tt->total[k] = 0.0;
+            tt->calls[k] = 0;
+        }
+        tt->first = -1.0;
+        tt->last = -1.0;
+    }
+    if (first < 0.0) {
+        return;
+    }
+    double t0 = 1.e6*vap_wtime();
+    fla_trace_span("dpm_tracking", 0, first, last - first, -1);
+    for (int k = 0; k < FLA_TRACE_N_KERNELS; k++) {
+        fla_trace_span(fla_trace_kernel_name[k], 1 + k, first, total[k], calls[k]);
+    }
+    fflush(fla_trace.f);
+    fla_trace_span("trace_write", 0, t0, 1.e6*vap_wtime() - t0, -1);
+}
+
+// Span name on lane 0 from t0 to now: the reductions and the output of the
+// adjust and on-demand functions.
+#define FLA_TRACE_SPAN_START(t0)      double t0 = 1.e6*vap_wtime()
+#define FLA_TRACE_SPAN_STOP(name, t0) fla_trace_span(name, 0, t0, 1.e6*vap_wtime() - (t0), -1)
+#else
+#define FLA_TRACE_SPAN_START(t0)
+#define FLA_TRACE_SPAN_STOP(name, t0)
+#endif // FLA_TRACE
+
+// Called at the beginning of every iteration: closes the trace of the DPM
+// pass of the previous iteration.
+DEFINE_ADJUST(fla_trace_adjust, d)
+{
+#if defined(FLA_TRACE) && !RP_HOST
+    fla_trace_flush_iteration();
+#endif
+}
+
+DEFINE_EXECUTE_ON_LOADING(fla_trace_on_loading, libname)
+{
+#if defined(FLA_TRACE) && !RP_HOST
+    double t0 = 1.e6*vap_wtime();
+    fla_trace_file();
+    fla_trace_span("library_load", 0, t0, 1.e6*vap_wtime() - t0, -1);
+#endif
+}
+
+DEFINE_EXECUTE_AT_EXIT(fla_trace_at_exit)
+{
+#if defined(FLA_TRACE) && !RP_HOST
+    fla_trace_flush_iteration();
+    if (fla_trace.f != NULL) {
+        fclose(fla_trace.f);
+        fla_trace.f = NULL;
+    }
+    vap_registry_free(&fla_trace_threads);
+#endif
+}
+
+// Joins the per-node traces into one fla-trace.json (node 0 in parallel).
+DEFINE_ON_DEMAND(fla_trace_merge)
+{
+#if defined(FLA_TRACE) && !RP_HOST
+    fla_trace_flush_iteration();
+    if (fla_trace.f != NULL) {
+        fflush(fla_trace.f);
+    }
+#if RP_NODE
+    PRF_GSYNC();
+    if (!I_AM_NODE_ZERO_P) {
+        return;
+    }
+    int n_files = compute_node_count;
+#else
+    int n_files = 1;
+#endif
+    FILE *out = fopen("fla-trace.json", "w");
+    if (out == NULL) {
+        Message("ALARM!!! Cannot open fla-trace.json\n");
+        return;
+    }
+    fprintf(out, "[\n");
+    int first = 1;
+    for (int i = 0; i < n_files; i++) {
+        char name[64];
+#if RP_NODE
+        sprintf(name, "fla-trace-%d.json", i);
+#else
+        sprintf(name, "fla-trace-%d.json", myid);
+#endif
+        FILE *in = fopen(name, "r");
+        if (in == NULL) {
+            continue;
+        }
+        char line[1024];
+        while (fgets(line, sizeof(line), in) != NULL) {
+            size_t n = strlen(line);
+            // drop the opening bracket and the trailing comma of every event
+            while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r' || line[n - 1] == ',')) {
+                line[--n] = '\0';
+            }
+            if (n == 0 || strcmp(line, "[") == 0) {
+                continue;
+            }
+            fprintf(out, "%s%s", first ? "" : ",\n", line);
+            first = 0;
+        }
+        fclose(in);
+    }
+    fprintf(out, "\n]\n");
+    fclose(out);
+    Message("FLA trace written to fla-trace.json\n");
+#endif
+}
+// END FLA trace
+
+// BEGIN FLA balance
+// Load of every compute node in the DPM pass: parcels, particle steps and the
+// time in the heat-mass and FLA kernels. fla_balance_adjust collects the
+// values of all nodes with one PRF_GRSUM of FLA_BALANCE_N values per node,
+// and the host prints them with the max/mean ratio of each column. Equal
+// ratios of steps and time point to the partitioning, a larger ratio of the
+// time per step to the kernels. A parcel is a run of steps of one P_ID on a
+// tracking thread, so a parcel that leaves the partition (or changes the
+// thread) and comes back counts twice. Every thread counts into its own
+// values, which fla_balance_adjust sums; the times are thus summed over the
+// threads of a node.
+#define FLA_BALANCE_PARCELS 0
+#define FLA_BALANCE_STEPS   1
+#define FLA_BALANCE_TIME    2 // heat-mass and FLA time, s, in the order of FLA_TRACE_HEAT_MASS, FLA_TRACE_FLA
+#define FLA_BALANCE_N       (2 + FLA_TRACE_N_KERNELS)
+
+#ifdef FLA_BALANCE
+typedef struct fla_balance_s {
+    real v[FLA_BALANCE_N];
+    int last_id;
+} fla_balance_t;
+
+static vap_registry_t fla_balance_threads;
+static VAP_THREAD_LOCAL fla_balance_t *fla_balance_mine = NULL;
+
+// The values of the calling thread, NULL if they cannot be allocated.
+static fla_balance_t *fla_balance_get(void)
+{
+    if (fla_balance_mine == NULL) {
+        fla_balance_mine = vap_registry_new(&fla_balance_threads, sizeof(fla_balance_t));
+        if (fla_balance_mine != NULL) {
+            fla_balance_mine->last_id = -1;
+        }
+    }
+    return fla_balance_mine;
+}
+
+// Accounts one particle step of p.
+void fla_balance_record(Tracked_Particle *p)
+{
+    fla_balance_t *b = fla_balance_get();
+    if (b == NULL) {
+        return;
+    }
+    if (P_ID(p) != b->last_id) {
+        b->v[FLA_BALANCE_PARCELS] += 1.0;
+        b->last_id = P_ID(p);
+    }
+    b->v[FLA_BALANCE_STEPS] += 1.0;
+}
+#endif // FLA_BALANCE
+
+#if defined(FLA_TRACE) || defined(FLA_BALANCE)
+// Accounts one call of kernel k that started at t0.
+void fla_kernel_done(int k, double t0)
+{
+    double t1 = 1.e6*vap_wtime();
+#ifdef FLA_TRACE
+    fla_trace_kernel(k, t0, t1);
+#endif
+#ifdef FLA_BALANCE
+    fla_balance_t *b = fla_balance_get();
+    if (b != NULL) {
+        b->v[FLA_BALANCE_TIME + k] += 1.e-6*(t1 - t0);
+    }
+#endif
+}
+
+#define FLA_TRACE_START(t0)   double t0 = 1.e6*vap_wtime()
+#define FLA_TRACE_STOP(k, t0) fla_kernel_done(k, t0)
+#else
+#define FLA_TRACE_START(t0)
+#define FLA_TRACE_STOP(k, t0)
+#endif
+
+#ifdef FLA_BALANCE
+// Prints the load of n_nodes nodes, FLA_BALANCE_N values each in v.
+static void fla_balance_print(const real v[], int n_nodes)
+{
+    static const char *name[FLA_BALANCE_N] = { "parcels", "steps", "heat-mass [s]", "FLA [s]" };
+    real max[FLA_BALANCE_N + 1], sum[FLA_BALANCE_N + 1];
+    for (int k = 0; k <= FLA_BALANCE_N; k++) {
+        max[k] = sum[k] = 0.0;
+    }
+    Message("FLA balance, iteration %d:\n%8s", N_ITER, "rank");
+    for (int k = 0; k < FLA_BALANCE_N; k++) {
+        Message(" %14s", name[k]);
+    }
+    Message(" %14s\n", "us/step");
+    for (int i = 0; i < n_nodes; i++) {
+        const real *r = &v[FLA_BALANCE_N*i];
+        real t = 0.0;
+        Message("%8d", i);
+        for (int k = 0; k < FLA_BALANCE_N; k++) {
+            Message(" %14.6g", r[k]);
+            max[k] = MAX(max[k], r[k]);
+            sum[k] += r[k];
+            t += k >= FLA_BALANCE_TIME ? r[k] : 0.0;
+        }
+        // kernel time per step, the same on every node unless the kernels differ
+        real us = r[FLA_BALANCE_STEPS] > 0.0 ? 1.e6*t / r[FLA_BALANCE_STEPS] : 0.0;
+        Message(" %14.6g\n", us);
+        max[FLA_BALANCE_N] = MAX(max[FLA_BALANCE_N], us);
+        sum[FLA_BALANCE_N] += us;
+    }
+    Message("%8s", "max/mean");
+    for (int k = 0; k <= FLA_BALANCE_N; k++) {
+        Message(" %14.3f", sum[k] > 0.0 ? max[k]*n_nodes / sum[k] : 1.0);
+    }
+    Message("\n");
+}
+#endif // FLA_BALANCE
+
+// Called at the beginning of every iteration: reports the load of the DPM
+// pass of the previous iteration, if there was one.
+DEFINE_ADJUST(fla_balance_adjust, d)
+{
+#ifdef FLA_BALANCE
+    int n_nodes = 1;
+#if RP_NODE || RP_HOST
+    n_nodes = compute_node_count;
+#endif
+    int n = FLA_BALANCE_N*n_nodes;
+    real *v = calloc(2*n, sizeof(real));
+    if (v == NULL) {
+        Message("ALARM!!! FLA balance: out of memory\n");
+        return;
+    }
+#if !RP_HOST
+    int rank = 0;
+#if RP_NODE
+    rank = myid;
+#endif
+    for (int k = 0; k < VAP_REGISTRY_N(&fla_balance_threads); k++) {
+        fla_balance_t *b = fla_balance_threads.obj[k];
+        if (b == NULL) {
+            continue;
+        }
+        for (int q = 0; q < FLA_BALANCE_N; q++) {
+            v[FLA_BALANCE_N*rank + q] += b->v[q];
+        }
+        memset(b->v, 0, sizeof(b->v));
+        b->last_id = -1;
+    }
+#if RP_NODE
+    FLA_TRACE_SPAN_START(t_red);
+    PRF_GRSUM(v, n, &v[n]);
+    FLA_TRACE_SPAN_STOP("balance_reduce", t_red);
+#endif
+#endif
+    node_to_host_real(v, n);
+#if !RP_NODE
+    real steps = 0.0;
+    for (int i = 0; i < n_nodes; i++) {
+        steps += v[FLA_BALANCE_N*i + FLA_BALANCE_STEPS];
+    }
+    if (steps > 0.0) {
+        fla_balance_print(v, n_nodes);
+    }
+#endif
+    free(v);
+#endif
+}
+// END FLA balance
+
+// Picks the kernel variants for the CPU of every compute node, see VAP dispatch.
+DEFINE_EXECUTE_ON_LOADING(vap_dispatch_on_loading, libname)
+{
+#if !RP_HOST
+    vap_dispatch_init(myid);
+#endif
+}
+
+// BEGIN VAP saturation limiter
+// Cell-local implicit limit of the vapour source. The droplet model assumes
+// no vapour in the ambient gas (BM with Y_inf = 0), so in dense cells the
+// droplets of a pass can request more vapour than the cell holds. Every
+// particle step adds the requested (unlimited) source density N_P dm/dt to
+// its cell, weighted with the surface mass fraction Ys. After the pass,
+// vap_sat_adjust solves, per cell, the vapour balance over the coupling
+// interval dt_c:
+//     Y = (rho Y_0 + phi S) / (rho + phi S),   phi = 1 - Y / Ys,
+// with S = sigma dt_c the requested vapour per volume. phi is the fraction
+// of the request the cell takes. In the next pass the droplets evaporate
+// phi times their rate inside the kernel (vap_env_t vap_limit), so the
+// droplet mass, its latent heat and the gas source stay consistent. dt_c is
+// the flow time step in unsteady runs; in steady ones it is the flow-through
+// time V^(1/ND_ND) / |u| of the cell (for axisymmetric cells, of the volume
+// per radian).
+// UDMs from VAP_SAT_UDM: 1 - phi (0, no limit, when initialised), sum of
+// N_P dm/dt dt, of N_P dm/dt dt Ys and of dt over the steps of the pass.
+// The threads of a node sum their steps in FLA cell accumulators of their
+// own (slots VAP_SAT_M..VAP_SAT_DT); vap_sat_adjust adds them to the UDMs.
+#define VAP_SAT_MIN (1.e-3) // smallest phi, so the requested rate can be recovered
+#define VAP_SAT_M   (0)     // accumulator slots: N_P dm/dt dt
+#define VAP_SAT_MYS (1)     // N_P dm/dt dt Ys
+#define VAP_SAT_DT  (2)     // dt
+
+static struct {
+    int ok;         // the UDMs are there, set by vap_sat_adjust
+} vap_sat = { 0 };
+
+typedef struct vap_sat_thread_s {
+    fla_acc_t acc;  // requests of the thread's steps per cell
+    int gas_index;  // vapour species
+    long steps;     // recorded since the last vap_sat_adjust
+} vap_sat_thread_t;
+
+static vap_registry_t vap_sat_threads;
+static VAP_THREAD_LOCAL vap_sat_thread_t *vap_sat_mine = NULL;
+
+// phi of a cell with gas density rho and vapour mass fraction Y0 given S of
+// requested vapour per volume, when the evaporation falls linearly to zero as
+// the cell approaches the surface mass fraction Ys: the root in [0, 1] of
+// Ys S phi^2 + (Ys rho + (1 - Ys) S) phi + (Y0 - Ys) rho = 0.
+real vap_sat_factor(real rho, real Y0, real Ys, real S)
+{
+    if (!(Ys > Y0)) {
+        return 0.0;
+    }
+    real a = Ys*S;
+    real b = Ys*rho + (1.0 - Ys)*S;
+    real c = (Y0 - Ys)*rho;
+    return MIN(1.0, -2.0*c / (b + sqrt(b*b - 4.0*a*c)));
+}
+
+// phi of the particle's cell, 1 without the limiter.
+real vap_sat_limit(Tracked_Particle *p)
+{
+#ifdef VAP_SAT_LIMIT
+    if (vap_sat.ok) {
+        return MAX(1.0 - C_UDMI(P_CELL(p), P_CELL_THREAD(p), VAP_SAT_UDM), VAP_SAT_MIN);
+    }
+#endif
+    return 1.0;
+}
+
+#ifdef VAP_SAT_LIMIT
+// Adds the requested source of the particle step to its cell.
+void vap_sat_record(Tracked_Particle *p, cell_t c, Thread *t)
+{
+    if (!vap_sat.ok) {
+        return;
+    }
+    if (vap_sat_mine == NULL) {
+        vap_sat_mine = vap_registry_new(&vap_sat_threads, sizeof(vap_sat_thread_t));
+        if (vap_sat_mine == NULL) {
+            return;
+        }
+        vap_sat_mine->gas_index = -1;
+    }
+    real *v = fla_acc_cell(&vap_sat_mine->acc, FLA_ACC_KEY(c, t));
+    if (v == NULL) {
+        return;
+    }
+    real phi = MAX(1.0 - C_UDMI(c, t, VAP_SAT_UDM), VAP_SAT_MIN);
+    real m = N_P(p)*P_VAP_dmdt(p) / phi*P_DT(p);
+    v[VAP_SAT_M] += m;
+    v[VAP_SAT_MYS] += m*P_USER_REAL(p, VAP_I_YS_TOT);
+    v[VAP_SAT_DT] += P_DT(p);
+    vap_sat_mine->gas_index = TP_COMPONENT_INDEX_I(p, 0);
+    vap_sat_mine->steps++;
+}
+#endif
+
+// After a DPM pass, sets phi of every cell for the next one from the
+// requests of the pass and clears them. Logs the limited cells.
+DEFINE_ADJUST(vap_sat_adjust, d)
+{
+#if defined(VAP_SAT_LIMIT) && !RP_HOST
+    if (N_UDM < VAP_SAT_UDM + 4) {
+        Message("ALARM!!! VAP_SAT_LIMIT needs %d UDMs\n", VAP_SAT_UDM + 4);
+        vap_sat.ok = 0;
+        return;
+    }
+    vap_sat.ok = 1;
+    // the requests of the threads into the UDMs, zeroed by the last call
+    int steps = 0;
+    int gi = -1;
+    for (int k = 0; k < VAP_REGISTRY_N(&vap_sat_threads); k++) {
+        vap_sat_thread_t *st = vap_sat_threads.obj[k];
+        if (st == NULL) {
+            continue;
+        }
+        const fla_acc_t *a = &st->acc;
+        for (int q = 0; q < a->n; q++) {
+            int s = a->touched[q];
+            Thread *t = Lookup_Thread(d, (int)(a->key[s] >> 32));
+            cell_t c = (cell_t)(a->key[s] & 0xffffffff);
+            const real *v = &a->v[FLA_ACC_N*s];
+            C_UDMI(c, t, VAP_SAT_UDM + 1) += v[VAP_SAT_M];
+            C_UDMI(c, t, VAP_SAT_UDM + 2) += v[VAP_SAT_MYS];
+            C_UDMI(c, t, VAP_SAT_UDM + 3) += v[VAP_SAT_DT];
+        }
+        fla_acc_clear(&st->acc);
+        steps = steps || st->steps > 0;
+        gi = MAX(gi, st->gas_index);
+        st->steps = 0;
+    }
+    int log = 1;
+#if RP_NODE
+    FLA_TRACE_SPAN_START(t_red);
+    steps = PRF_GISUM1(steps);
+    gi = PRF_GIHIGH1(gi);
+    FLA_TRACE_SPAN_STOP("sat_reduce", t_red);
+    log = I_AM_NODE_ZERO_P;
+#endif
+    if (steps == 0 || gi < 0) {
+        return;
+    }
+    Thread *t;
+    cell_t c;
+    int limited = 0;
+    real phi_min = 1.0;
+    thread_loop_c(t, d) {
+        if (FLUID_THREAD_P(t)) {
+            begin_c_loop_int(c, t) {
+                real m = C_UDMI(c, t, VAP_SAT_UDM + 1);
+                real tau = C_UDMI(c, t, VAP_SAT_UDM + 3);
+                real phi = 1.0;
+                if (m > 0.0 && tau > 0.0) {
+                    real U = sqrt(C_U(c, t)*C_U(c, t) + C_V(c, t)*C_V(c, t));
+                    real dt_c = rp_unsteady ? CURRENT_TIMESTEP : pow(C_VOLUME(c, t), 1.0 / ND_ND) / MAX(U, 1.e-3);
+                    real Ys = C_UDMI(c, t, VAP_SAT_UDM + 2) / m;
+                    phi = MAX(vap_sat_factor(C_R(c, t), C_YI(c, t, gi), Ys, m / tau*dt_c), VAP_SAT_MIN);
+                    limited += phi < 1.0;
+                    phi_min = MIN(phi_min, phi);
+                }
+                C_UDMI(c, t, VAP_SAT_UDM) = 1.0 - phi;
+                C_UDMI(c, t, VAP_SAT_UDM + 1) = 0.0;
+                C_UDMI(c, t, VAP_SAT_UDM + 2) = 0.0;
+                C_UDMI(c, t, VAP_SAT_UDM + 3) = 0.0;
+            } end_c_loop_int(c, t)
+        }
+    }
+#if RP_NODE
+    FLA_TRACE_SPAN_START(t_red_log);
+    limited = PRF_GISUM1(limited);
+    phi_min = PRF_GRLOW1(phi_min);
+    FLA_TRACE_SPAN_STOP("sat_reduce", t_red_log);
+#endif
+    if (log) {
+        Message("VAP saturation limiter: %d cells limited, smallest fraction of the requested vapour %.3g\n",
+                limited, phi_min);
+    }
+#endif
+}
+
+// Frees the request tables of the threads before the library is unloaded.
+DEFINE_EXECUTE_AT_EXIT(vap_sat_at_exit)
+{
+#if defined(VAP_SAT_LIMIT) && !RP_HOST
+    for (int k = 0; k < VAP_REGISTRY_N(&vap_sat_threads); k++) {
+        vap_sat_thread_t *st = vap_sat_threads.obj[k];
+        if (st != NULL) {
+            fla_acc_free(&st->acc);
+        }
+    }
+    vap_registry_free(&vap_sat_threads);
+#endif
+}
+// END VAP saturation limiter
+
+// Gas state of the particle's cell from the cphase cache, see vap_env_t.
+void vap_fluent_env(Tracked_Particle *p, int gas_index, const vap_state_t *s, vap_env_t *g)
+{
+    cphase_state_t *c = p->cphase;  /* continuous phase struct, caching variables of the cell */
+    Material *cond_mix = P_MATERIAL(p);
+    Material *cond_c = MIXTURE_COMPONENT(cond_mix, 0);
+    g->temp = c->temp;
+    g->pressure = c->pressure;
+    g->mu = c->mu;
+    g->tCond = c->tCond;
+    g->sHeat = c->sHeat;
+    g->rel_vel = sqrt((c->V[0] - P_VEL(p)[0])*(c->V[0] - P_VEL(p)[0]) + (c->V[1] - P_VEL(p)[1])*(c->V[1] - P_VEL(p)[1]) + (c->V[2] - P_VEL(p)[2])*(c->V[2] - P_VEL(p)[2]));
+    g->Re = p->Re;
+    g->mw_vap = solver_par.molWeight[gas_index];
+    g->D = DPM_BINARY_DIFFUSIVITY(p, cond_c, s->T[N_INT]);
+    g->vap_limit = vap_sat_limit(p);
+}
+
+// Hands the result of a heat-mass step back to Fluent: r are the rates of the
+// droplet itself (mass equation, time step limits), src the rates deposited
+// in the gas phase. They differ only in multivap_control_variate.
+void vap_fluent_apply(Tracked_Particle *p, int gas_index, const vap_state_t *s, const vap_rates_t *r,
+                      const vap_rates_t *src, real *dydt, dpms_t *dzdt)
+{
+    cphase_state_t *c = p->cphase;
+    real Dp = P_DIAM(p);
+    real Tp = s->T[N_INT];
+    real T_av = s->T_av;
+
+    //-------------------------------------------------------------------------
+    // update Fluent variables using our values
+    p->state.temp = T_av;
+    //p->source.htc = Nu*kgas*P_DIAM(p);
+    p->source.htc = 0.e-15;  // htc - heat transfer coefficient
+    
+    // evaporation rates - source terms, droplet mass
+    real vap_rate = r->vap_rate;
+    // ANSYS stuff
+    if ((!p->in_rk) && (ABS(vap_rate)>0.)) {
+        p->limiting_time = MIN(p->limiting_time, dpm_par.fractional_change_factor_mass*P_MASS(p) / vap_rate*TP_COMPONENT_I(p, 0));
+    }
+    dydt[1] -= vap_rate;
+    {
+        int source_index = injection_par.yi2s[gas_index];
+        if (source_index >= 0) {
+            dzdt->species[source_index] += src->vap_rate;
+            //p->source.mtc[source_index] = c->rho * Ap * Sh_Star * D / Dp;
+            p->source.mtc[source_index] = c->rho * PI * Dp * r->Sh_Star * s->D;
+        }
+    }
+    
+    // Keep particle temperature independent form Fluent's source term.
+    // source terms for energy equations: zero, as Temperature is calculated explicitly
+    dydt[0] = 0.e-15;
+
+    dzdt->energy -= src->dh_dt;
+
+    //-------------------------------------------------------------------------
+    // ANSYS stuff
+    real h = s->h;
+    real mp = P_MASS(p);
+    real convective_heating_rate = h * DPM_AREA(Dp) / (mp * p->Cp);
+
+    /* limit for higher heating rate */
+    if ((!p->in_rk) && (ABS(convective_heating_rate)>DPM_SMALL)) {
+            real factor = dpm_par.fractional_change_factor_heat;
+            if (ABS(c->temp - Tp)>Tp) {
+                factor = dpm_par.fractional_change_factor_heat*Tp / (c->temp - Tp);
+            }
+            p->limiting_time = MIN(p->limiting_time, factor / ABS(convective_heating_rate));
+    }
+    
+    //-------------------------------------------------------------------------
+    // update user reals
+    vap_update_user_real(s, p);
+    
+    P_VAP_dhdt(p) = src->dh_dt;
+    // FIXME under assumpmtion of mono-component droplet
+    P_VAP_dmdt(p) = src->vap_rate;
+}
+
+// Pseudo-random draw with probability fraction from a particle id and a salt.
+int vap_draw(int id, int salt, real fraction)
+{
+    unsigned int k = (unsigned int)id*2654435761u ^ (unsigned int)salt*40503u;
+    k ^= k >> 16;
+    k *= 0x45d9f3bu;
+    k ^= k >> 16;
+    return (real)(k & 0xffffff) < fraction*16777216.0;
+}
+
+// 1 if the particle belongs to the control-variate sample. The draw hashes
+// the particle id only, so a parcel stays in or out of the sample for its
+// whole lifetime, independently of its state (which keeps the correction
+// unbiased), and the same on every node.
+int vap_cv_sampled(Tracked_Particle *p)
+{
+    return vap_draw(P_ID(p), 0, CV_FRACTION);
+}
+
+// Auto-tuner sample of the particle step in the calibration phase, see VAP tune.
+void vap_tune_draw_sample(Tracked_Particle *p, const vap_state_t *s, const vap_env_t *g)
+{
+#ifdef VAP_TUNE
+    if (!vap_tune.done && !p->in_rk && vap_draw(P_ID(p), 7919 + N_ITER, VAP_TUNE_FRACTION)) {
+        vap_tune_sample(s, g, P_DIAM(p), P_RHO(p), P_DT(p));
+    }
+#endif
+}
+
+// Ends the calibration phase after VAP_TUNE_ITERS iterations (or later, once
+// particle steps have been sampled) with the same vap_res on every node.
+DEFINE_ADJUST(vap_tune_adjust, d)
+{
+#if defined(VAP_TUNE) && !RP_HOST
+    if (vap_tune.done || N_ITER < VAP_TUNE_ITERS) {
+        return;
+    }
+    vap_tune_t t;
+    vap_tune_combine(&t);
+    int log = 1;
+#if RP_NODE
+    real work[VAP_TUNE_N_LAMBDA];
+    FLA_TRACE_SPAN_START(t_red);
+    PRF_GRHIGH(t.err_lambda, VAP_TUNE_N_LAMBDA, work);
+    PRF_GRHIGH(t.err_stride, VAP_TUNE_N_STRIDE, work);
+    t.samples = PRF_GISUM1(t.samples);
+    FLA_TRACE_SPAN_STOP("tune_reduce", t_red);
+    log = I_AM_NODE_ZERO_P;
+#endif
+    if (t.samples == 0) {
+        return;
+    }
+    vap_tune = t;
+    vap_tune_select(log);
+#endif
+}
+
+// Fluent implementation of the host adapter, p is the Tracked_Particle. The
+// sources go to the dydt and dzdt of the DEFINE_DPM_HEAT_MASS call; the FLA
+// callbacks do not use them. The gas callback also offers the step to the
+// auto-tuner.
+typedef struct vap_fluent_host_s {
+    int gas_index;
+    real *dydt;
+    dpms_t *dzdt;
+} vap_fluent_host_t;
+
+static int vap_fluent_particle(void *ctx, void *p, vap_particle_t *q)
+{
+    (void)ctx;
+    Tracked_Particle *tp = p;
+    q->Dp = P_DIAM(tp);
+    q->rho = P_RHO(tp);
+    // Use the same Runge-Kutta time step as Fluent.
+    q->dt = P_DT(tp);
+    // Here we make sure, that we are using the same drag law, that is used by Fluent. 
+    // See DEFINE_DPM_DRAG in the manual.
+    q->tau = P_RHO(tp) * P_DIAM(tp) * P_DIAM(tp) / (tp->cphase->mu * DragCoeff(tp));
+    return 0;
+}
+
+static int vap_fluent_read_state(void *ctx, void *p, vap_state_t *s)
+{
+    (void)ctx;
+    return vap_read_user_real(s, p);
+}
+
+static int vap_fluent_gas(void *ctx, void *p, const vap_state_t *s, vap_env_t *g)
+{
+    vap_fluent_env(p, ((vap_fluent_host_t *)ctx)->gas_index, s, g);
+    vap_tune_draw_sample(p, s, g);
+    return 0;
+}
+
+static int vap_fluent_host_apply(void *ctx, void *p, const vap_state_t *s, const vap_rates_t *r)
+{
+    vap_fluent_host_t *f = ctx;
+    vap_fluent_apply(p, f->gas_index, s, r, r, f->dydt, f->dzdt);
+    return 0;
+}
+
+static int vap_fluent_read_fla(void *ctx, void *p, real y[])
+{
+    (void)ctx;
+    return fla_read_user_real(y, p);
+}
+
+static int vap_fluent_write_fla(void *ctx, void *p, const real y[])
+{
+    (void)ctx;
+    return fla_update_user_real(y, p);
+}
+
+static int vap_fluent_flow(void *ctx, void *p, real grad[], real turb[2])
+{
+    (void)ctx;
+    Tracked_Particle *tp = p;
+    cell_t c = P_CELL(tp);
+    Thread *t = P_CELL_THREAD(tp);
+    fla_read_gradients(grad, c, t);
+#ifdef FLA_TURB
+    turb[0] = C_K(c,t);
+    turb[1] = C_D(c,t);
+#else
+    (void)turb;
+#endif
+    return 0;
+}
+
+vap_host_t vap_fluent_host(vap_fluent_host_t *f)
+{
+    vap_host_t h = { f, vap_fluent_particle, vap_fluent_read_state, vap_fluent_gas, vap_fluent_host_apply,
+                     vap_fluent_read_fla, vap_fluent_write_fla, vap_fluent_flow };
+    return h;
+}
+
+/* convection diffusion controlled vaporisation model as implemented into Fluent
+   p    ... tracked particle struct
+   Cp   ... particle heat capacity
+   hgas ... enthalpy of formation for gas species
+   hvap ... vaporization enthalpy
+   cvap_surf ... molar concentration of vapor at surface
+   Z    ... compressibility factor
+   dydt ... temperature / component mass source terms for particle 
+            dydt[0] = temperature equation, 
+            dydt[1+ns] = mass equation of particle species ns
+   dzdt ... temperature / species mass source terms for gas phase
+            dzdt->energy = convective heat transfer in Watt
+            dzdt->species[n_gas] = mass source for gas species n_gas in kg/s
+ */
+
+// 4*N_component + 7 (x_i, y_i, dm_i, Mw_i, y_tot, dm_tot, D, BM, BT, diam1, diam2) + N_INT+1 
+// for temperature distribution inside a droplet USER_REAL variables 
+// 116 for single component n-dodecane
+DEFINE_DPM_HEAT_MASS(multivap_conv_diffusion_new, p, Cp, hgas, hvap, cvap_surf, Z, dydt, dzdt)
+{
+    //-------------------------------------------------------------------------
+    /* molecular weight of gas species */
+    /* molwt_bulk is first the reciproke of the real molecular weight to avoid additional divisions */
+    real molwt_bulk = 0.;
+    int ns;
+    Thread *t0 = P_CELL_THREAD(p);
+    Material *gas_mix = THREAD_MATERIAL(DPM_THREAD(t0, p));
+	cphase_state_t *c = p->cphase;  /* continuous phase struct, caching variables of the cell */
+
+    mixture_species_loop_i(gas_mix, ns)
+    {
+        molwt_bulk += c->yi[ns] / solver_par.molWeight[ns]; /* c->yi[ns] contains mass fraction of fluid cell */
+        //P_USER_REAL(p, 3 * nc + ns) = solver_par.molWeight[ns];
+    }
+    molwt_bulk = MAX(molwt_bulk, DPM_SMALL);
+    molwt_bulk = 1. / molwt_bulk;
+    
+
+    /* when not using Runge Kutta solver, increase limiting time for the next integration step */
+    // ANSYS stuff
+    if (!p->in_rk) {
+        p->limiting_time = P_DT(p)*1.01;
+    }
+
+    int nc = TP_N_COMPONENTS(p);
+	if (nc != NCOMPONENTS) {
+        Message("ALARM!!! nc != NCOMPONENTS.");
+    }
+    /* gas species index of vaporization */
+    int gas_index = TP_COMPONENT_INDEX_I(p, 0);
+    if (gas_index < 0) {
+        return;
+    }
+    FLA_TRACE_START(trace_t0);
+    // The user-real block is staged once by the adapter and written back once
+    // at the end, see vap_host_heat_mass().
+    vap_fluent_host_t f = { gas_index, dydt, dzdt };
+    vap_host_t host = vap_fluent_host(&f);
+    vap_rates_t rates;
+    if (vap_host_heat_mass(&host, p, &rates) != 0) {
+        // logged at the 1st, 2nd, 4th, ... failure of the thread
+        static VAP_THREAD_LOCAL long failures = 0;
+        failures++;
+        if ((failures & (failures - 1)) == 0) {
+            Message("ALARM!!! multivap_conv_diffusion_new: %ld failed heat-mass steps on this thread, the last of particle %d\n",
+                    failures, P_ID(p));
+        }
+    }
+    FLA_TRACE_STOP(FLA_TRACE_HEAT_MASS, trace_t0);
+}
+
+// Multi-fidelity alternative to multivap_conv_diffusion_new (hook one of the
+// two). Every parcel is advanced with the lumped model, vap_heat_mass_lumped().
+// A fixed random fraction CV_FRACTION of the parcels (vap_cv_sampled()) is
+// advanced with the full model instead and carries a shadow lumped state next
+// to it (VAP_CV_*): temperature and mass of the same droplet had it run the
+// lumped model from its injection on, in the gas the parcel meets. These
+// parcels deposit
+//     S_lumped + (S_full - S_lumped) / CV_FRACTION
+// with S_lumped the rates of the shadow, so the vapour and heat sources
+// summed over a cell are an unbiased estimate of the full-model sources over
+// whole trajectories (a control variate with the lumped model), while the
+// series solution runs on a fraction of the parcels only. The droplet itself
+// keeps the rates of the model it was advanced with, so mass and energy
+// between droplets and gas are conserved in expectation only, not per parcel.
+// Where the full model evaporates less than the lumped one, the amplified
+// difference can turn the vapour source negative and drive the species of
+// the cell negative; it is clipped at zero, at the cost of a small bias.
+DEFINE_DPM_HEAT_MASS(multivap_control_variate, p, Cp, hgas, hvap, cvap_surf, Z, dydt, dzdt)
+{
+    if (!p->in_rk) {
+        p->limiting_time = P_DT(p)*1.01;
+    }
+    int nc = TP_N_COMPONENTS(p);
+    if (nc != NCOMPONENTS) {
+        Message("ALARM!!! nc != NCOMPONENTS.");
+    }
+    int gas_index = TP_COMPONENT_INDEX_I(p, 0);
+    if (gas_index < 0) {
+        return;
+    }
+    FLA_TRACE_START(trace_t0);
+    vap_state_t s;
+    vap_read_user_real(&s, p);
+    vap_env_t g;
+    vap_fluent_env(p, gas_index, &s, &g);
+    vap_tune_draw_sample(p, &s, &g);
+
+    real Dp = P_DIAM(p);
+    vap_rates_t rates, src;
+    if (vap_cv_sampled(p)) {
+        // the shadow starts from the droplet at its first step
+        if (P_USER_REAL(p, VAP_CV_OFFSET + VAP_CV_SET) == 0.0) {
+            P_USER_REAL(p, VAP_CV_OFFSET + VAP_CV_T) = s.T_av;
+            P_USER_REAL(p, VAP_CV_OFFSET + VAP_CV_M) = P_MASS(p);
+            P_USER_REAL(p, VAP_CV_OFFSET + VAP_CV_SET) = 1.0;
+        }
+        vap_rates_t lumped = { 0.0, 0.0, 0.0 };
+        real m_lumped = P_USER_REAL(p, VAP_CV_OFFSET + VAP_CV_M);
+        if (m_lumped > 0.0) {
+            vap_state_t s_lumped = s;
+            s_lumped.T_av = P_USER_REAL(p, VAP_CV_OFFSET + VAP_CV_T);
+            for (int j = 0; j < N_INT + 1; j++) { s_lumped.T[j] = s_lumped.T_av; }
+            real Dp_lumped = DPM_DIAM_FROM_VOL(m_lumped / P_RHO(p));
+            vap_env_t g_lumped;
+            vap_fluent_env(p, gas_index, &s_lumped, &g_lumped);
+            g_lumped.Re = g.Re*Dp_lumped / Dp;
+            vap_heat_mass_lumped(&s_lumped, &g_lumped, Dp_lumped, P_RHO(p), P_DT(p), &lumped);
+            P_USER_REAL(p, VAP_CV_OFFSET + VAP_CV_T) = s_lumped.T_av;
+            P_USER_REAL(p, VAP_CV_OFFSET + VAP_CV_M) = MAX(m_lumped - lumped.vap_rate*P_DT(p), 0.0);
+        }
+        vap_heat_mass(&s, &g, Dp, P_RHO(p), P_DT(p), &rates);
+        src = rates;
+        src.vap_rate = MAX(lumped.vap_rate + (rates.vap_rate - lumped.vap_rate) / CV_FRACTION, 0.0);
+        src.dh_dt = lumped.dh_dt + (rates.dh_dt - lumped.dh_dt) / CV_FRACTION;
+    } else {
+        vap_heat_mass_lumped(&s, &g, Dp, P_RHO(p), P_DT(p), &rates);
+        src = rates;
+    }
+    vap_fluent_apply(p, gas_index, &s, &rates, &src, dydt, dzdt);
+    FLA_TRACE_STOP(FLA_TRACE_HEAT_MASS, trace_t0);
+}
+
+// BEGIN VAP lag
+// Pending heat-mass steps of multivap_lagged. Every thread keeps a direct
+// mapped table of droplets (slot P_ID % VAP_LAG_TABLE) with the input of
+// their next step and, once the batch holding it has been evaluated, its
+// result. A droplet whose slot is taken by a queued step of another droplet
+// is simply not queued and takes its next step directly.
+#define VAP_LAG_FREE   (0)
+#define VAP_LAG_QUEUED (1)
+#define VAP_LAG_READY  (2)
+
+typedef struct vap_lag_entry_s {
+    int id;         // P_ID of the droplet
+    int status;
+    real Ts_in;     // surface and average temperature of the input state, to
+    real T_av_in;   // recognise a droplet that was re-injected with the same id
+    vap_state_t s;  // input state, the advanced one once READY
+    vap_env_t g;    // gas state the step is evaluated with
+    real Dp, rho_p, dt;
+    vap_rates_t r;
+} vap_lag_entry_t;
+
+typedef struct vap_lag_s {
+    vap_lag_entry_t *table;     // [VAP_LAG_TABLE]
+    int queue[VAP_BATCH];       // slots of the queued steps
+    int n_queued;
+    vap_batch_t batch;
+    // since the last report of vap_lag_adjust
+    long calls;                 // steps outside the Runge-Kutta tracking
+    long lagged;                // steps that used their lagged result
+    long rejected;              // lagged results redone: VAP_LAG_TOL, other dt or Dp
+    long batches;
+    long lanes;
+    real err_max;
+} vap_lag_t;
+
+static VAP_THREAD_LOCAL vap_lag_t *vap_lag = NULL;
+static vap_registry_t vap_lag_threads;  // the lag states of the node's threads, see vap_lag_adjust
+
+// Lagged steps are off for the iteration after one in which most were
+// rejected, see vap_lag_adjust.
+int vap_lag_enabled = 1;
+
+// The lag state of the calling thread, NULL if it cannot be allocated.
+vap_lag_t *vap_lag_get(void)
+{
+    if (vap_lag == NULL) {
+        vap_lag_entry_t *table = calloc(VAP_LAG_TABLE, sizeof(vap_lag_entry_t));
+        vap_lag_t *L = table != NULL ? vap_registry_new(&vap_lag_threads, sizeof(vap_lag_t)) : NULL;
+        if (L == NULL) {
+            Message("ALARM!!! Out of memory for the lagged heat-mass steps, they are evaluated directly.\n");
+            free(table);
+            return NULL;
+        }
+        L->table = table;
+        vap_lag = L;
+    }
+    return vap_lag;
+}
+
+// Evaluates the queued steps in one batch.
+void vap_lag_flush(vap_lag_t *L)
+{
+    int n = L->n_queued;
+    if (n == 0) {
+        return;
+    }
+    vap_state_t *s[VAP_BATCH];
+    const vap_env_t *g[VAP_BATCH];
+    real Dp[VAP_BATCH], rho_p[VAP_BATCH], dt[VAP_BATCH];
+    vap_rates_t *r[VAP_BATCH];
+    for (int l = 0; l < n; l++) {
+        vap_lag_entry_t *e = &L->table[L->queue[l]];
+        s[l] = &e->s;
+        g[l] = &e->g;
+        Dp[l] = e->Dp;
+        rho_p[l] = e->rho_p;
+        dt[l] = e->dt;
+        r[l] = &e->r;
+    }
+    vap_heat_mass_batch(&L->batch, n, s, g, Dp, rho_p, dt, r);
+    for (int l = 0; l < n; l++) {
+        L->table[L->queue[l]].status = VAP_LAG_READY;
+    }
+    L->n_queued = 0;
+    L->batches++;
+    L->lanes += n;
+}
+
+// Relative change of the gas state between the lagged step (g_lag) and now:
+// of the temperature difference driving the heat flux and of the Reynolds number.
+real vap_lag_error(const vap_env_t *g_lag, const vap_env_t *g, real Ts)
+{
+    real e_T = ABS(g->temp - g_lag->temp) / MAX(ABS(g->temp - Ts), 1.0);
+    real e_Re = ABS(g->Re - g_lag->Re) / (1.0 + g->Re);
+    return MAX(e_T, e_Re);
+}
+
+// One-step-lagged heat and mass transfer (hook instead of
+// multivap_conv_diffusion_new). A call takes the droplet step that was queued
+// in its previous call, from the same droplet state with the gas state of
+// then, and evaluated in a batch together with the steps of other droplets
+// (vap_heat_mass_batch()); it then queues the next step with the current gas
+// state. A droplet that returns before its batch is full (steady tracking
+// follows one droplet at a time) flushes the batch early, so the batches fill
+// when droplets are advanced in turn, as in unsteady tracking.
+// The lagged step is redone directly if the gas state has changed by more
+// than VAP_LAG_TOL or if the step length or the diameter differ from the
+// queued ones. Otherwise its heat rate is corrected to the current gas
+// temperature by the linearised flux h A (T_gas - T_gas,lag) which is given
+// to the droplet as well, so the heat and the vapour passed to the gas are
+// exactly what the droplet loses. Runge-Kutta steps are evaluated directly.
+DEFINE_DPM_HEAT_MASS(multivap_lagged, p, Cp, hgas, hvap, cvap_surf, Z, dydt, dzdt)
+{
+    if (!p->in_rk) {
+        p->limiting_time = P_DT(p)*1.01;
+    }
+    int nc = TP_N_COMPONENTS(p);
+    if (nc != NCOMPONENTS) {
+        Message("ALARM!!! nc != NCOMPONENTS.");
+    }
+    int gas_index = TP_COMPONENT_INDEX_I(p, 0);
+    if (gas_index < 0) {
+        return;
+    }
+    FLA_TRACE_START(trace_t0);
+    vap_state_t s;
+    vap_read_user_real(&s, p);
+    vap_env_t g;
+    vap_fluent_env(p, gas_index, &s, &g);
+    vap_tune_draw_sample(p, &s, &g);
+
+    real Dp = P_DIAM(p);
+    vap_rates_t rates;
+    vap_lag_t *L = (p->in_rk || !vap_lag_enabled) ? NULL : vap_lag_get();
+    vap_lag_entry_t *e = NULL;
+    int lagged = 0;
+    if (L != NULL) {
+        L->calls++;
+        e = &L->table[(unsigned int)P_ID(p) % VAP_LAG_TABLE];
+        if (e->id == P_ID(p) && e->status != VAP_LAG_FREE) {
+            if (e->status == VAP_LAG_QUEUED) {
+                vap_lag_flush(L);
+            }
+            if (e->Ts_in == s.T[N_INT] && e->T_av_in == s.T_av) {
+                // a step of another length or from another diameter (the
+                // tracking shortened the step, the diameter was reset) is redone
+                int same_step = e->dt == P_DT(p) && e->Dp == Dp;
+                real err = same_step ? vap_lag_error(&e->g, &g, s.T[N_INT]) : 0.0;
+                L->err_max = MAX(L->err_max, err);
+                if (same_step && err <= VAP_LAG_TOL) {
+                    real q = e->s.h*DPM_AREA(e->Dp)*(g.temp - e->g.temp);
+                    real dT = q*P_DT(p) / (P_MASS(p)*get_liquid_c_p(e->s.T_av));
+                    s = e->s;
+                    for (int j = 0; j < N_INT + 1; j++) { s.T[j] += dT; }
+                    s.T_av += dT;
+                    rates = e->r;
+                    rates.dh_dt += q;
+                    lagged = 1;
+                    L->lagged++;
+                } else {
+                    L->rejected++;
+                }
+            }
+            e->status = VAP_LAG_FREE;
+        }
+    }
+    if (!lagged) {
+        vap_heat_mass(&s, &g, Dp, P_RHO(p), P_DT(p), &rates);
+    }
+    vap_fluent_apply(p, gas_index, &s, &rates, &rates, dydt, dzdt);
+
+    // queue the next step from the new state with the current gas state
+    if (e != NULL && e->status != VAP_LAG_QUEUED) {
+        e->id = P_ID(p);
+        e->status = VAP_LAG_QUEUED;
+        e->Ts_in = s.T[N_INT];
+        e->T_av_in = s.T_av;
+        e->s = s;
+        e->g = g;
+        e->Dp = Dp;
+        e->rho_p = P_RHO(p);
+        e->dt = P_DT(p);
+        L->queue[L->n_queued++] = (int)(e - L->table);
+        if (L->n_queued == VAP_BATCH) {
+            vap_lag_flush(L);
+        }
+    }
+    FLA_TRACE_STOP(FLA_TRACE_HEAT_MASS, trace_t0);
+}
+
+// Reports the lagged steps of the last iteration, summed over the threads and
+// nodes, and switches the lag off for the next one if most lagged results had
+// to be redone (fast transients). Every node takes part in the reductions,
+// also one without lag states yet.
+DEFINE_ADJUST(vap_lag_adjust, d)
+{
+#if !RP_HOST
+    real n[5] = { 0.0, 0.0, 0.0, 0.0, 0.0 };
+    real err_max = 0.0;
+    for (int k = 0; k < VAP_REGISTRY_N(&vap_lag_threads); k++) {
+        vap_lag_t *L = vap_lag_threads.obj[k];
+        if (L == NULL) {
+            continue;
+        }
+        n[0] += L->calls; n[1] += L->lagged; n[2] += L->rejected; n[3] += L->batches; n[4] += L->lanes;
+        err_max = MAX(err_max, L->err_max);
+        L->calls = L->lagged = L->rejected = L->batches = L->lanes = 0;
+        L->err_max = 0.0;
+    }
+    int log = 1;
+#if RP_NODE
+    real work[5];
+    FLA_TRACE_SPAN_START(t_red);
+    PRF_GRSUM(n, 5, work);
+    err_max = PRF_GRHIGH1(err_max);
+    FLA_TRACE_SPAN_STOP("lag_reduce", t_red);
+    log = I_AM_NODE_ZERO_P;
+#endif
+    if (n[0] > 0.0 && log) {
+        Message("VAP lag: %.0f steps, %.1f%% lagged, %.1f%% redone (max gas change %.3g), %.1f droplets per batch\n",
+                n[0], 100.0*n[1] / n[0], 100.0*n[2] / n[0], err_max, n[4] / MAX(n[3], 1.0));
+    }
+    vap_lag_enabled = !(n[2] > n[1]);
+#ifdef VAP_OPERATOR
+    real o[3] = { 0.0, 0.0, 0.0 };
+    for (int k = 0; k < VAP_REGISTRY_N(&vap_op_threads); k++) {
+        vap_op_cache_t *oc = vap_op_threads.obj[k];
+        if (oc == NULL) {
+            continue;
+        }
+        o[0] += oc->lanes; o[1] += oc->direct; o[2] += oc->built;
+        oc->lanes = oc->direct = oc->built = 0;
+    }
+#if RP_NODE
+    real work_o[3];
+    FLA_TRACE_SPAN_START(t_red_o);
+    PRF_GRSUM(o, 3, work_o);
+    FLA_TRACE_SPAN_STOP("lag_reduce", t_red_o);
+#endif
+    if (o[0] + o[1] > 0.0 && log) {
+        Message("VAP operators: %.1f%% of the batched updates, %.0f built\n", 100.0*o[0] / (o[0] + o[1]), o[2]);
+    }
+#endif
+#endif
+}
+
+// Frees the lag tables and the operator caches of all threads before the
+// library is unloaded.
+DEFINE_EXECUTE_AT_EXIT(vap_lag_at_exit)
+{
+#if !RP_HOST
+    for (int k = 0; k < VAP_REGISTRY_N(&vap_lag_threads); k++) {
+        vap_lag_t *L = vap_lag_threads.obj[k];
+        if (L != NULL) {
+            free(L->table);
+        }
+    }
+    vap_registry_free(&vap_lag_threads);
+#ifdef VAP_OPERATOR
+    vap_registry_free(&vap_op_threads);
+#endif
+#endif
+}
+// END VAP lag
+
+// BEGIN VAP DPM interval
+// Adaptive DPM update interval of coupled steady runs, see vap_dpm_adjust.
+// The scalar update accumulates the droplet sources deposited in a DPM pass
+// (N_P weighted heat and vapour, as P_VAP_dhdt_scaled) and the FLA number
+// density along the trajectories. After each pass the gas temperature and
+// speed of the cells are kept, to measure how far the gas has drifted since.
+// Every thread accumulates into its own sums, which vap_dpm_adjust adds up.
+typedef struct vap_dpm_sums_s {
+    long steps;         // particle steps of the current pass
+    real src[3];        // heat, vapour, N_P, integrated over the steps
+} vap_dpm_sums_t;
+
+typedef struct vap_dpm_s {
+    real src_last[3];   // src of the previous pass
+    real change;        // relative change of src between the last two passes
+    int passes;
+    int since;          // iterations since the last pass
+    int n_cells;        // cells of the snapshot
+    real *T, *U;        // gas state after the last pass
+} vap_dpm_t;
+
+vap_dpm_t vap_dpm = { { 0.0 }, 1.0, 0, 0, 0, NULL, NULL };
+static vap_registry_t vap_dpm_threads;
+static VAP_THREAD_LOCAL vap_dpm_sums_t *vap_dpm_mine = NULL;
+
+// Accounts a particle step of the DPM pass, called by Diesel_droplet.
+void vap_dpm_accumulate(Tracked_Particle *p)
+{
+    if (vap_dpm_mine == NULL) {
+        vap_dpm_mine = vap_registry_new(&vap_dpm_threads, sizeof(vap_dpm_sums_t));
+        if (vap_dpm_mine == NULL) {
+            return;
+        }
+    }
+    vap_dpm_sums_t *a = vap_dpm_mine;
+    a->steps++;
+    a->src[0] += P_VAP_dhdt_scaled(p)*P_DT(p);
+    a->src[1] += P_VAP_dmdt_scaled(p)*P_DT(p);
+    a->src[2] += N_P(p)*P_DT(p);
+}
+
+// Number of interior cells of the fluid zones of this node.
+static int vap_dpm_cell_count(Domain *d)
+{
+    Thread *t;
+    cell_t c;
+    int n = 0;
+    thread_loop_c(t, d) {
+        if (FLUID_THREAD_P(t)) {
+            begin_c_loop_int(c, t) {
+                n++;
+            } end_c_loop_int(c, t)
+        }
+    }
+    return n;
+}
+
+// RMS change of the gas temperature and speed since the snapshot, relative
+// to their ranges over the domain, in drift[0] and drift[1]. With snap != 0
+// the current state becomes the snapshot. Returns -1 if there is no valid
+// snapshot.
+static int vap_dpm_drift(Domain *d, int snap, real drift[2])
+{
+    Thread *t;
+    cell_t c;
+    int n = vap_dpm_cell_count(d);
+    int valid = vap_dpm.T != NULL && n == vap_dpm.n_cells;
+    if (snap && !valid) {
+        free(vap_dpm.T);
+        free(vap_dpm.U);
+        vap_dpm.T = malloc(MAX(n, 1)*sizeof(real));
+        vap_dpm.U = malloc(MAX(n, 1)*sizeof(real));
+        vap_dpm.n_cells = n;
+        if (vap_dpm.T == NULL || vap_dpm.U == NULL) {
+            Message("ALARM!!! Out of memory in vap_dpm_adjust\n");
+            free(vap_dpm.T);
+            free(vap_dpm.U);
+            vap_dpm.T = vap_dpm.U = NULL;
+            vap_dpm.n_cells = 0;
+        }
+    }
+    // sum V, sum V dT^2, sum V dU^2, min/max of T and |u|
+    real sum[3] = { 0.0, 0.0, 0.0 };
+    real T_lo = 1.e30, T_hi = -1.e30, U_hi = 0.0;
+    int i = 0;
+    thread_loop_c(t, d) {
+        if (FLUID_THREAD_P(t)) {
+            begin_c_loop_int(c, t) {
+                real T = C_T(c, t);
+                real U = sqrt(C_U(c, t)*C_U(c, t) + C_V(c, t)*C_V(c, t));
+                real V = C_VOLUME(c, t);
+                if (valid) {
+                    sum[0] += V;
+                    sum[1] += V*(T - vap_dpm.T[i])*(T - vap_dpm.T[i]);
+                    sum[2] += V*(U - vap_dpm.U[i])*(U - vap_dpm.U[i]);
+                }
+                if (snap && vap_dpm.T != NULL) {
+                    vap_dpm.T[i] = T;
+                    vap_dpm.U[i] = U;
+                }
+                T_lo = MIN(T_lo, T);
+                T_hi = MAX(T_hi, T);
+                U_hi = MAX(U_hi, U);
+                i++;
+            } end_c_loop_int(c, t)
+        }
+    }
+#if RP_NODE
+    real work[3];
+    FLA_TRACE_SPAN_START(t_red);
+    PRF_GRSUM(sum, 3, work);
+    T_lo = PRF_GRLOW1(T_lo);
+    T_hi = PRF_GRHIGH1(T_hi);
+    U_hi = PRF_GRHIGH1(U_hi);
+    valid = PRF_GISUM1(!valid) == 0;
+    FLA_TRACE_SPAN_STOP("dpm_reduce", t_red);
+#endif
+    if (!valid || sum[0] <= 0.0) {
+        return -1;
+    }
+    drift[0] = sqrt(sum[1] / sum[0]) / MAX(T_hi - T_lo, 1.0);
+    drift[1] = sqrt(sum[2] / sum[0]) / MAX(U_hi, 1.e-3);
+    return 0;
+}
+
+// Requests the next DPM pass of a coupled steady run only when it matters:
+// while the droplet sources still change by more than VAP_DPM_SRC_TOL from
+// pass to pass, every VAP_DPM_MIN_INTERVAL iterations; once the spray has
+// converged, when the gas temperature or speed has drifted by more than
+// VAP_DPM_DRIFT_TOL since the last pass, or after VAP_DPM_MAX_INTERVAL
+// iterations. The request sets the DPM iteration interval (VAP_DPM_RPVAR) to
+// 1, otherwise it is held at VAP_DPM_MAX_INTERVAL. The decisions are logged.
+DEFINE_ADJUST(vap_dpm_adjust, d)
+{
+    int update = 0;
+#if !RP_HOST
+    // sums of the threads since the last call
+    real steps = 0.0;
+    real src[3] = { 0.0, 0.0, 0.0 };
+    for (int i = 0; i < VAP_REGISTRY_N(&vap_dpm_threads); i++) {
+        vap_dpm_sums_t *a = vap_dpm_threads.obj[i];
+        if (a == NULL) {
+            continue;
+        }
+        steps += a->steps;
+        for (int k = 0; k < 3; k++) {
+            src[k] += a->src[k];
+        }
+        memset(a, 0, sizeof(*a));
+    }
+    int log = 1;
+#if RP_NODE
+    FLA_TRACE_SPAN_START(t_red);
+    steps = PRF_GRSUM1(steps);
+    FLA_TRACE_SPAN_STOP("dpm_reduce", t_red);
+    log = I_AM_NODE_ZERO_P;
+#endif
+    real drift[2] = { 0.0, 0.0 };
+    if (steps > 0.0) {
+        // a DPM pass ran since the last call
+#if RP_NODE
+        real work[3];
+        FLA_TRACE_SPAN_START(t_red_src);
+        PRF_GRSUM(src, 3, work);
+        FLA_TRACE_SPAN_STOP("dpm_reduce", t_red_src);
+#endif
+        real change = 0.0;
+        for (int k = 0; k < 3; k++) {
+            change = MAX(change, ABS(src[k] - vap_dpm.src_last[k]) / MAX(ABS(vap_dpm.src_last[k]), 1.e-30));
+            vap_dpm.src_last[k] = src[k];
+        }
+        vap_dpm.change = vap_dpm.passes > 0 ? change : 1.0;
+        vap_dpm.passes++;
+        if (log) {
+            Message("VAP DPM: pass %d at iteration %d after %d iterations, %.0f particle steps, source change %.3g\n",
+                    vap_dpm.passes, N_ITER, vap_dpm.since, steps, vap_dpm.change);
+        }
+        vap_dpm.since = 0;
+        vap_dpm_drift(d, 1, drift);
+    } else {
+        vap_dpm.since++;
+        if (vap_dpm.since >= VAP_DPM_MIN_INTERVAL) {
+            if (vap_dpm.change > VAP_DPM_SRC_TOL || vap_dpm.since >= VAP_DPM_MAX_INTERVAL) {
+                update = 1;
+            } else if (vap_dpm_drift(d, 0, drift) != 0 || MAX(drift[0], drift[1]) > VAP_DPM_DRIFT_TOL) {
+                update = 1;
+            }
+        }
+        if (update && log) {
+            Message("VAP DPM: pass requested at iteration %d, %d iterations since the last, source change %.3g, drift T %.3g, |u| %.3g\n",
+                    N_ITER, vap_dpm.since, vap_dpm.change, drift[0], drift[1]);
+        }
+    }
+#endif
+    node_to_host_int_1(update);
+#if !RP_NODE
+    if (RP_Variable_Exists_P(VAP_DPM_RPVAR)) {
+        RP_Set_Integer(VAP_DPM_RPVAR, update ? 1 : VAP_DPM_MAX_INTERVAL);
+    } else {
+        Message("ALARM!!! No rpvar %s, set VAP_DPM_RPVAR for this Fluent version\n", VAP_DPM_RPVAR);
+    }
+#endif
+}
+// END VAP DPM interval
+
+// BEGIN FLA field
+// Per-cell FLA fields of the last DPM pass in the UDMs FLA_FIELD_UDM + 0..2:
+// the residence-time mean of N_P, its maximum (caustics) and the residence
+// time of the droplets. Diesel_droplet only adds N_P*dt, max N_P and dt of
+// every step to the cell of the recording buffer of its thread, which
+// fla_field_adjust combines after the pass. The reconstruction (the
+// means and the fill of up to FLA_FIELD_SWEEPS cell layers between the
+// trajectories with the mean of their neighbours) works on the buffer of the
+// finished pass on a helper thread of the node, while the gas phase iterates
+// on; fla_field_adjust publishes a reconstructed field into the UDMs in one go,
+// so the solver only ever sees complete fields. The helper never touches
+// Fluent data: the cells are numbered per node (fluid zones one after the
+// other) and their neighbours are collected beforehand. Without pthreads
+// (MSVC) the reconstruction runs in fla_field_adjust itself.
+#ifdef FLA_FIELD
+#ifndef _MSC_VER
+#include <pthread.h>
+#define FLA_FIELD_THREAD
+#endif
+#define FLA_FIELD_MAX_ZONES (64)
+
+#ifdef FLA_FIELD_INCREMENTAL
+// Incremental sums (FLA_FIELD_INCREMENTAL). Every trajectory (P_ID) keeps the
+// list of its contributions of the last pass, one entry per visit of a cell
+// (sum N_P dt, sum dt, max N_P). While it is tracked again, the new entries
+// are only compared with the old ones; the list is copied and rewritten from
+// the first entry that differs by more than FLA_FIELD_TOL. After the pass,
+// fla_traj_apply subtracts the old and adds the new list of the changed
+// trajectories only, and drops those not tracked any more. The maximum of
+// N_P cannot be taken back, so all sums are rebuilt every FLA_FIELD_REBUILD
+// passes, which also clears the rounding of the differences. Every tracking
+// thread keeps the trajectories it tracks in a table of its own; the sums are
+// those of the lists of all tables. A trajectory that another thread tracks
+// in the next pass leaves the one table and enters the other, which is
+// correct, only not incremental.
+typedef struct fla_traj_entry_s {
+    int cell;
+    float n_dt;     // sum N_P dt
+    float dt;       // sum dt
+    float n_max;    // max N_P
+} fla_traj_entry_t;
+
+typedef struct fla_traj_s {
+    int id;                 // P_ID, -1 free, -2 deleted
+    int pass;               // last pass that tracked it
+    int n, cap;             // entries of the last pass
+    fla_traj_entry_t *e;
+    // the pass being tracked
+    int cursor;             // entries of e matched so far
+    int changed;            // the entries differ from e, see e_new
+    int n_new, cap_new;
+    fla_traj_entry_t *e_new;
+    fla_traj_entry_t open;  // entry of the current cell, cell -1 if none
+} fla_traj_t;
+
+typedef struct fla_trajs_s {
+    int capacity;           // slots, a power of two
+    int used;               // live and deleted slots
+    fla_traj_t *t;
+} fla_trajs_t;
+
+static void fla_trajs_free(fla_trajs_t *tr)
+{
+    for (int i = 0; i < tr->capacity; i++) {
+        free(tr->t[i].e); free(tr->t[i].e_new);
+    }
+    free(tr->t);
+    memset(tr, 0, sizeof(*tr));
+}
+
+static int fla_trajs_probe(const fla_trajs_t *tr, int id)
+{
+    int mask = tr->capacity - 1;
+    int i = (int)(((uint32_t)id*2654435761u) >> 8) & mask;
+    int free_slot = -1;
+    while (tr->t[i].id != -1) {
+        if (tr->t[i].id == id) {
+            return i;
+        }
+        if (tr->t[i].id == -2 && free_slot < 0) {
+            free_slot = i;
+        }
+        i = (i + 1) & mask;
+    }
+    return free_slot >= 0 ? free_slot : i;
+}
+
+// Trajectory id, a new one if it is unknown; NULL if out of memory.
+static fla_traj_t *fla_trajs_get(fla_trajs_t *tr, int id)
+{
+    if (2*(tr->used + 1) > tr->capacity) {
+        // rehash the live trajectories into the double size
+        fla_trajs_t b;
+        b.capacity = MAX(2*tr->capacity, 1024);
+        b.used = 0;
+        b.t = malloc(b.capacity*sizeof(fla_traj_t));
+        if (b.t == NULL) {
+            return NULL;
+        }
+        for (int i = 0; i < b.capacity; i++) {
+            memset(&b.t[i], 0, sizeof(fla_traj_t));
+            b.t[i].id = -1;
+        }
+        for (int i = 0; i < tr->capacity; i++) {
+            if (tr->t[i].id >= 0) {
+                b.t[fla_trajs_probe(&b, tr->t[i].id)] = tr->t[i];
+                b.used++;
+            } else {
+                free(tr->t[i].e); free(tr->t[i].e_new);
+            }
+        }
+        free(tr->t);
+        *tr = b;
+    }
+    int i = fla_trajs_probe(tr, id);
+    fla_traj_t *T = &tr->t[i];
+    if (T->id != id) {
+        if (T->id == -1) {
+            tr->used++;
+        }
+        free(T->e); free(T->e_new);
+        memset(T, 0, sizeof(*T));
+        T->id = id;
+        T->pass = -1;
+        T->open.cell = -1;
+    }
+    return T;
+}
+
+static int fla_traj_push(fla_traj_t *T, const fla_traj_entry_t *x)
+{
+    if (T->n_new == T->cap_new) {
+        int cap = MAX(2*T->cap_new, 16);
+        fla_traj_entry_t *e = realloc(T->e_new, cap*sizeof(fla_traj_entry_t));
+        if (e == NULL) {
+            return -1;
+        }
+        T->e_new = e;
+        T->cap_new = cap;
+    }
+    T->e_new[T->n_new++] = *x;
+    return 0;
+}
+
+static int fla_traj_differs(float a, float b)
+{
+    return fabsf(a - b) > FLA_FIELD_TOL*MAX(fabsf(a), fabsf(b));
+}
+
+// From the first difference on, the entries of this pass go to e_new.
+static void fla_traj_diverge(fla_traj_t *T)
+{
+    T->changed = 1;
+    T->n_new = 0;
+    for (int k = 0; k < T->cursor; k++) {
+        fla_traj_push(T, &T->e[k]);
+    }
+}
+
+// Ends the entry of the current cell.
+static void fla_traj_close(fla_traj_t *T)
+{
+    if (T->open.cell < 0) {
+        return;
+    }
+    const fla_traj_entry_t *o = &T->open;
+    if (!T->changed) {
+        const fla_traj_entry_t *e = T->cursor < T->n ? &T->e[T->cursor] : NULL;
+        if (e != NULL && e->cell == o->cell && !fla_traj_differs(e->n_dt, o->n_dt) && !fla_traj_differs(e->dt, o->dt)
+            && !fla_traj_differs(e->n_max, o->n_max)) {
+            T->cursor++;
+            T->open.cell = -1;
+            return;
+        }
+        fla_traj_diverge(T);
+    }
+    fla_traj_push(T, o);
+    T->open.cell = -1;
+}
 
-    real BT = BM;
-    real BT_i = BT;
-    real dif = 1.0;
-    real coef = c_p_die * rho_gas_s * D / kgas * Sh_Star;
-    real phi = 0.e-15;
-	real FBT, Nu_star;
-    // find BT iteratively
-    while (dif > ACCURACY) {
-        FBT = pow(1.0 + BT, 0.7)*log(1.0 + BT) / BT;
-        Nu_star = 2.0 + (pow(1.0 + Re*Pr, 1.0 / 3.0)*MAX(1.0, pow(Re, 0.077)) - 1.0) / FBT;
-        phi = coef / Nu_star;
-        BT = pow(1.0 + BM, phi) - 1.0;
-        dif = abs(BT - BT_i);
-        BT_i = BT;
+// Accounts a step of trajectory id in cell i (node-local number) in pass.
+void fla_traj_step(fla_trajs_t *tr, int id, int pass, int i, real n_p, real dt)
+{
+    fla_traj_t *T = fla_trajs_get(tr, id);
+    if (T == NULL) {
+        return;
+    }
+    if (T->pass != pass) {
+        T->pass = pass;
+        T->cursor = 0;
+        T->changed = 0;
+        T->n_new = 0;
+        T->open.cell = -1;
     }
+    if (T->open.cell != i) {
+        fla_traj_close(T);
+        T->open.cell = i;
+        T->open.n_dt = T->open.dt = T->open.n_max = 0.0f;
+    }
+    T->open.n_dt += (float)(n_p*dt);
+    T->open.dt += (float)dt;
+    T->open.n_max = MAX(T->open.n_max, (float)n_p);
+}
 
-    real Nu = log(1.0 + BT) * Nu_star / BT; // Nusselt number
+// Adds (sign 1) or subtracts (sign -1) the entries e[0, n) to the sums of
+// fla_field_record; a cell whose residence time is taken back is emptied.
+static void fla_traj_add(real sums[], const fla_traj_entry_t e[], int n, int sign)
+{
+    for (int k = 0; k < n; k++) {
+        real *r = &sums[3*e[k].cell];
+        r[0] += sign*(real)e[k].n_dt;
+        r[2] += sign*(real)e[k].dt;
+        if (sign > 0) {
+            r[1] = MAX(r[1], (real)e[k].n_max);
+        } else if (r[2] < 1.e-6*e[k].dt) {
+            r[0] = r[2] = 0.0;
+        }
+    }
+}
 
-    //-------------------------------------------------------------------------
-    // Temperature distribution calculations
-    real T_av = P_USER_REAL(p, 4 * nc + 6);
-    real Visc_l = get_liquid_visc(T_av);
-    real k_l = get_liquid_k(T_av);
-    real C_pl = get_liquid_c_p(T_av);
+// Applies the trajectories of pass to the sums, all of them into zeroed sums
+// with rebuild != 0. Returns the number of trajectories whose contributions
+// were applied; *entries counts the entries.
+int fla_traj_apply(fla_trajs_t *tr, int pass, real sums[], int rebuild, long *entries)
+{
+    int changed = 0;
+    *entries = 0;
+    for (int i = 0; i < tr->capacity; i++) {
+        fla_traj_t *T = &tr->t[i];
+        if (T->id < 0) {
+            continue;
+        }
+        if (T->pass != pass) {
+            // not tracked any more
+            if (!rebuild) {
+                fla_traj_add(sums, T->e, T->n, -1);
+                *entries += T->n;
+            }
+            free(T->e); free(T->e_new);
+            memset(T, 0, sizeof(*T));
+            T->id = -2;
+            changed++;
+            continue;
+        }
+        fla_traj_close(T);
+        if (!T->changed && T->cursor != T->n) {
+            fla_traj_diverge(T); // ended earlier
+        }
+        if (T->changed) {
+            if (!rebuild) {
+                fla_traj_add(sums, T->e, T->n, -1);
+                *entries += T->n;
+            }
+            fla_traj_entry_t *e = T->e;
+            int cap = T->cap;
+            T->e = T->e_new; T->n = T->n_new; T->cap = T->cap_new;
+            T->e_new = e; T->cap_new = cap; T->n_new = 0;
+            T->changed = 0;
+            fla_traj_add(sums, T->e, T->n, 1);
+            *entries += T->n;
+            changed++;
+        } else if (rebuild) {
+            fla_traj_add(sums, T->e, T->n, 1);
+            *entries += T->n;
+        }
+    }
+    return changed;
+}
+#endif // FLA_FIELD_INCREMENTAL
 
-    real rel_vel = sqrt((c->V[0] - P_VEL(p)[0])*(c->V[0] - P_VEL(p)[0]) + (c->V[1] - P_VEL(p)[1])*(c->V[1] - P_VEL(p)[1]) + (c->V[2] - P_VEL(p)[2])*(c->V[2] - P_VEL(p)[2]));
-    real Pe = 12.69 / 16.0*P_RHO(p)*0.5*Dp* C_pl / k_l*rel_vel*c->mu / Visc_l*pow(Re, 1.0 / 3.0) / (1.0 + BM);
-    real k_eff = (1.86 + 0.86*tanh(2.225*log10(Pe / 30.0)))*k_l;  // effective thermal conductivity to take into account recirculation Abramzon B, Sirignano WA. Int J Heat Mass Transfer 1989;32:1605–18.
-    if (abs(Pe) < 1.e-12) {
-        k_eff = k_l;
+static struct {
+    // cell numbering of the node
+    int n_zones;
+    Thread *zone[FLA_FIELD_MAX_ZONES];
+    int offset[FLA_FIELD_MAX_ZONES + 1];
+    int n_cells;
+    int *adj_start;     // [n_cells + 1], neighbours of cell i in adj[adj_start[i]...]
+    int *adj;
+    // per cell: sum N_P dt, max N_P, sum dt
+    real *work;         // [3*n_cells] finished pass, read by the helper
+    real *back;         // [3*n_cells] fields being reconstructed
+    real *front;        // [3*n_cells] last reconstructed fields
+#ifdef FLA_FIELD_INCREMENTAL
+    int pass;           // running DPM pass; the sums of the threads' trajectories persist in work
+    int passes;         // passes since the layout was built
+#endif
+    int busy;           // the helper owns work and back
+    int done;           // back holds fields not published yet
+#ifdef FLA_FIELD_THREAD
+    pthread_t thread;
+    int started;        // creation of the helper was tried
+    int running;
+    int stop;
+#endif
+} fla_field;
+
+#ifdef FLA_FIELD_THREAD
+static pthread_mutex_t fla_field_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fla_field_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
+// Recording buffer of a tracking thread.
+typedef struct fla_field_thread_s {
+    real *rec;          // [3*n_cells] running DPM pass, NULL until the thread records into the layout
+    long steps;         // steps in rec (in traj with FLA_FIELD_INCREMENTAL)
+#ifdef FLA_FIELD_INCREMENTAL
+    fla_trajs_t traj;   // contributions of the trajectories the thread tracks
+#endif
+} fla_field_thread_t;
+
+static vap_registry_t fla_field_threads;
+static VAP_THREAD_LOCAL fla_field_thread_t *fla_field_mine = NULL;
+
+// The recording buffer of the calling thread, NULL if out of memory.
+static fla_field_thread_t *fla_field_thread(void)
+{
+    if (fla_field_mine == NULL) {
+        fla_field_mine = vap_registry_new(&fla_field_threads, sizeof(fla_field_thread_t));
     }
+    fla_field_thread_t *m = fla_field_mine;
+#ifndef FLA_FIELD_INCREMENTAL
+    if (m != NULL && m->rec == NULL) {
+        m->rec = calloc(3*MAX(fla_field.n_cells, 1), sizeof(real));
+        if (m->rec == NULL) {
+            Message("ALARM!!! Out of memory for the FLA fields\n");
+            return NULL;
+        }
+    }
+#endif
+    return m;
+}
 
-    real T_eff = c->temp - tot_vap_rate*L_eff / PI / Dp / Nu / kgas;
-    real h0 = kgas*Nu*0.5 / k_eff - 1.0;
-    real zeta = (h0 + 1.0)*T_eff;
-    real kappa = k_eff / (C_pl*P_RHO(p)*0.25*Dp*Dp);
+// Node-local number of cell c of thread t, -1 if it is not an interior fluid cell.
+int fla_field_index(cell_t c, Thread *t)
+{
+    for (int z = 0; z < fla_field.n_zones; z++) {
+        if (fla_field.zone[z] == t) {
+            return c < fla_field.offset[z + 1] - fla_field.offset[z] ? fla_field.offset[z] + c : -1;
+        }
+    }
+    return -1;
+}
 
-	real lambda[N_Lambda];
-	for (int i = 0; i < N_Lambda; i++) { lambda[i] = -1.0; }
-    int err = Lambda(h0, lambda);
+// Accounts a particle step in its cell, called by Diesel_droplet.
+void fla_field_record(Tracked_Particle *p, cell_t c, Thread *t)
+{
+    int i = fla_field.work != NULL ? fla_field_index(c, t) : -1;
+    fla_field_thread_t *m = i >= 0 ? fla_field_thread() : NULL;
+    if (m == NULL) {
+        return;
+    }
+#ifdef FLA_FIELD_INCREMENTAL
+    fla_traj_step(&m->traj, P_ID(p), fla_field.pass, i, N_P(p), P_DT(p));
+#else
+    real *r = &m->rec[3*i];
+    r[0] += N_P(p)*P_DT(p);
+    r[1] = MAX(r[1], N_P(p));
+    r[2] += P_DT(p);
+#endif
+    m->steps++;
+}
 
-	real series[N_Lambda];
-    for (int i = 0; i < N_Lambda; i++) { series[i] = 0.e-15; }
+// Fields from the sums of a pass, see FLA field; pure function of its arguments.
+void fla_field_reconstruct(int n, const int adj_start[], const int adj[], const real sums[], real out[])
+{
+    for (int i = 0; i < n; i++) {
+        out[3*i + 0] = sums[3*i + 2] > 0.0 ? sums[3*i + 0] / sums[3*i + 2] : -1.0;
+        out[3*i + 1] = sums[3*i + 1];
+        out[3*i + 2] = sums[3*i + 2];
+    }
+    // Jacobi sweeps: an empty cell takes the mean of its filled neighbours
+    for (int sweep = 0; sweep < FLA_FIELD_SWEEPS; sweep++) {
+        int filled = 0;
+        for (int i = 0; i < n; i++) {
+            if (out[3*i] >= 0.0) {
+                continue;
+            }
+            real sum = 0.0;
+            int m = 0;
+            for (int k = adj_start[i]; k < adj_start[i + 1]; k++) {
+                real v = out[3*adj[k]];
+                if (v >= 0.0 && out[3*adj[k] + 2] >= 0.0) {
+                    sum += v;
+                    m++;
+                }
+            }
+            if (m > 0) {
+                out[3*i] = sum / m;
+                out[3*i + 2] = -1.0; // filled in this sweep, not a source yet
+                filled++;
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            if (out[3*i + 2] < 0.0) {
+                out[3*i + 2] = 0.0;
+            }
+        }
+        if (filled == 0) {
+            break;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        out[3*i] = MAX(out[3*i], 0.0);
+    }
+}
 
-	real I_n, b_n;
-	for (int i = 0; i < N_Lambda; i++) {
-        b_n = 0.5*(1.0 + h0 / (h0*h0 + lambda[i] * lambda[i]));
-        I_n = 0.e-15;
-        I_n = P_USER_REAL(p, 4 * nc + 7 + N_INT)*sin(lambda[i]);
-        for (int j = 1; j < N_INT; j += 2) {
-            I_n += 4.0 * P_USER_REAL(p, 4 * nc + 7 + j)*(((double)j)*Delta_R)*sin(lambda[i] * ((double)j)*Delta_R);
+#ifdef FLA_FIELD_THREAD
+static void *fla_field_helper(void *arg)
+{
+    pthread_mutex_lock(&fla_field_lock);
+    for (;;) {
+        while (!fla_field.busy && !fla_field.stop) {
+            pthread_cond_wait(&fla_field_cond, &fla_field_lock);
         }
-        for (int j = 2; j < N_INT; j += 2) {
-            I_n += 2.0 * P_USER_REAL(p, 4 * nc + 7 + j)*(((double)j)*Delta_R)*sin(lambda[i] * ((double)j)*Delta_R);
+        if (fla_field.stop) {
+            break;
         }
-        I_n = I_n*Delta_R / 3.0;
-        series[i] = (I_n - sin(lambda[i]) / lambda[i] / lambda[i] * zeta)*exp(0.0 - kappa*lambda[i] * lambda[i] * P_DT(p)) / b_n;
+        pthread_mutex_unlock(&fla_field_lock);
+        fla_field_reconstruct(fla_field.n_cells, fla_field.adj_start, fla_field.adj, fla_field.work, fla_field.back);
+        pthread_mutex_lock(&fla_field_lock);
+        fla_field.busy = 0;
+        fla_field.done = 1;
+        pthread_cond_broadcast(&fla_field_cond);
     }
+    pthread_mutex_unlock(&fla_field_lock);
+    return NULL;
+}
+#endif
 
-    for (int j = 0; j < N_INT + 1; j++) { P_USER_REAL(p, 4 * nc + 7 + j) = T_eff; }
-    for (int i = 0; i < N_Lambda; i++)  {
-        P_USER_REAL(p, 4 * nc + 7) += series[i] * lambda[i];
-        for (int j = 1; j < N_INT + 1; j++) {
-            P_USER_REAL(p, 4 * nc + 7 + j) += series[i] * sin(lambda[i] * ((double)j)*Delta_R) / (((double)j)*Delta_R);
+// Waits until the helper is idle.
+static void fla_field_wait(void)
+{
+#ifdef FLA_FIELD_THREAD
+    if (fla_field.running) {
+        pthread_mutex_lock(&fla_field_lock);
+        while (fla_field.busy) {
+            pthread_cond_wait(&fla_field_cond, &fla_field_lock);
         }
+        pthread_mutex_unlock(&fla_field_lock);
     }
-    // Now we know temperature at each layer
+#endif
+}
 
-    // Re-calculate droplet avarage temperature T_av
-    Tp = P_USER_REAL(p, 4 * nc + 7 + N_INT);
-    T_av = Tp;
-    for (int j = 1; j < N_INT; j += 2) {
-        T_av += 4.0 * P_USER_REAL(p, 4 * nc + 7 + j)*(((double)j)*Delta_R)*(((double)j)*Delta_R);
+// 1 if the helper is reconstructing.
+static int fla_field_busy(void)
+{
+    int busy = fla_field.busy;
+#ifdef FLA_FIELD_THREAD
+    if (fla_field.running) {
+        pthread_mutex_lock(&fla_field_lock);
+        busy = fla_field.busy;
+        pthread_mutex_unlock(&fla_field_lock);
+    }
+#endif
+    return busy;
+}
+
+// Makes finished fields the front ones; returns 1 if there were any.
+static int fla_field_collect(void)
+{
+    int fresh = 0;
+#ifdef FLA_FIELD_THREAD
+    if (fla_field.running) {
+        pthread_mutex_lock(&fla_field_lock);
     }
-    for (int j = 2; j < N_INT; j += 2) {
-        T_av += 2.0 * P_USER_REAL(p, 4 * nc + 7 + j)*(((double)j)*Delta_R)*(((double)j)*Delta_R);
+#endif
+    if (fla_field.done) {
+        real *tmp = fla_field.front;
+        fla_field.front = fla_field.back;
+        fla_field.back = tmp;
+        fla_field.done = 0;
+        fresh = 1;
     }
-    T_av = T_av*Delta_R;
+#ifdef FLA_FIELD_THREAD
+    if (fla_field.running) {
+        pthread_mutex_unlock(&fla_field_lock);
+    }
+#endif
+    return fresh;
+}
 
-    //-------------------------------------------------------------------------
-    // update Fluent variables using our values
-    p->state.temp = T_av;
-    //p->source.htc = Nu*kgas*P_DIAM(p);
-    p->source.htc = 0.e-15;  // htc - heat transfer coefficient
-    
-    // evaporation rates - source terms, droplet mass
-    for (int ns = 0; ns < nc; ns++) {
-        /* gas species index of vaporization */
-        int gas_index = TP_COMPONENT_INDEX_I(p, ns);
-        if (gas_index >= 0) {
-            real vap_rate = P_USER_REAL(p, nc + ns) * tot_vap_rate / Ys_tot; //!!
+static void fla_field_free(void)
+{
+    free(fla_field.adj_start); free(fla_field.adj);
+    free(fla_field.work); free(fla_field.back); free(fla_field.front);
+    fla_field.adj_start = fla_field.adj = NULL;
+    fla_field.work = fla_field.back = fla_field.front = NULL;
+    fla_field.n_zones = fla_field.n_cells = 0;
+    fla_field.done = 0;
+    // the threads allocate their buffers anew for the next layout
+    for (int k = 0; k < VAP_REGISTRY_N(&fla_field_threads); k++) {
+        fla_field_thread_t *m = fla_field_threads.obj[k];
+        if (m != NULL) {
+            free(m->rec);
+            m->rec = NULL;
+            m->steps = 0;
+#ifdef FLA_FIELD_INCREMENTAL
+            fla_trajs_free(&m->traj); // the lists hold cell numbers
+#endif
+        }
+    }
+#ifdef FLA_FIELD_INCREMENTAL
+    fla_field.passes = 0;
+#endif
+}
 
-            // ANSYS stuff
-            if ((!p->in_rk) && (ABS(vap_rate)>0.)) {
-                p->limiting_time = MIN(p->limiting_time, dpm_par.fractional_change_factor_mass*P_MASS(p) / vap_rate*TP_COMPONENT_I(p, ns));
+// (Re)builds the cell numbering and the neighbours if the mesh of the node
+// has changed; the helper must be idle. Returns 1 if it was rebuilt.
+static int fla_field_layout(Domain *d)
+{
+    Thread *t;
+    int n_zones = 0, n = 0, same = 1;
+    thread_loop_c(t, d) {
+        if (FLUID_THREAD_P(t) && n_zones < FLA_FIELD_MAX_ZONES) {
+            same = same && n_zones < fla_field.n_zones && fla_field.zone[n_zones] == t
+                   && fla_field.offset[n_zones + 1] - fla_field.offset[n_zones] == THREAD_N_ELEMENTS_INT(t);
+            n += THREAD_N_ELEMENTS_INT(t);
+            n_zones++;
+        }
+    }
+    if (same && n_zones == fla_field.n_zones && fla_field.work != NULL) {
+        return 0;
+    }
+    fla_field_free();
+    n_zones = 0;
+    n = 0;
+    thread_loop_c(t, d) {
+        if (FLUID_THREAD_P(t) && n_zones < FLA_FIELD_MAX_ZONES) {
+            fla_field.zone[n_zones] = t;
+            fla_field.offset[n_zones] = n;
+            n += THREAD_N_ELEMENTS_INT(t);
+            n_zones++;
+        }
+    }
+    fla_field.n_zones = n_zones;
+    fla_field.offset[n_zones] = n;
+    fla_field.n_cells = n;
+
+    // neighbours over the interior faces between fluid cells of the node
+    Thread *tf;
+    face_t f;
+    fla_field.adj_start = calloc(n + 1, sizeof(int));
+    for (int pass = 0; pass < 2 && fla_field.adj_start != NULL; pass++) {
+        thread_loop_f(tf, d) {
+            if (BOUNDARY_FACE_THREAD_P(tf)) {
+                continue;
+            }
+            begin_f_loop(f, tf) {
+                int i0 = fla_field_index(F_C0(f, tf), THREAD_T0(tf));
+                int i1 = fla_field_index(F_C1(f, tf), THREAD_T1(tf));
+                if (i0 >= 0 && i1 >= 0) {
+                    if (pass == 0) {
+                        fla_field.adj_start[i0 + 1]++;
+                        fla_field.adj_start[i1 + 1]++;
+                    } else {
+                        fla_field.adj[fla_field.adj_start[i0]++] = i1;
+                        fla_field.adj[fla_field.adj_start[i1]++] = i0;
+                    }
+                }
+            } end_f_loop(f, tf)
+        }
+        if (pass == 0) {
+            for (int i = 0; i < n; i++) {
+                fla_field.adj_start[i + 1] += fla_field.adj_start[i];
+            }
+            fla_field.adj = malloc(MAX(fla_field.adj_start[n], 1)*sizeof(int));
+            if (fla_field.adj == NULL) {
+                break;
+            }
+        } else {
+            // the fill has advanced every start to the next one
+            for (int i = n; i > 0; i--) {
+                fla_field.adj_start[i] = fla_field.adj_start[i - 1];
             }
+            fla_field.adj_start[0] = 0;
+        }
+    }
+    fla_field.work = calloc(3*MAX(n, 1), sizeof(real));
+    fla_field.back = calloc(3*MAX(n, 1), sizeof(real));
+    fla_field.front = calloc(3*MAX(n, 1), sizeof(real));
+    if (!fla_field.adj_start || !fla_field.adj || !fla_field.work || !fla_field.back || !fla_field.front) {
+        Message("ALARM!!! Out of memory for the FLA fields\n");
+        fla_field_free();
+    }
+    return 1;
+}
 
-            P_USER_REAL(p, 2 * nc + ns) = vap_rate;
-            dydt[1 + ns] -= vap_rate;
+// Writes the front fields into the UDMs.
+static void fla_field_publish(void)
+{
+    FLA_TRACE_SPAN_START(t0);
+    cell_t c;
+    for (int z = 0; z < fla_field.n_zones; z++) {
+        Thread *t = fla_field.zone[z];
+        begin_c_loop_int(c, t) {
+            const real *v = &fla_field.front[3*(fla_field.offset[z] + c)];
+            for (int k = 0; k < 3; k++) {
+                C_UDMI(c, t, FLA_FIELD_UDM + k) = v[k];
+            }
+        } end_c_loop_int(c, t)
+    }
+    FLA_TRACE_SPAN_STOP("field_publish", t0);
+}
+#endif // FLA_FIELD
 
-            {
-                int source_index = injection_par.yi2s[gas_index];
-                if (source_index >= 0) {
-                    dzdt->species[source_index] += vap_rate;
-                    //p->source.mtc[source_index] = c->rho * Ap * Sh_Star * D / Dp;
-                    p->source.mtc[source_index] = c->rho * PI * Dp * Sh_Star * D;
-                }
+// Publishes the fields reconstructed since the last call and hands the
+// buffer of a DPM pass that has finished since then to the helper.
+DEFINE_ADJUST(fla_field_adjust, d)
+{
+#if defined(FLA_FIELD) && !RP_HOST
+    if (N_UDM < FLA_FIELD_UDM + 3) {
+        Message("ALARM!!! FLA_FIELD needs %d UDMs\n", FLA_FIELD_UDM + 3);
+        return;
+    }
+#ifdef FLA_FIELD_THREAD
+    if (!fla_field.started) {
+        fla_field.started = 1;
+        fla_field.running = pthread_create(&fla_field.thread, NULL, fla_field_helper, NULL) == 0;
+    }
+#endif
+    long steps = 0;
+    for (int k = 0; k < VAP_REGISTRY_N(&fla_field_threads); k++) {
+        fla_field_thread_t *m = fla_field_threads.obj[k];
+        steps += m != NULL ? m->steps : 0;
+    }
+    if (steps > 0) {
+        fla_field_wait(); // still on the pass before, the gas phase iterated too little
+    }
+    if (fla_field_collect()) {
+        fla_field_publish();
+    }
+    if (!fla_field_busy() && fla_field_layout(d)) {
+        return; // new numbering, the next pass records into it
+    }
+    if (steps == 0 || fla_field.work == NULL) {
+        return;
+    }
+#ifdef FLA_FIELD_INCREMENTAL
+    // a DPM pass has finished and the helper is idle: update the sums it reads
+    // by the trajectories that changed, hand them over only if there were any
+    int rebuild = fla_field.passes % FLA_FIELD_REBUILD == 0;
+    if (rebuild) {
+        memset(fla_field.work, 0, 3*MAX(fla_field.n_cells, 1)*sizeof(real));
+    }
+    int changed = 0;
+    for (int k = 0; k < VAP_REGISTRY_N(&fla_field_threads); k++) {
+        fla_field_thread_t *m = fla_field_threads.obj[k];
+        if (m != NULL) {
+            long entries;
+            changed += fla_traj_apply(&m->traj, fla_field.pass, fla_field.work, rebuild, &entries);
+            m->steps = 0;
+        }
+    }
+    fla_field.pass++;
+    fla_field.passes++;
+    if (changed == 0 && !rebuild) {
+        return;
+    }
+#else
+    // a DPM pass has finished and the helper is idle: combine the threads'
+    // sums for it, the next pass records into zeros
+    real *w = fla_field.work;
+    int n = fla_field.n_cells;
+    memset(w, 0, 3*MAX(n, 1)*sizeof(real));
+    for (int k = 0; k < VAP_REGISTRY_N(&fla_field_threads); k++) {
+        fla_field_thread_t *m = fla_field_threads.obj[k];
+        if (m == NULL || m->rec == NULL) {
+            continue;
+        }
+        if (m->steps > 0) {
+            for (int i = 0; i < n; i++) {
+                w[3*i] += m->rec[3*i];
+                w[3*i + 1] = MAX(w[3*i + 1], m->rec[3*i + 1]);
+                w[3*i + 2] += m->rec[3*i + 2];
             }
+            memset(m->rec, 0, 3*MAX(n, 1)*sizeof(real));
         }
+        m->steps = 0;
     }
-    
-    // Keep particle temperature independent form Fluent's source term.
-    // source terms for energy equations: zero, as Temperature is calculated explicitly
-    dydt[0] = 0.e-15;
+#endif
+#ifdef FLA_FIELD_THREAD
+    if (fla_field.running) {
+        pthread_mutex_lock(&fla_field_lock);
+        fla_field.busy = 1;
+        pthread_cond_broadcast(&fla_field_cond);
+        pthread_mutex_unlock(&fla_field_lock);
+        return;
+    }
+#endif
+    fla_field_reconstruct(fla_field.n_cells, fla_field.adj_start, fla_field.adj, fla_field.work, fla_field.back);
+    fla_field.done = 1;
+    fla_field_collect();
+    fla_field_publish();
+#endif
+}
 
-    real dh_dt = Nu * kgas * Ap / Dp * (c->temp - T_av);
-    dzdt->energy -= dh_dt;
+// Stops the helper and frees the buffers before the library is unloaded.
+DEFINE_EXECUTE_AT_EXIT(fla_field_at_exit)
+{
+#if defined(FLA_FIELD) && !RP_HOST
+#ifdef FLA_FIELD_THREAD
+    if (fla_field.running) {
+        pthread_mutex_lock(&fla_field_lock);
+        fla_field.stop = 1;
+        pthread_cond_broadcast(&fla_field_cond);
+        pthread_mutex_unlock(&fla_field_lock);
+        pthread_join(fla_field.thread, NULL);
+        fla_field.running = 0;
+    }
+#endif
+    fla_field_free();
+#endif
+}
+// END FLA field
 
-    //-------------------------------------------------------------------------
-    // ANSYS stuff
-    real h = Nu * kgas / Dp;
-	real mp = P_MASS(p);
-    real convective_heating_rate = h * Ap / (mp * p->Cp);
+// BEGIN FLA accumulator UDMs
+// With FLA_ACC, Diesel_droplet adds every step to the FLA cell accumulators of
+// its thread, and fla_acc_adjust merges them after a DPM pass and writes the
+// fields of the pass into the UDMs FLA_ACC_UDM + 0..6 of the touched cells:
+// residence time, mean N_P, heat and vapour mass given to the gas (N_P
+// weighted, per pass), steps, N_P-weighted mean diameter and T_av. The cells
+// of the pass before are cleared first, so no loop runs over the mesh. The
+// report compares memory and cell updates with full-mesh arrays per thread.
+#ifdef FLA_ACC
+static struct {
+    fla_acc_t pass[2];                      // merged sums; pass[last] is in the UDMs
+    int last;
+} fla_acc;
 
-    /* limit for higher heating rate */
-    if ((!p->in_rk) && (ABS(convective_heating_rate)>DPM_SMALL)) {
-            real factor = dpm_par.fractional_change_factor_heat;
-            if (ABS(c->temp - Tp)>Tp) {
-                factor = dpm_par.fractional_change_factor_heat*Tp / (c->temp - Tp);
-            }
-            p->limiting_time = MIN(p->limiting_time, factor / ABS(convective_heating_rate));
+static vap_registry_t fla_acc_threads;      // tables of the node's threads that record steps
+static VAP_THREAD_LOCAL fla_acc_t *fla_acc_mine = NULL;
+
+// The table of the calling thread, NULL if it cannot be allocated.
+static fla_acc_t *fla_acc_get(void)
+{
+    if (fla_acc_mine == NULL) {
+        fla_acc_mine = vap_registry_new(&fla_acc_threads, sizeof(fla_acc_t));
     }
-    
-    //-------------------------------------------------------------------------
-    // update user reals
-    P_USER_REAL(p, 4 * nc + 2) = BM;
-    P_USER_REAL(p, 4 * nc + 3) = BT;
-    P_USER_REAL(p, 4 * nc + 4) = L_eff; // used in temperature calculations
-    //P_USER_REAL(p, 4 * nc + 5) = P_DIAM(p);
-    //P_USER_REAL(p, 4 * nc + 6) = Dp;
-    P_USER_REAL(p, 4 * nc + 5) = Nu; //used in temperature calculations
-    P_USER_REAL(p, 4 * nc + 6) = T_av;
+    return fla_acc_mine;
+}
 
-    P_USER_REAL(p, 4 * nc + 7 + N_INT + 1) = coef;
-    P_USER_REAL(p, 4 * nc + 7 + N_INT + 2) = Nu_star;
-    P_USER_REAL(p, 4 * nc + 7 + N_INT + 3) = D;
-    P_USER_REAL(p, 4 * nc + 7 + N_INT + 4) = kgas;
-    P_USER_REAL(p, 3 * nc + 0) = h;
-    
-    P_VAP_dhdt(p) = dh_dt;
-    // FIXME under assumpmtion of mono-component droplet
-    P_VAP_dmdt(p) = -dydt[1];
+// Accounts a particle step in its cell, called by Diesel_droplet.
+void fla_acc_record(Tracked_Particle *p, cell_t c, Thread *t)
+{
+    fla_acc_t *a = fla_acc_get();
+    real *v = a != NULL ? fla_acc_cell(a, FLA_ACC_KEY(c, t)) : NULL;
+    if (v == NULL) {
+        return;
+    }
+    real dt = P_DT(p);
+    real n_dt = N_P(p)*dt;
+    v[FLA_ACC_W] += dt;
+    v[FLA_ACC_N_P] += n_dt;
+    v[FLA_ACC_HEAT] += P_VAP_dhdt_scaled(p)*dt;
+    v[FLA_ACC_MASS] += P_VAP_dmdt_scaled(p)*dt;
+    v[FLA_ACC_STEPS] += 1.0;
+    v[FLA_ACC_D] += n_dt*P_DIAM(p);
+    v[FLA_ACC_T] += n_dt*P_USER_REAL(p, VAP_I_T_AV);
+}
+
+// Writes the fields of the cells of a into the UDMs, zeros with clear != 0.
+static void fla_acc_scatter(Domain *d, const fla_acc_t *a, int clear)
+{
+    for (int k = 0; k < a->n; k++) {
+        int s = a->touched[k];
+        Thread *t = Lookup_Thread(d, (int)(a->key[s] >> 32));
+        cell_t c = (cell_t)(a->key[s] & 0xffffffff);
+        const real *v = &a->v[FLA_ACC_N*s];
+        real f[FLA_ACC_N] = { 0.0 };
+        if (!clear) {
+            real n = MAX(v[FLA_ACC_N_P], 1.e-30);
+            f[FLA_ACC_W] = v[FLA_ACC_W];
+            f[FLA_ACC_N_P] = v[FLA_ACC_W] > 0.0 ? v[FLA_ACC_N_P] / v[FLA_ACC_W] : 0.0;
+            f[FLA_ACC_HEAT] = v[FLA_ACC_HEAT];
+            f[FLA_ACC_MASS] = v[FLA_ACC_MASS];
+            f[FLA_ACC_STEPS] = v[FLA_ACC_STEPS];
+            f[FLA_ACC_D] = v[FLA_ACC_D] / n;
+            f[FLA_ACC_T] = v[FLA_ACC_T] / n;
+        }
+        for (int q = 0; q < FLA_ACC_N; q++) {
+            C_UDMI(c, t, FLA_ACC_UDM + q) = f[q];
+        }
+    }
+}
+#endif // FLA_ACC
+
+// Merges the accumulators of the DPM pass since the last call, if there was
+// one, into the UDMs and reports the cost against full-mesh arrays.
+DEFINE_ADJUST(fla_acc_adjust, d)
+{
+#if defined(FLA_ACC) && !RP_HOST
+    if (N_UDM < FLA_ACC_UDM + FLA_ACC_N) {
+        Message("ALARM!!! FLA_ACC needs %d UDMs\n", FLA_ACC_UDM + FLA_ACC_N);
+        return;
+    }
+    double t0 = vap_wtime();
+    fla_acc_t *next = &fla_acc.pass[1 - fla_acc.last];
+    fla_acc_clear(next);
+    // sums: touched cells of the threads, of the pass, of the pass before;
+    // memory of the tables and of full-mesh arrays per thread; cells
+    real n[6] = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+    int ok = 1;
+    int n_threads = 0;
+    for (int k = 0; k < VAP_REGISTRY_N(&fla_acc_threads); k++) {
+        fla_acc_t *a = fla_acc_threads.obj[k];
+        if (a == NULL) {
+            continue;
+        }
+        n[0] += a->n;
+        n[3] += fla_acc_bytes(a);
+        ok = ok && fla_acc_merge(next, a) == 0;
+        fla_acc_clear(a);
+        n_threads++;
+    }
+    if (!ok) {
+        Message("ALARM!!! FLA_ACC: out of memory, the fields of this pass are incomplete\n");
+    }
+    fla_acc_t *prev = &fla_acc.pass[fla_acc.last];
+    int pass = next->n > 0;
+    if (pass) {
+        fla_acc_scatter(d, prev, 1);
+        fla_acc_scatter(d, next, 0);
+        fla_acc.last = 1 - fla_acc.last;
+    }
+    Thread *t;
+    thread_loop_c(t, d) {
+        if (FLUID_THREAD_P(t)) {
+            n[5] += THREAD_N_ELEMENTS_INT(t);
+        }
+    }
+    n[1] = next->n;
+    n[2] = pass ? prev->n : 0.0;
+    n[3] += fla_acc_bytes(&fla_acc.pass[0]) + fla_acc_bytes(&fla_acc.pass[1]);
+    n[4] = (real)MAX(n_threads, 1)*n[5]*FLA_ACC_N*sizeof(real);
+    real wall = vap_wtime() - t0;
+    int log = 1;
+#if RP_NODE
+    real work[6];
+    FLA_TRACE_SPAN_START(t_red);
+    PRF_GRSUM(n, 6, work);
+    wall = PRF_GRHIGH1(wall);
+    FLA_TRACE_SPAN_STOP("acc_reduce", t_red);
+    log = I_AM_NODE_ZERO_P;
+#endif
+    if (n[1] > 0.0 && log) {
+        // dense: zero and reduce every thread's arrays, write every cell
+        real dense = (2.0*MAX(n_threads, 1) + 1.0)*n[5];
+        Message("FLA accumulators: %.0f of %.0f cells touched, %.3g MB (full-mesh arrays %.3g MB), "
+                "%.0f cell updates (full-mesh %.0f), merge and scatter %.3g s\n",
+                n[1], n[5], 1.e-6*n[3], 1.e-6*n[4], n[0] + n[1] + n[2], dense, wall);
+    }
+#endif
+}
+
+// Frees the tables of the threads and the merged sums before the library is unloaded.
+DEFINE_EXECUTE_AT_EXIT(fla_acc_at_exit)
+{
+#if defined(FLA_ACC) && !RP_HOST
+    for (int k = 0; k < VAP_REGISTRY_N(&fla_acc_threads); k++) {
+        fla_acc_t *a = fla_acc_threads.obj[k];
+        if (a != NULL) {
+            fla_acc_free(a);
+        }
+    }
+    vap_registry_free(&fla_acc_threads);
+    fla_acc_free(&fla_acc.pass[0]);
+    fla_acc_free(&fla_acc.pass[1]);
+#endif
 }
+// END FLA accumulator UDMs
 
 DEFINE_DPM_SCALAR_UPDATE(Diesel_droplet, cell, thread, initialize, p)
 {
@@ -761,28 +5019,38 @@ DEFINE_DPM_SCALAR_UPDATE(Diesel_droplet, cell, thread, initialize, p)
         //P_USER_REAL(p, 4 * nc + 7 + N_INT + 3) = ((real) t)/CLOCKS_PER_SEC;
         //P_USER_REAL(p, 4 * nc + 7 + N_INT + 4) = 0.0;
         // Message("Temperature initiated\n");
-        for (int i = FLA_OFFSET; i < FLA_OFFSET + FLA_N_SCAL; i++) {
-            P_USER_REAL(p, i) = 0;
-        }
-        J_DET(p) = 1.; N_P(p)   = 1.;
-        J11(p)   = 1.; J22(p)   = 1.;
+        real y[FLA_N_SCAL];
+        fla_init(y);
+        fla_update_user_real(y, p);
+#ifdef VAP_MULTIRATE
+        for (int i = 0; i < VAP_MR_N; i++) { P_USER_REAL(p, VAP_MR_OFFSET + i) = 0.0; }
+#endif
         // R_0(p) = 
     } else {
         // BEGIN FLA calculation 
-        // Compute jacobian along trajectory.
-        fla_rk4_step(p, cell, thread);
-        // Compute new determinant of the jacobian:
-        real div = J11(p)*J22(p) - J12(p)*J21(p);
-        // Check if jacobian changed sign:
-        if (signbit(J_DET(p)) != signbit(div)) {
-            N_J_SIGN(p)++;
-        }
-        J_DET(p) = div;
-        N_P(p)  = 1./fabs(div);
+        // Compute jacobian along trajectory, its determinant and number density.
+        FLA_TRACE_START(trace_t0);
+        vap_fluent_host_t f = { -1, NULL, NULL };
+        vap_host_t host = vap_fluent_host(&f);
+        vap_host_fla(&host, p);
+        FLA_TRACE_STOP(FLA_TRACE_FLA, trace_t0);
         // END FLA calculation 
         
         P_VAP_dhdt_scaled(p) = P_VAP_dhdt(p)*N_P(p);
         P_VAP_dmdt_scaled(p) = P_VAP_dmdt(p)*N_P(p);
+        vap_dpm_accumulate(p);
+#ifdef FLA_BALANCE
+        fla_balance_record(p);
+#endif
+#ifdef FLA_FIELD
+        fla_field_record(p, cell, thread);
+#endif
+#ifdef FLA_ACC
+        fla_acc_record(p, cell, thread);
+#endif
+#ifdef VAP_SAT_LIMIT
+        vap_sat_record(p, cell, thread);
+#endif
 
         //P_USER_REAL(p, 4 * nc + 7 + N_INT + 4) = ((real)t) / CLOCKS_PER_SEC - P_USER_REAL(p, 4 * nc + 7 + N_INT + 3);
         //
@@ -797,6 +5065,142 @@ DEFINE_DPM_TIMESTEP(Constant_dt, p, dt)
     return DPM_DT;
 }
 
+// Checkpoint side-files, see VAP checkpoint. Every compute node writes the
+// droplets it holds to VAP_CKPT_NAME-<myid>.bin; on reading, every node scans
+// all side-files for its own droplets (by id), so a restart may be
+// partitioned differently. Execute vap_ckpt_write after writing a data file
+// and vap_ckpt_read after reading it back (unsteady tracking; steady tracking
+// keeps no droplets between iterations).
+DEFINE_ON_DEMAND(vap_ckpt_write)
+{
+#if !RP_HOST
+    FLA_TRACE_SPAN_START(t0);
+    Injection *I;
+    Particle *p;
+    int64_t n = 0;
+    loop(I, Get_dpm_injections()) {
+        loop(p, I->p) { n++; }
+    }
+#if RP_NODE
+    int n_files = compute_node_count;
+#else
+    int n_files = 1;
+#endif
+    vap_ckpt_header_t h;
+    vap_ckpt_header_init(&h, n_files, n);
+    char name[256];
+    sprintf(name, "%s-%d.bin", VAP_CKPT_NAME, myid);
+    FILE *f = fopen(name, "wb");
+    if (f == NULL) {
+        Message("ALARM!!! Cannot open %s\n", name);
+        return;
+    }
+    fwrite(&h, sizeof(h), 1, f);
+    int size = vap_ckpt_record_size(&h);
+    unsigned char buf[VAP_CKPT_MAX_RECORD];
+    real u[VAP_N_USER_REALS];
+    loop(I, Get_dpm_injections()) {
+        loop(p, I->p) {
+            for (int i = 0; i < VAP_N_USER_REALS; i++) { u[i] = PP_USER_REAL(p, i); }
+            vap_ckpt_pack(buf, PP_ID(p), u);
+            fwrite(buf, size, 1, f);
+        }
+    }
+    fclose(f);
+    FLA_TRACE_SPAN_STOP("ckpt_write", t0);
+    real n_tot = (real)n;
+#if RP_NODE
+    FLA_TRACE_SPAN_START(t_red);
+    n_tot = PRF_GRSUM1(n_tot);
+    FLA_TRACE_SPAN_STOP("ckpt_reduce", t_red);
+    if (!I_AM_NODE_ZERO_P) {
+        return;
+    }
+#endif
+    Message("VAP checkpoint: %.0f droplets written to %s-*.bin, %d bytes per droplet\n", n_tot, VAP_CKPT_NAME, size);
+#endif
+}
+
+DEFINE_ON_DEMAND(vap_ckpt_read)
+{
+#if !RP_HOST
+    // the droplets of this node by id, open addressing
+    Injection *I;
+    Particle *p;
+    int n = 0;
+    loop(I, Get_dpm_injections()) {
+        loop(p, I->p) { n++; }
+    }
+    unsigned int mask = 15;
+    while (mask + 1 < 2u*(unsigned int)n) {
+        mask = 2*mask + 1;
+    }
+    Particle **table = calloc(mask + 1, sizeof(Particle *));
+    if (table == NULL) {
+        Message("ALARM!!! Out of memory in vap_ckpt_read\n");
+        return;
+    }
+    loop(I, Get_dpm_injections()) {
+        loop(p, I->p) {
+            unsigned int k = (unsigned int)PP_ID(p)*2654435761u & mask;
+            while (table[k] != NULL) {
+                k = (k + 1) & mask;
+            }
+            table[k] = p;
+        }
+    }
+
+    int restored = 0;
+    int n_files = 1;
+    unsigned char buf[VAP_CKPT_MAX_RECORD];
+    real u[VAP_N_USER_REALS];
+    for (int i = 0; i < n_files; i++) {
+        char name[256];
+        sprintf(name, "%s-%d.bin", VAP_CKPT_NAME, i);
+        FILE *f = fopen(name, "rb");
+        vap_ckpt_header_t h;
+        if (f == NULL || fread(&h, sizeof(h), 1, f) != 1 || vap_ckpt_header_check(&h) != 0) {
+            Message("ALARM!!! Cannot read the checkpoint side-file %s\n", name);
+            if (f != NULL) {
+                fclose(f);
+            }
+            continue;
+        }
+        if (i == 0) {
+            n_files = h.n_files;
+        }
+        int size = vap_ckpt_record_size(&h);
+        for (int64_t r = 0; r < h.n_records && fread(buf, size, 1, f) == 1; r++) {
+            int32_t id;
+            memcpy(&id, buf, 4);
+            unsigned int k = (unsigned int)id*2654435761u & mask;
+            while (table[k] != NULL && PP_ID(table[k]) != id) {
+                k = (k + 1) & mask;
+            }
+            if (table[k] == NULL) {
+                continue;
+            }
+            p = table[k];
+            for (int l = 0; l < VAP_N_USER_REALS; l++) { u[l] = PP_USER_REAL(p, l); }
+            vap_ckpt_unpack(buf, &h, u);
+            for (int l = 0; l < VAP_N_USER_REALS; l++) { PP_USER_REAL(p, l) = u[l]; }
+            restored++;
+        }
+        fclose(f);
+    }
+    free(table);
+    int missing = n - restored;
+#if RP_NODE
+    restored = PRF_GISUM1(restored);
+    missing = PRF_GISUM1(missing);
+    if (!I_AM_NODE_ZERO_P) {
+        return;
+    }
+#endif
+    Message("VAP checkpoint: %d droplets restored from %s-*.bin, %d not found\n", restored, VAP_CKPT_NAME, missing);
+#endif
+}
+
 // BEGIN n-dodecane properties
 DEFINE_DPM_PROPERTY(Diesel_liquid_density, c, t, p, T)
 {
@@ -974,14 +5378,18 @@ DEFINE_DPM_HEAT_MASS(multivap_conv_diffusion_kl, p, Cp, hgas, hvap, cvap_surf, Z
     dif = 1.0;
     coef = c_p_die * rho_gas_s * D / kgas * Sh_Star;
     phi = 0.e-15;
-    while (dif > ACCURACY)
+    // capped as in vap_surface_balance(): close to the boiling point the
+    // iteration can cycle, the step then takes the last iterate
+    int bt_it = 0;
+    while (dif > ACCURACY && bt_it < BT_MAX_ITER)
     {
         FBT = pow(1.0 + BT, 0.7)*log(1.0 + BT) / BT;
         Nu_star = 2.0 + (pow(1.0 + Re*Pr, 1.0 / 3.0)*MAX(1.0, pow(Re, 0.077)) - 1.0) / FBT;
         phi = coef / Nu_star;
         BT = pow(1.0 + BM, phi) - 1.0;
-        dif = abs(BT - BT_i);
+        dif = fabs(BT - BT_i);
         BT_i = BT;
+        bt_it++;
     }
 
     Nu = log(1.0 + BT) * Nu_star / BT;
@@ -996,7 +5404,7 @@ DEFINE_DPM_HEAT_MASS(multivap_conv_diffusion_kl, p, Cp, hgas, hvap, cvap_surf, Z
     rel_vel = sqrt((c->V[0] - P_VEL(p)[0])*(c->V[0] - P_VEL(p)[0]) + (c->V[1] - P_VEL(p)[1])*(c->V[1] - P_VEL(p)[1]) + (c->V[2] - P_VEL(p)[2])*(c->V[2] - P_VEL(p)[2]));
     Pe = 12.69 / 16.0*P_RHO(p)*0.5*Dp* C_pl / k_l*rel_vel*c->mu / Visc_l*pow(Re, 1.0 / 3.0) / (1.0 + BM);
     k_eff = (1.86 + 0.86*tanh(2.225*log10(Pe / 30.0)))*k_l;
-    if (abs(Pe) < 1.e-12) k_eff = k_l;
+    if (fabs(Pe) < 1.e-12) k_eff = k_l;
 
     T_eff = c->temp - tot_vap_rate*L_eff / PI / Dp / Nu / kgas;
     h0 = kgas*Nu*0.5 / k_eff - 1.0;
@@ -1097,3 +5505,4 @@ DEFINE_DPM_HEAT_MASS(multivap_conv_diffusion_kl, p, Cp, hgas, hvap, cvap_surf, Z
     P_USER_REAL(p, 3 * nc + 0) = Pe;
     dydt[0] = 0.e-15;
 }
+#endif // FLA_VAP_STANDALONE